@@ -0,0 +1,141 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <strings.h>
+
+#include "bandwidth.h"
+#include "clients.h"
+#include "upnpglobalvars.h"
+
+#define REFILL_INTERVAL 20	/* milliseconds between refills */
+#define BURST_MS        100	/* most a bucket holds, in ms of the total rate */
+
+static struct timeval last_refill;
+
+static int
+client_weight(const struct client_cache_s *client)
+{
+	if (client->type && client->type->weight > 0)
+		return client->type->weight;
+	return 1;
+}
+
+int
+bandwidth_set_weight(const char *name, int weight)
+{
+	int i, found = 0;
+
+	for (i = 0; client_types[i].name; i++)
+	{
+		if (strcasecmp(client_types[i].name, name) != 0)
+			continue;
+		client_types[i].weight = weight;
+		found++;
+	}
+
+	return found;
+}
+
+long
+bandwidth_refill(const struct timeval *now)
+{
+	off_t rate, budget, burst, left, share;
+	long ms;
+	int i, weights, pass;
+
+	if (runtime_vars.max_bandwidth <= 0)
+		return -1;
+
+	/* only clients that are streaming get a share */
+	weights = 0;
+	for (i = 0; i < CLIENT_CACHE_SLOTS; i++)
+	{
+		if (clients[i].connections > 0)
+			weights += client_weight(&clients[i]);
+		else
+			clients[i].bucket.tokens = 0;
+	}
+	if (!weights)
+	{
+		last_refill = *now;
+		return -1;
+	}
+
+	ms = (now->tv_sec - last_refill.tv_sec) * 1000 +
+	     (now->tv_usec - last_refill.tv_usec) / 1000;
+	if (ms >= 0 && ms < REFILL_INTERVAL)
+		return REFILL_INTERVAL - ms;
+	/* the clock was stepped, or we've been busy for a while */
+	if (ms < 0 || ms > BURST_MS)
+		ms = BURST_MS;
+	last_refill = *now;
+
+	rate = (off_t)runtime_vars.max_bandwidth * 1024;
+	budget = rate * ms / 1000;
+	burst = rate * BURST_MS / 1000;
+
+	/* Share the budget out by weight.  A client whose bucket is full
+	 * isn't using its share, so what it leaves goes round again to
+	 * the clients that can use it. */
+	for (pass = 0; pass < 3 && budget > 0; pass++)
+	{
+		weights = 0;
+		for (i = 0; i < CLIENT_CACHE_SLOTS; i++)
+		{
+			if (clients[i].connections > 0 && clients[i].bucket.tokens < burst)
+				weights += client_weight(&clients[i]);
+		}
+		if (!weights)
+			break;
+		left = budget;
+		for (i = 0; i < CLIENT_CACHE_SLOTS; i++)
+		{
+			if (clients[i].connections <= 0 || clients[i].bucket.tokens >= burst)
+				continue;
+			share = budget * client_weight(&clients[i]) / weights;
+			if (share > burst - clients[i].bucket.tokens)
+				share = burst - clients[i].bucket.tokens;
+			clients[i].bucket.tokens += share;
+			left -= share;
+		}
+		budget = left;
+	}
+
+	return REFILL_INTERVAL;
+}
+
+off_t
+bandwidth_limit(struct client_cache_s *client, off_t len)
+{
+	if (runtime_vars.max_bandwidth <= 0 || !client)
+		return len;
+	if (client->bucket.tokens <= 0)
+		return 0;
+	return (len < client->bucket.tokens) ? len : client->bucket.tokens;
+}
+
+void
+bandwidth_charge(struct client_cache_s *client, off_t len)
+{
+	if (runtime_vars.max_bandwidth <= 0 || !client)
+		return;
+	client->bucket.tokens -= len;
+}
@@ -0,0 +1,55 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BANDWIDTH_H__
+#define __BANDWIDTH_H__
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+struct client_cache_s;
+
+/* Token bucket of a client.  While max_bandwidth is set, the total
+ * rate is shared out between the clients that are streaming, in
+ * proportion to the weight of their client type. */
+struct bucket {
+	off_t tokens;		/* bytes the client may send right now */
+};
+
+/* bandwidth_set_weight()
+ * set the weight of the client types called name; returns how many
+ * client_types[] entries matched */
+int
+bandwidth_set_weight(const char *name, int weight);
+
+/* bandwidth_refill()
+ * hand out the tokens accrued since the last call; returns the number
+ * of milliseconds until the next refill is due, or -1 if none is */
+long
+bandwidth_refill(const struct timeval *now);
+
+/* bandwidth_limit()
+ * how much of len the client may send now; 0 if it has to wait */
+off_t
+bandwidth_limit(struct client_cache_s *client, off_t len);
+
+/* bandwidth_charge()
+ * the client has sent len bytes */
+void
+bandwidth_charge(struct client_cache_s *client, off_t len);
+
+#endif
@@ -0,0 +1,204 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "browsecache.h"
+#include "upnpglobalvars.h"
+#include "log.h"
+
+#define BROWSECACHE_BUCKETS 256
+
+struct browsecache_entry {
+	char *key;
+	unsigned int hash;
+	char *data;
+	size_t len;
+	LIST_ENTRY(browsecache_entry) entries;
+	TAILQ_ENTRY(browsecache_entry) lru;	/* most recently used first */
+};
+
+static LIST_HEAD(, browsecache_entry) buckets[BROWSECACHE_BUCKETS];
+static TAILQ_HEAD(browsecache_lru, browsecache_entry) lru = TAILQ_HEAD_INITIALIZER(lru);
+static uint32_t cache_update_id;
+static size_t cache_total;
+static unsigned long hits, misses;
+/* Browse requests are answered on the worker threads */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int
+key_hash(const char *key)
+{
+	unsigned int h = 5381;
+
+	while (*key)
+		h = h * 33 + (unsigned char)*key++;
+
+	return h;
+}
+
+static size_t
+entry_size(const struct browsecache_entry *e)
+{
+	return sizeof(*e) + strlen(e->key) + 1 + e->len;
+}
+
+static void
+free_entry(struct browsecache_entry *e)
+{
+	free(e->key);
+	free(e->data);
+	free(e);
+}
+
+static void
+remove_entry(struct browsecache_entry *e)
+{
+	cache_total -= entry_size(e);
+	LIST_REMOVE(e, entries);
+	TAILQ_REMOVE(&lru, e, lru);
+	free_entry(e);
+}
+
+/* Everything cached was rendered from an older library once
+ * SystemUpdateID has changed */
+static void
+check_update_id(void)
+{
+	struct browsecache_entry *e;
+
+	if (cache_update_id == updateID)
+		return;
+	if (cache_total)
+		DPRINTF(E_DEBUG, L_HTTP, "SystemUpdateID is now %u; dropping %zu bytes of Browse responses\n",
+			updateID, cache_total);
+	while ((e = TAILQ_FIRST(&lru)) != NULL)
+		remove_entry(e);
+	cache_update_id = updateID;
+}
+
+static struct browsecache_entry *
+find_entry(const char *key, unsigned int hash)
+{
+	struct browsecache_entry *e;
+
+	LIST_FOREACH(e, &buckets[hash % BROWSECACHE_BUCKETS], entries)
+	{
+		if (e->hash == hash && strcmp(e->key, key) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+char *
+browsecache_get(const char *key, size_t *len)
+{
+	struct browsecache_entry *e;
+	unsigned int hash;
+	char *data = NULL;
+
+	if (runtime_vars.browse_cache_size <= 0)
+		return NULL;
+	hash = key_hash(key);
+	pthread_mutex_lock(&cache_lock);
+	check_update_id();
+	e = find_entry(key, hash);
+	if (e)
+	{
+		data = malloc(e->len);
+		if (data)
+		{
+			memcpy(data, e->data, e->len);
+			*len = e->len;
+			TAILQ_REMOVE(&lru, e, lru);
+			TAILQ_INSERT_HEAD(&lru, e, lru);
+		}
+	}
+	if (data)
+		hits++;
+	else
+		misses++;
+	pthread_mutex_unlock(&cache_lock);
+
+	return data;
+}
+
+size_t
+browsecache_max_entry(void)
+{
+	if (runtime_vars.browse_cache_size <= 0)
+		return 0;
+	return (size_t)runtime_vars.browse_cache_size * 1024 / 4;
+}
+
+void
+browsecache_put(const char *key, uint32_t update_id, const char *data, size_t len)
+{
+	struct browsecache_entry *e, *old;
+	size_t limit = (size_t)runtime_vars.browse_cache_size * 1024;
+
+	if (runtime_vars.browse_cache_size <= 0 || len > browsecache_max_entry())
+		return;
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return;
+	e->key = strdup(key);
+	e->data = malloc(len);
+	if (!e->key || !e->data)
+	{
+		free_entry(e);
+		return;
+	}
+	memcpy(e->data, data, len);
+	e->len = len;
+	e->hash = key_hash(key);
+
+	pthread_mutex_lock(&cache_lock);
+	check_update_id();
+	/* rendered from a library that has changed since */
+	if (update_id != cache_update_id)
+	{
+		pthread_mutex_unlock(&cache_lock);
+		free_entry(e);
+		return;
+	}
+	old = find_entry(key, e->hash);
+	if (old)
+		remove_entry(old);
+	LIST_INSERT_HEAD(&buckets[e->hash % BROWSECACHE_BUCKETS], e, entries);
+	TAILQ_INSERT_HEAD(&lru, e, lru);
+	cache_total += entry_size(e);
+	while (cache_total > limit)
+		remove_entry(TAILQ_LAST(&lru, browsecache_lru));
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void
+browsecache_stats(unsigned long *h, unsigned long *m, size_t *bytes)
+{
+	pthread_mutex_lock(&cache_lock);
+	*h = hits;
+	*m = misses;
+	*bytes = cache_total;
+	pthread_mutex_unlock(&cache_lock);
+}
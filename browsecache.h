@@ -0,0 +1,51 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BROWSECACHE_H__
+#define __BROWSECACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Rendered Browse responses, kept until SystemUpdateID moves on.
+ * The key is the normalized request: object, range, sort order and
+ * the client's filter, response flags, interface and passwords.
+ * Search keeps the list of objects its criteria matched here too,
+ * under keys starting with "S/". */
+
+/* browsecache_get()
+ * return a malloc()ed copy of the response cached under key, setting
+ * its length, or NULL if there is none for the current SystemUpdateID */
+char *
+browsecache_get(const char *key, size_t *len);
+
+/* browsecache_put()
+ * cache a response that was built while SystemUpdateID was update_id */
+void
+browsecache_put(const char *key, uint32_t update_id, const char *data, size_t len);
+
+/* browsecache_max_entry()
+ * the largest response that would be kept, or 0 if none would */
+size_t
+browsecache_max_entry(void);
+
+/* browsecache_stats()
+ * lookups answered from the cache and not, and the bytes it holds */
+void
+browsecache_stats(unsigned long *hits, unsigned long *misses, size_t *bytes);
+
+#endif
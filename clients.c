@@ -18,10 +18,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <sys/param.h>
 
 #include "clients.h"
 #include "event.h"
 #include "getifaddr.h"
+#include "upnpglobalvars.h"
 #include "log.h"
 
 struct client_type_s client_types[] =
@@ -364,3 +366,69 @@ AddClientCache(struct in_addr addr, int type)
 
 	return NULL;
 }
+
+/* Admission control.  Each client may only have so many streams and
+ * worker requests going at once.  Besides, once max_connections
+ * streams are open, the clients already holding more than an equal
+ * share of them are turned away, so that a newcomer still gets in. */
+static unsigned long admit_rejects[ADMIT_RESULTS];
+
+static enum admit_result
+admit_result(struct client_cache_s *client, enum admit_result result)
+{
+	if (result == ADMIT_OK)
+		return result;
+	admit_rejects[result]++;
+	client->rejected++;
+	DPRINTF(E_INFO, L_HTTP, "Turning away %s [%s]: %s\n",
+		client->type->name, inet_ntoa(client->addr),
+		result == ADMIT_CLIENT_STREAMS ? "too many streams" :
+		result == ADMIT_OVERLOAD ? "over its share of max_connections" :
+		"too many requests");
+
+	return result;
+}
+
+enum admit_result
+client_admit_stream(struct client_cache_s *client)
+{
+	int i, total = 0, active = 0;
+
+	if (!client)
+		return ADMIT_OK;
+	if (runtime_vars.max_client_streams > 0 &&
+	    client->connections >= runtime_vars.max_client_streams)
+		return admit_result(client, ADMIT_CLIENT_STREAMS);
+
+	for (i = 0; i < CLIENT_CACHE_SLOTS; i++)
+	{
+		if (clients[i].connections <= 0)
+			continue;
+		total += clients[i].connections;
+		active++;
+	}
+	if (total < runtime_vars.max_connections)
+		return ADMIT_OK;
+	if (!client->connections)
+		active++;
+	if (client->connections >= MAX(1, runtime_vars.max_connections / active))
+		return admit_result(client, ADMIT_OVERLOAD);
+
+	return ADMIT_OK;
+}
+
+enum admit_result
+client_admit_request(struct client_cache_s *client)
+{
+	if (client && runtime_vars.max_client_requests > 0 &&
+	    client->requests >= runtime_vars.max_client_requests)
+		return admit_result(client, ADMIT_CLIENT_REQUESTS);
+
+	return ADMIT_OK;
+}
+
+unsigned long
+client_admit_rejects(enum admit_result result)
+{
+	return admit_rejects[result];
+}
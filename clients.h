@@ -21,6 +21,8 @@
 #include <sys/time.h>
 #include <netinet/in.h>
 
+#include "bandwidth.h"
+
 #define CLIENT_CACHE_SLOTS 25
 
 /* Client capability/quirk flags */
@@ -91,6 +93,7 @@ struct client_type_s {
 	const char *name;
 	const char *match;
 	enum match_types match_type;
+	int weight;		/* share of max_bandwidth, 0 counts as 1 */
 };
 
 struct client_cache_s {
@@ -98,8 +101,20 @@ struct client_cache_s {
 	unsigned char mac[6];
 	struct client_type_s *type;
 	time_t age;
-	int connections;
+	int connections;	/* streams and forked children */
+	int requests;		/* requests queued for the worker threads */
+	unsigned long rejected;	/* requests turned away by client_admit_*() */
 	char *password;
+	struct bucket bucket;
+};
+
+/* Why client_admit_*() turned a request away */
+enum admit_result {
+	ADMIT_OK,
+	ADMIT_CLIENT_STREAMS,	/* over max_client_streams */
+	ADMIT_OVERLOAD,		/* over its share of max_connections */
+	ADMIT_CLIENT_REQUESTS,	/* over max_client_requests */
+	ADMIT_RESULTS
 };
 
 extern struct client_type_s client_types[];
@@ -108,4 +123,11 @@ extern struct client_cache_s clients[CLIENT_CACHE_SLOTS];
 struct client_cache_s *SearchClientCache(struct in_addr addr, int quiet);
 struct client_cache_s *AddClientCache(struct in_addr addr, int type);
 
+/* May the client open another stream, or queue another request?
+ * Requests from unknown clients are always admitted. */
+enum admit_result client_admit_stream(struct client_cache_s *client);
+enum admit_result client_admit_request(struct client_cache_s *client);
+/* How often each admission limit was hit */
+unsigned long client_admit_rejects(enum admit_result result);
+
 #endif
@@ -0,0 +1,197 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "didl.h"
+
+/* '<' (0x3C) and '>' (0x3E) differ only in bit 1, '"' (0x22) and '&'
+ * (0x26) only in bit 2, so two compares find all four characters. */
+#define IS_SPECIAL(c) ((((c) | 0x02) == '>') || (((c) | 0x04) == '&'))
+
+size_t
+xml_special_span(const char *s, size_t len)
+{
+	size_t i = 0;
+#if defined(__AVX2__)
+	const __m256i b1 = _mm256_set1_epi8(0x02), gt = _mm256_set1_epi8('>');
+	const __m256i b2 = _mm256_set1_epi8(0x04), amp = _mm256_set1_epi8('&');
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i m = _mm256_or_si256(
+			_mm256_cmpeq_epi8(_mm256_or_si256(v, b1), gt),
+			_mm256_cmpeq_epi8(_mm256_or_si256(v, b2), amp));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__)
+	{
+	const __m128i b1 = _mm_set1_epi8(0x02), gt = _mm_set1_epi8('>');
+	const __m128i b2 = _mm_set1_epi8(0x04), amp = _mm_set1_epi8('&');
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i m = _mm_or_si128(
+			_mm_cmpeq_epi8(_mm_or_si128(v, b1), gt),
+			_mm_cmpeq_epi8(_mm_or_si128(v, b2), amp));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	}
+#endif
+	for (; i < len; i++)
+	{
+		if (IS_SPECIAL(s[i]))
+			break;
+	}
+
+	return i;
+}
+
+static inline const char *
+entity(char c, int *len)
+{
+	switch (c)
+	{
+	case '&':
+		*len = 9;
+		return "&amp;amp;";
+	case '<':
+		*len = 8;
+		return "&amp;lt;";
+	case '>':
+		*len = 8;
+		return "&amp;gt;";
+	default:
+		*len = 10;
+		return "&amp;quot;";
+	}
+}
+
+size_t
+xml_escaped_len(const char *s, size_t len)
+{
+	size_t n, total = 0;
+	int elen;
+
+	while ((n = xml_special_span(s, len)) < len)
+	{
+		entity(s[n], &elen);
+		total += n + elen;
+		s += n + 1;
+		len -= n + 1;
+	}
+
+	return total + len;
+}
+
+int
+didl_escape(struct string_s *str, const char *s, size_t len)
+{
+	const char *e;
+	size_t n;
+	int elen, ret = 0;
+
+	while ((n = xml_special_span(s, len)) < len)
+	{
+		e = entity(s[n], &elen);
+		ret += strcatn(str, s, n);
+		ret += strcatn(str, e, elen);
+		s += n + 1;
+		len -= n + 1;
+	}
+
+	return ret + strcatn(str, s, len);
+}
+
+int
+didl_int(struct string_s *str, long long val)
+{
+	char buf[24], *p = buf + sizeof(buf);
+	unsigned long long v = (val < 0) ? -(unsigned long long)val : (unsigned long long)val;
+
+	do {
+		*--p = '0' + (v % 10);
+		v /= 10;
+	} while (v);
+	if (val < 0)
+		*--p = '-';
+
+	return strcatn(str, p, buf + sizeof(buf) - p);
+}
+
+int
+didl_hex(struct string_s *str, unsigned int val, int width)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	char buf[32];
+	int i;
+
+	if (width > (int)sizeof(buf))
+		width = sizeof(buf);
+	for (i = width - 1; i >= 0; i--)
+	{
+		buf[i] = digits[val & 0xF];
+		val >>= 4;
+	}
+
+	return strcatn(str, buf, width);
+}
+
+int
+didl_attr(struct string_s *str, const char *name, const char *value)
+{
+	int ret;
+
+	ret = didl_text(str, name);
+	ret += strcats(str, "=\"");
+	ret += didl_text(str, value);
+	ret += strcats(str, "\" ");
+
+	return ret;
+}
+
+int
+didl_tag(struct string_s *str, const char *tag, const char *value)
+{
+	size_t tlen = strlen(tag);
+	int ret;
+
+	ret = strcats(str, "&lt;");
+	ret += strcatn(str, tag, tlen);
+	ret += strcats(str, "&gt;");
+	ret += didl_text(str, value);
+	ret += strcats(str, "&lt;/");
+	ret += strcatn(str, tag, tlen);
+	ret += strcats(str, "&gt;");
+
+	return ret;
+}
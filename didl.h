@@ -0,0 +1,77 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __DIDL_H__
+#define __DIDL_H__
+
+#include <stddef.h>
+
+#include "utils.h"
+
+/* DIDL-Lite writer.
+ * The Result element carries DIDL-Lite as escaped text inside the SOAP
+ * body, so markup is written as "&lt;tag&gt;" and text is escaped twice
+ * ("&" becomes "&amp;amp;").  Like strcatf(), every primitive truncates
+ * silently once the buffer is full. */
+
+/* Append a string literal */
+#define didl_lit(str, s) strcats(str, s)
+
+/* didl_text()
+ * append a NUL-terminated string as is; NULL appends nothing */
+static inline int
+didl_text(struct string_s *str, const char *s)
+{
+	return s ? strcatn(str, s, strlen(s)) : 0;
+}
+
+/* didl_int()
+ * append a decimal integer */
+int
+didl_int(struct string_s *str, long long val);
+
+/* didl_hex()
+ * append an unsigned value as width upper case hex digits */
+int
+didl_hex(struct string_s *str, unsigned int val, int width);
+
+/* didl_escape()
+ * append len bytes of s with &, <, > and " escaped twice */
+int
+didl_escape(struct string_s *str, const char *s, size_t len);
+
+/* didl_attr()
+ * append 'name="value" ' for an already escaped value */
+int
+didl_attr(struct string_s *str, const char *name, const char *value);
+
+/* didl_tag()
+ * append "&lt;tag&gt;value&lt;/tag&gt;" for an already escaped value */
+int
+didl_tag(struct string_s *str, const char *tag, const char *value);
+
+/* xml_special_span()
+ * return the length of the leading part of s that needs no escaping */
+size_t
+xml_special_span(const char *s, size_t len);
+
+/* xml_escaped_len()
+ * return the length of s once didl_escape() has escaped it */
+size_t
+xml_escaped_len(const char *s, size_t len);
+
+#endif
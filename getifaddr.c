@@ -336,7 +336,10 @@ reload_ifaces(int force_notify)
 			if (memcmp(&lan_addr[i].addr, &old_addr[j], sizeof(struct in_addr)) == 0)
 				break;
 		}
-		/* Send out startup notifies if it's a new interface, or on SIGHUP */
+		/* Send out startup notifies if it's a new interface, or on SIGHUP.
+		 * The extra HTTP listeners leave SSDP to the main process. */
+		if (GETFLAG(HTTP_LISTENER_MASK))
+			continue;
 		if (force_notify || j == MAX_LAN_ADDR)
 		{
 			DPRINTF(E_INFO, L_GENERAL, "Enabling interface %s/%s\n",
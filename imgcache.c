@@ -0,0 +1,405 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include "imgcache.h"
+#include "upnpglobalvars.h"
+#include "utils.h"
+#include "log.h"
+
+#define IMGCACHE_BUCKETS 256
+#define PENDING_TIMEOUT  60	/* seconds to wait for a child to store an image */
+#define SWEEP_INTERVAL   30	/* seconds between rescans of the cache directory */
+
+struct imgcache_entry {
+	struct imgcache_key key;
+	off_t size;		/* -1 until the file has been stored */
+	time_t added;
+	unsigned long used;	/* lookup count when last used, for LRU */
+	unsigned long seen;	/* last sweep that found the file */
+	LIST_ENTRY(imgcache_entry) entries;
+};
+
+static LIST_HEAD(, imgcache_entry) buckets[IMGCACHE_BUCKETS];
+static char cache_dir[PATH_MAX];
+static off_t cache_limit = 0;
+static off_t cache_total = 0;
+static unsigned long lookups = 0;
+static unsigned long sweeps = 0;
+
+static unsigned int
+key_hash(const struct imgcache_key *key)
+{
+	uint64_t h;
+
+	h = (uint64_t)key->id * 2654435761U;
+	h ^= ((uint64_t)key->width << 16) ^ key->height ^ ((uint64_t)key->rotate << 24);
+	h ^= (uint64_t)key->mtime * 40503U;
+
+	return (h ^ (h >> 32)) % IMGCACHE_BUCKETS;
+}
+
+static int
+key_equal(const struct imgcache_key *a, const struct imgcache_key *b)
+{
+	return a->id == b->id && a->width == b->width && a->height == b->height &&
+	       a->rotate == b->rotate && a->mtime == b->mtime;
+}
+
+/* Returns -1 if the path doesn't fit in buf */
+static int
+cache_path(const struct imgcache_key *key, char *buf, size_t len)
+{
+	int n;
+
+	n = snprintf(buf, len, "%s/%" PRId64 "_%dx%d_%d_%lx.jpg", cache_dir, key->id,
+	             key->width, key->height, key->rotate, (unsigned long)key->mtime);
+	if (n >= len)
+		return -1;
+
+	return 0;
+}
+
+static int
+parse_name(const char *name, struct imgcache_key *key)
+{
+	long long id;
+	unsigned long mtime;
+
+	if (sscanf(name, "%lld_%dx%d_%d_%lx.jpg", &id, &key->width,
+	           &key->height, &key->rotate, &mtime) != 5 ||
+	    !ends_with(name, ".jpg"))
+		return -1;
+	key->id = id;
+	key->mtime = mtime;
+
+	return 0;
+}
+
+static struct imgcache_entry *
+find_entry(const struct imgcache_key *key)
+{
+	struct imgcache_entry *e;
+
+	LIST_FOREACH(e, &buckets[key_hash(key)], entries)
+	{
+		if (key_equal(&e->key, key))
+			return e;
+	}
+
+	return NULL;
+}
+
+static struct imgcache_entry *
+add_entry(const struct imgcache_key *key, off_t size)
+{
+	struct imgcache_entry *e;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+	e->key = *key;
+	e->size = size;
+	e->added = time(NULL);
+	e->used = lookups;
+	LIST_INSERT_HEAD(&buckets[key_hash(key)], e, entries);
+	if (size > 0)
+		cache_total += size;
+
+	return e;
+}
+
+static void
+remove_entry(struct imgcache_entry *e, int unlink_file)
+{
+	char path[PATH_MAX];
+
+	if (unlink_file && cache_path(&e->key, path, sizeof(path)) == 0)
+		unlink(path);
+	if (e->size > 0)
+		cache_total -= e->size;
+	LIST_REMOVE(e, entries);
+	free(e);
+}
+
+/* Drop the least recently used images until the cache fits its limit */
+static void
+evict(const struct imgcache_entry *keep)
+{
+	struct imgcache_entry *e, *oldest;
+	int i;
+
+	while (cache_total > cache_limit)
+	{
+		oldest = NULL;
+		for (i = 0; i < IMGCACHE_BUCKETS; i++)
+		{
+			LIST_FOREACH(e, &buckets[i], entries)
+			{
+				if (e != keep && e->size > 0 && (!oldest || e->used < oldest->used))
+					oldest = e;
+			}
+		}
+		if (!oldest)
+			break;
+		DPRINTF(E_DEBUG, L_HTTP, "Evicting resized image %" PRId64 " [%dx%d]\n",
+			oldest->key.id, oldest->key.width, oldest->key.height);
+		remove_entry(oldest, 1);
+	}
+}
+
+static int
+cmp_added(const void *a, const void *b)
+{
+	const struct imgcache_entry *ea = *(struct imgcache_entry * const *)a;
+	const struct imgcache_entry *eb = *(struct imgcache_entry * const *)b;
+
+	if (ea->added == eb->added)
+		return 0;
+	return (ea->added < eb->added) ? -1 : 1;
+}
+
+void
+imgcache_init(void)
+{
+	struct imgcache_entry **found = NULL, **tmp, *e;
+	struct imgcache_key key;
+	struct dirent *d;
+	struct stat st;
+	char path[PATH_MAX];
+	int i, n = 0, alloc = 0;
+	DIR *dir;
+
+	cache_limit = (off_t)runtime_vars.resize_cache_size * 1024 * 1024;
+	if (cache_limit <= 0)
+		return;
+	i = snprintf(cache_dir, sizeof(cache_dir), "%s/resize_cache", db_path);
+	if (i >= sizeof(cache_dir) ||
+	    make_dir(cache_dir, S_ISVTX|S_IRWXU|S_IRWXG|S_IRWXO) != 0)
+	{
+		DPRINTF(E_WARN, L_GENERAL, "Resized image cache disabled\n");
+		cache_limit = 0;
+		return;
+	}
+
+	dir = opendir(cache_dir);
+	if (!dir)
+		return;
+	while ((d = readdir(dir)) != NULL)
+	{
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+			continue;
+		i = snprintf(path, sizeof(path), "%s/%s", cache_dir, d->d_name);
+		if (i >= sizeof(path))
+			continue;
+		if (parse_name(d->d_name, &key) != 0 ||
+		    stat(path, &st) != 0 || st.st_size <= 0)
+		{
+			/* left over from a resize that didn't finish */
+			unlink(path);
+			continue;
+		}
+		if (n == alloc)
+		{
+			alloc = alloc ? alloc * 2 : 64;
+			tmp = realloc(found, alloc * sizeof(*found));
+			if (!tmp)
+				break;
+			found = tmp;
+		}
+		e = add_entry(&key, st.st_size);
+		if (!e)
+			break;
+		e->added = st.st_mtime;
+		found[n++] = e;
+	}
+	closedir(dir);
+
+	/* the newest files count as the most recently used */
+	if (n)
+		qsort(found, n, sizeof(*found), cmp_added);
+	for (i = 0; i < n; i++)
+		found[i]->used = ++lookups;
+	free(found);
+	evict(NULL);
+	DPRINTF(E_DEBUG, L_GENERAL, "Resized image cache holds %d images, %jd bytes\n",
+		n, (intmax_t)cache_total);
+}
+
+void
+imgcache_sweep(void)
+{
+	static time_t last_sweep = 0;
+	struct imgcache_entry *e, *next;
+	struct imgcache_key key;
+	struct dirent *d;
+	struct stat st;
+	char path[PATH_MAX];
+	time_t now = time(NULL);
+	int i;
+	DIR *dir;
+
+	if (cache_limit <= 0 || now - last_sweep < SWEEP_INTERVAL)
+		return;
+	last_sweep = now;
+
+	dir = opendir(cache_dir);
+	if (!dir)
+		return;
+	sweeps++;
+	while ((d = readdir(dir)) != NULL)
+	{
+		i = snprintf(path, sizeof(path), "%s/%s", cache_dir, d->d_name);
+		if (i >= sizeof(path))
+			continue;
+		if (d->d_name[0] == '.')
+		{
+			/* from a resize child that died while writing */
+			if (ends_with(d->d_name, ".tmp") && stat(path, &st) == 0 &&
+			    now - st.st_mtime > PENDING_TIMEOUT)
+				unlink(path);
+			continue;
+		}
+		if (parse_name(d->d_name, &key) != 0)
+			continue;
+		e = find_entry(&key);
+		if (!e || e->size < 0)
+		{
+			/* stored by a child, or by another listener process */
+			if (stat(path, &st) != 0 || st.st_size <= 0)
+				continue;
+			if (e)
+				remove_entry(e, 0);
+			e = add_entry(&key, st.st_size);
+			if (!e)
+				continue;
+		}
+		e->seen = sweeps;
+	}
+	closedir(dir);
+
+	for (i = 0; i < IMGCACHE_BUCKETS; i++)
+	{
+		for (e = LIST_FIRST(&buckets[i]); e; e = next)
+		{
+			next = LIST_NEXT(e, entries);
+			if (e->size < 0 ? now - e->added > PENDING_TIMEOUT
+			                : e->seen != sweeps)
+				remove_entry(e, 0);
+		}
+	}
+	evict(NULL);
+}
+
+int
+imgcache_open(const struct imgcache_key *key, off_t *size)
+{
+	struct imgcache_entry *e;
+	struct stat st;
+	char path[PATH_MAX];
+	int fd;
+
+	if (cache_limit <= 0 || cache_path(key, path, sizeof(path)) != 0)
+		return -1;
+	lookups++;
+	e = find_entry(key);
+	if (!e || e->size < 0)
+	{
+		/* a child may have stored it since */
+		if (stat(path, &st) != 0 || st.st_size <= 0)
+		{
+			if (!e)
+				e = add_entry(key, -1);
+			else if (time(NULL) - e->added > PENDING_TIMEOUT)
+				remove_entry(e, 0);
+			return -1;
+		}
+		if (e)
+			remove_entry(e, 0);
+		e = add_entry(key, st.st_size);
+		if (!e)
+			return -1;
+		evict(e);
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		remove_entry(e, 0);
+		return -1;
+	}
+	e->used = lookups;
+	*size = e->size;
+
+	return fd;
+}
+
+void
+imgcache_store(const struct imgcache_key *key, const void *data, size_t len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	const char *p = data;
+	ssize_t n;
+	int fd;
+
+	if (cache_limit <= 0 || (off_t)len > cache_limit)
+		return;
+	/* don't cache under a truncated name */
+	if (cache_path(key, path, sizeof(path)) != 0)
+		return;
+	n = snprintf(tmp, sizeof(tmp), "%s/.%d.tmp", cache_dir, (int)getpid());
+	if (n >= sizeof(tmp))
+		return;
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		DPRINTF(E_WARN, L_HTTP, "Unable to cache resized image: %s\n", strerror(errno));
+		return;
+	}
+	while (len > 0)
+	{
+		n = write(fd, p, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			DPRINTF(E_WARN, L_HTTP, "Unable to cache resized image: %s\n", strerror(errno));
+			close(fd);
+			unlink(tmp);
+			return;
+		}
+		p += n;
+		len -= n;
+	}
+	close(fd);
+	/* lookups only ever see complete files */
+	if (rename(tmp, path) != 0)
+		unlink(tmp);
+}
@@ -0,0 +1,59 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __IMGCACHE_H__
+#define __IMGCACHE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* A resized image is identified by the object it was made from,
+ * the size it was scaled to, and the source file's mtime */
+struct imgcache_key {
+	int64_t id;
+	int width;
+	int height;
+	int rotate;
+	time_t mtime;
+};
+
+/* imgcache_init()
+ * index what the cache directory under db_path holds from earlier runs */
+void
+imgcache_init(void);
+
+/* imgcache_sweep()
+ * every so often, index the images stored since the last sweep, forget
+ * ones that are gone or were never stored, and evict down to the limit */
+void
+imgcache_sweep(void);
+
+/* imgcache_open()
+ * open the cached image for key, setting its size; returns -1 if
+ * it isn't in the cache (yet) */
+int
+imgcache_open(const struct imgcache_key *key, off_t *size);
+
+/* imgcache_store()
+ * save a freshly resized image.  This runs in the process that did
+ * the resizing, and the index picks the file up on the next lookup
+ * or sweep. */
+void
+imgcache_store(const struct imgcache_key *key, const void *data, size_t len);
+
+#endif
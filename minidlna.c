@@ -58,6 +58,7 @@
 #include <sys/time.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -98,6 +99,10 @@
 #include "tivo_beacon.h"
 #include "tivo_utils.h"
 #include "avahi.h"
+#include "workers.h"
+#include "uring.h"
+#include "bandwidth.h"
+#include "imgcache.h"
 
 #if SQLITE_VERSION_NUMBER < 3005001
 # warning "Your SQLite3 library appears to be too old!  Please use 3.5.1 or newer."
@@ -105,6 +110,7 @@
 #endif
 
 static LIST_HEAD(httplisthead, upnphttp) upnphttphead;
+static void signal_http_listeners(int sig);
 
 /* OpenAndConfHTTPSocket() :
  * setup the socket used to handle incoming HTTP connections. */
@@ -127,6 +133,12 @@ OpenAndConfHTTPSocket(unsigned short port)
 
 	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i)) < 0)
 		DPRINTF(E_WARN, L_GENERAL, "setsockopt(http, SO_REUSEADDR): %s\n", strerror(errno));
+#ifdef SO_REUSEPORT
+	/* each HTTP listener process binds its own socket to the port */
+	if (runtime_vars.http_listeners > 1 &&
+	    setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &i, sizeof(i)) < 0)
+		DPRINTF(E_WARN, L_GENERAL, "setsockopt(http, SO_REUSEPORT): %s\n", strerror(errno));
+#endif
 
 	memset(&listenname, 0, sizeof(struct sockaddr_in));
 	listenname.sin_family = AF_INET;
@@ -217,6 +229,7 @@ sighup(int sig)
 	signal(sig, sighup);
 	DPRINTF(E_WARN, L_GENERAL, "received signal %d, reloading\n", sig);
 
+	signal_http_listeners(sig);
 	reload_ifaces(1);
 	log_reopen();
 }
@@ -398,7 +411,7 @@ rescan:
 				ret, DB_VERSION);
 		sqlite3_close(db);
 
-		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/art_cache %s/resize_cache", db_path, db_path, db_path);
 		if (system(cmd) != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache!  Exiting...\n");
 
@@ -584,6 +597,15 @@ init(int argc, char **argv)
 	runtime_vars.port = 8200;
 	runtime_vars.notify_interval = 895;	/* seconds between SSDP announces */
 	runtime_vars.max_connections = 50;
+	runtime_vars.keepalive_timeout = 15;
+	runtime_vars.keepalive_requests = 100;
+	runtime_vars.worker_threads = -1;
+	runtime_vars.max_bandwidth = 0;
+	runtime_vars.resize_cache_size = 32;
+	runtime_vars.http_listeners = 1;
+	runtime_vars.max_client_streams = 8;
+	runtime_vars.max_client_requests = 4;
+	runtime_vars.browse_cache_size = 2048;
 	runtime_vars.nonlocal_iface = -1; /* don't respond to nonlocal queries */
 	runtime_vars.root_container = NULL;
 	runtime_vars.ifaces[0] = NULL;
@@ -817,6 +839,49 @@ init(int argc, char **argv)
 			if (!strtobool(ary_options[i].value))
 				CLEARFLAG(SUBTITLES_MASK);
 			break;
+		case KEEPALIVE_TIMEOUT:
+			runtime_vars.keepalive_timeout = atoi(ary_options[i].value);
+			break;
+		case KEEPALIVE_REQUESTS:
+			runtime_vars.keepalive_requests = atoi(ary_options[i].value);
+			break;
+		case WORKER_THREADS:
+			runtime_vars.worker_threads = atoi(ary_options[i].value);
+			break;
+		case MAX_BANDWIDTH:
+			runtime_vars.max_bandwidth = atoi(ary_options[i].value);
+			break;
+		case RESIZE_CACHE_SIZE:
+			runtime_vars.resize_cache_size = atoi(ary_options[i].value);
+			break;
+		case HTTP_LISTENERS:
+			runtime_vars.http_listeners = atoi(ary_options[i].value);
+			if (runtime_vars.http_listeners < 1)
+				runtime_vars.http_listeners = 1;
+			break;
+		case MAX_CLIENT_STREAMS:
+			runtime_vars.max_client_streams = atoi(ary_options[i].value);
+			break;
+		case MAX_CLIENT_REQUESTS:
+			runtime_vars.max_client_requests = atoi(ary_options[i].value);
+			break;
+		case BROWSE_CACHE_SIZE:
+			runtime_vars.browse_cache_size = atoi(ary_options[i].value);
+			break;
+		case BANDWIDTH_WEIGHT:
+			word = strrchr(ary_options[i].value, ',');
+			if (!word || atoi(word + 1) <= 0)
+			{
+				DPRINTF(E_ERROR, L_GENERAL, "Bandwidth weight not understood [%s]\n",
+					ary_options[i].value);
+				break;
+			}
+			*word = '\0';
+			if (!bandwidth_set_weight(ary_options[i].value, atoi(word + 1)))
+				DPRINTF(E_ERROR, L_GENERAL, "Unknown client type in bandwidth_weight [%s]\n",
+					ary_options[i].value);
+			*word = ',';
+			break;
 		default:
 			DPRINTF(E_ERROR, L_GENERAL, "Unknown option in file %s\n",
 				optionsfile);
@@ -919,7 +984,7 @@ init(int argc, char **argv)
 			SETFLAG(RESCAN_MASK);
 			break;
 		case 'R':
-			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/art_cache %s/resize_cache", db_path, db_path, db_path);
 			if (system(buf) != 0)
 				DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache %s. EXITING\n", db_path);
 			break;
@@ -1098,6 +1163,265 @@ init(int argc, char **argv)
 
 /* === main === */
 /* process HTTP or SSDP requests */
+static time_t http_deadline;	/* when the next idle connection expires */
+static int following;		/* connections wait for a growing file */
+
+/* Shorten the event loop timeout to what the HTTP connections need */
+static u_long
+http_timeout(const struct timeval *now, u_long timeout)
+{
+	struct upnphttp *e;
+	long bwtimeout;
+
+	/* wake up in time to close idle HTTP connections */
+	if (http_deadline)
+	{
+		if (http_deadline <= now->tv_sec)
+			timeout = 0;
+		else if (timeout > (http_deadline - now->tv_sec) * 1000)
+			timeout = (http_deadline - now->tv_sec) * 1000;
+	}
+
+	/* check on streams waiting for a growing file */
+	if (following && timeout > FOLLOW_INTERVAL)
+		timeout = FOLLOW_INTERVAL;
+
+	/* pace streaming clients to their share of max_bandwidth */
+	bwtimeout = bandwidth_refill(now);
+	if (bwtimeout >= 0)
+	{
+		if (timeout > (u_long)bwtimeout)
+			timeout = bwtimeout;
+		for (e = upnphttphead.lh_first; e != NULL; e = e->entries.le_next)
+			Unthrottle_upnphttp(e);
+	}
+
+	return timeout;
+}
+
+/* Delete finished HTTP connections, after closing idle ones */
+static void
+http_cleanup(void)
+{
+	struct upnphttp *e, *next;
+	time_t deadline;
+
+	http_deadline = 0;
+	following = 0;
+	for (e = upnphttphead.lh_first; e != NULL; e = next)
+	{
+		next = e->entries.le_next;
+		if (e->state < 100)
+		{
+			if (Follow_upnphttp(e))
+				following = 1;
+			deadline = Timeout_upnphttp(e, time(NULL));
+			if (deadline && (!http_deadline || deadline < http_deadline))
+				http_deadline = deadline;
+		}
+		if(e->state >= 100)
+		{
+			LIST_REMOVE(e, entries);
+			Delete_upnphttp(e);
+		}
+	}
+	deadline = uring_expire(time(NULL));
+	if (deadline && (!http_deadline || deadline < http_deadline))
+		http_deadline = deadline;
+}
+
+/* With http_listeners set, extra processes accept HTTP connections on
+ * their own SO_REUSEPORT sockets.  The main process keeps SSDP, the
+ * scanner and the media monitors to itself, and shares what changes
+ * through a small anonymous mapping. */
+struct listener_state {
+	volatile uint32_t update_id;
+	volatile int scanning;
+};
+static struct listener_state *listener_state;
+static pid_t *listener_pids;
+static int n_listener_pids;
+static uint32_t listener_update_id;	/* as last published or seen */
+
+/* Publish SystemUpdateID changes made by this process, and take in
+ * the ones made by the others */
+static void
+sync_listeners(void)
+{
+	if (!listener_state)
+		return;
+	if (updateID != listener_update_id)
+		listener_state->update_id = updateID;
+	else if (listener_state->update_id != updateID)
+	{
+		updateID = listener_state->update_id;
+		upnp_event_var_change_notify(EContentDirectory);
+	}
+	listener_update_id = updateID;
+
+	if (!GETFLAG(HTTP_LISTENER_MASK))
+		listener_state->scanning = GETFLAG(SCANNING_MASK) ? 1 : 0;
+	else if (listener_state->scanning)
+		SETFLAG(SCANNING_MASK);
+	else
+		CLEARFLAG(SCANNING_MASK);
+}
+
+/* Main loop of an extra HTTP listener process */
+static void
+http_listener(void)
+{
+	struct upnphttp *e;
+	struct timeval timeofday;
+	struct event httpev, monev;
+	u_long timeout;
+	int shttpl, smonitor, i;
+
+	SETFLAG(HTTP_LISTENER_MASK);
+	/* none of the main process' children are ours */
+	free(listener_pids);
+	listener_pids = NULL;
+	n_listener_pids = 0;
+	memset(children, 0, runtime_vars.max_connections * sizeof(struct child));
+	number_of_children = 0;
+
+	event_module.fini();
+	if ((i = event_module.init()) != 0)
+		DPRINTF(E_FATAL, L_GENERAL, "Failed to init event module. "
+		    "[%s] EXITING.\n", strerror(i));
+	/* an SQLite connection must not be used across fork() */
+	open_db(NULL);
+#ifdef TIVO_SUPPORT
+	if (GETFLAG(TIVO_MASK) &&
+	    sqlite3_create_function(db, "tivorandom", 1, SQLITE_UTF8, NULL, &TiVoRandomSeedFunc, NULL, NULL) != SQLITE_OK)
+		DPRINTF(E_ERROR, L_TIVO, "ERROR: Failed to add sqlite randomize function for TiVo!\n");
+#endif
+	workers_init(runtime_vars.worker_threads);
+	uring_init();
+
+	reload_ifaces(0);
+	smonitor = OpenAndConfMonitorSocket();
+	if (smonitor > 0)
+	{
+		monev = (struct event ){ .fd = smonitor, .rdwr = EVENT_READ, .process = ProcessMonitorEvent };
+		event_module.add(&monev);
+	}
+	shttpl = OpenAndConfHTTPSocket(runtime_vars.port);
+	if (shttpl < 0)
+		DPRINTF(E_FATAL, L_GENERAL, "Failed to open socket for HTTP. EXITING\n");
+	httpev = (struct event ){ .fd = shttpl, .rdwr = EVENT_READ, .process = ProcessListen };
+	event_module.add(&httpev);
+
+	while (!quitting)
+	{
+		if (gettimeofday(&timeofday, 0) < 0)
+			DPRINTF(E_FATAL, L_GENERAL, "gettimeofday(): %s\n", strerror(errno));
+		/* the shared state is polled once a second */
+		timeout = http_timeout(&timeofday, 1000);
+		uring_submit();
+		event_module.process(timeout);
+		if (quitting)
+			break;
+		upnpevents_gc();
+		imgcache_sweep();
+		sync_listeners();
+		http_cleanup();
+	}
+
+	workers_fini();
+	uring_fini();
+	while (upnphttphead.lh_first != NULL)
+	{
+		e = upnphttphead.lh_first;
+		LIST_REMOVE(e, entries);
+		Delete_upnphttp(e);
+	}
+	close(shttpl);
+	if (smonitor >= 0)
+		close(smonitor);
+	for (i = 0; i < n_lan_addr; i++)
+		close(lan_addr[i].snotify);
+	process_reap_children();
+	free(children);
+	event_module.fini();
+	sql_flush_cached(db);
+	sqlite3_close(db);
+	upnpevents_removeSubscribers();
+	log_close();
+
+	exit(EXIT_SUCCESS);
+}
+
+/* Fork the extra HTTP listeners.  This has to happen before any
+ * thread is started, or any socket of the main process is opened. */
+static void
+start_http_listeners(void)
+{
+	int n = runtime_vars.http_listeners - 1;
+	pid_t pid;
+
+	if (n <= 0)
+		return;
+#ifndef SO_REUSEPORT
+	DPRINTF(E_ERROR, L_GENERAL, "http_listeners needs SO_REUSEPORT, which isn't supported\n");
+	runtime_vars.http_listeners = 1;
+	return;
+#endif
+	listener_state = mmap(NULL, sizeof(*listener_state), PROT_READ|PROT_WRITE,
+	                      MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	listener_pids = calloc(n, sizeof(pid_t));
+	if (listener_state == MAP_FAILED || !listener_pids)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Failed to set up the HTTP listeners\n");
+		if (listener_state != MAP_FAILED)
+			munmap(listener_state, sizeof(*listener_state));
+		listener_state = NULL;
+		free(listener_pids);
+		listener_pids = NULL;
+		runtime_vars.http_listeners = 1;
+		return;
+	}
+	/* event subscriptions have to be seen by every process */
+	if (upnpevents_share() != 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Failed to share event subscriptions; not starting HTTP listeners\n");
+		munmap(listener_state, sizeof(*listener_state));
+		listener_state = NULL;
+		free(listener_pids);
+		listener_pids = NULL;
+		runtime_vars.http_listeners = 1;
+		return;
+	}
+	listener_state->update_id = listener_update_id = updateID;
+	listener_state->scanning = GETFLAG(SCANNING_MASK) ? 1 : 0;
+	/* keep max_bandwidth a limit on the total */
+	if (runtime_vars.max_bandwidth > 0)
+		runtime_vars.max_bandwidth = MAX(1, runtime_vars.max_bandwidth / runtime_vars.http_listeners);
+
+	while (n_listener_pids < n)
+	{
+		pid = fork();
+		if (pid == 0)
+			http_listener();
+		if (pid < 0)
+		{
+			DPRINTF(E_ERROR, L_GENERAL, "fork(http listener): %s\n", strerror(errno));
+			break;
+		}
+		listener_pids[n_listener_pids++] = pid;
+	}
+	DPRINTF(E_WARN, L_GENERAL, "Started %d additional HTTP listeners\n", n_listener_pids);
+}
+
+static void
+signal_http_listeners(int sig)
+{
+	int i;
+
+	for (i = 0; i < n_listener_pids; i++)
+		kill(listener_pids[i], sig);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -1105,7 +1429,6 @@ main(int argc, char **argv)
 	int shttpl = -1;
 	int smonitor = -1;
 	struct upnphttp * e = 0;
-	struct upnphttp * next;
 	struct timeval tv, timeofday, lastnotifytime = {0, 0};
 	time_t lastupdatetime = 0, lastdbtime = 0;
 	u_long timeout;	/* in milliseconds */
@@ -1146,6 +1469,11 @@ main(int argc, char **argv)
 	}
 	check_db(db, ret, &scanner_pid);
 	lastdbtime = _get_dbtime();
+
+	if (BuildDescs_upnphttp() < 0)
+		DPRINTF(E_ERROR, L_GENERAL, "Failed to generate the XML descriptions\n");
+	imgcache_init();
+	start_http_listeners();
 #ifdef HAVE_INOTIFY
 	if( GETFLAG(INOTIFY_MASK) )
 	{
@@ -1164,6 +1492,9 @@ main(int argc, char **argv)
 	}
 #endif /* HAVE_KQUEUE */
 
+	workers_init(runtime_vars.worker_threads);
+	uring_init();
+
 	smonitor = OpenAndConfMonitorSocket();
 	if (smonitor > 0)
 	{
@@ -1279,6 +1610,10 @@ main(int argc, char **argv)
 				timeout = beacontimeout;
 		}
 #endif
+		timeout = http_timeout(&timeofday, timeout);
+		/* take in what the HTTP listeners changed once a second */
+		if (listener_state && timeout > 1000)
+			timeout = 1000;
 
 		if (GETFLAG(SCANNING_MASK) && kill(scanner_pid, 0) != 0) {
 			CLEARFLAG(SCANNING_MASK);
@@ -1290,15 +1625,20 @@ main(int argc, char **argv)
 #endif /* HAVE_KQUEUE */
 		}
 
+		/* queue up file reads and sends from the last pass */
+		uring_submit();
 		event_module.process(timeout);
 		if (quitting)
 			goto shutdown;
 
 		upnpevents_gc();
+		upnpevents_sync();
+		imgcache_sweep();
 
 		/* increment SystemUpdateID if the content database has changed,
-		 * and if there is an active HTTP connection, at most once every 2 seconds */
-		if (!LIST_EMPTY(&upnphttphead) &&
+		 * and if there is an active HTTP connection (or there may be one
+		 * in another listener), at most once every 2 seconds */
+		if ((!LIST_EMPTY(&upnphttphead) || listener_state) &&
 		    (timeofday.tv_sec >= (lastupdatetime + 2)))
 		{
 			if (GETFLAG(SCANNING_MASK))
@@ -1318,16 +1658,8 @@ main(int argc, char **argv)
 				lastupdatetime = timeofday.tv_sec;
 			}
 		}
-		/* delete finished HTTP connections */
-		for (e = upnphttphead.lh_first; e != NULL; e = next)
-		{
-			next = e->entries.le_next;
-			if(e->state >= 100)
-			{
-				LIST_REMOVE(e, entries);
-				Delete_upnphttp(e);
-			}
-		}
+		sync_listeners();
+		http_cleanup();
 	}
 
 shutdown:
@@ -1335,6 +1667,9 @@ shutdown:
 	if (GETFLAG(SCANNING_MASK) && scanner_pid)
 		kill(scanner_pid, SIGKILL);
 
+	workers_fini();
+	uring_fini();
+
 	/* close out open sockets */
 	while (upnphttphead.lh_first != NULL)
 	{
@@ -1366,12 +1701,14 @@ shutdown:
 	}
 
 	/* kill other child processes */
+	signal_http_listeners(SIGTERM);
 	process_reap_children();
 	free(children);
 
 	event_module.fini();
 
 	sql_exec(db, "UPDATE SETTINGS set VALUE = '%u' where KEY = 'UPDATE_ID'", updateID);
+	sql_flush_cached(db);
 	sqlite3_close(db);
 
 	upnpevents_removeSubscribers();
@@ -49,6 +49,15 @@ struct runtime_vars_s {
 	int port;	/* HTTP Port */
 	int notify_interval;	/* seconds between SSDP announces */
 	int max_connections;	/* max number of simultaneous conenctions */
+	int keepalive_timeout;	/* seconds an idle HTTP connection is kept open */
+	int keepalive_requests;	/* max number of requests per HTTP connection */
+	int worker_threads;	/* threads answering Browse/Search, -1 for one per CPU */
+	int max_bandwidth;	/* KB/s shared out between streaming clients, 0 for no limit */
+	int resize_cache_size;	/* MB of resized images to keep, 0 to keep none */
+	int http_listeners;	/* processes accepting HTTP connections on the same port */
+	int max_client_streams;	/* per client, 0 for no limit */
+	int max_client_requests;	/* per client, 0 for no limit */
+	int browse_cache_size;	/* KB of Browse responses to keep, 0 to keep none */
 	int password_length;	/* Password Length */
 	int nonlocal_iface;     /*  iface to use respond to nonlocal queries */
 	const char *root_container;	/* root ObjectID (instead of "0") */
@@ -221,10 +221,14 @@ static void
 SendSSDPResponse(int s, struct sockaddr_in sockname, int st_no,
 		 const char *host, unsigned short port, socklen_t len_r)
 {
-	int l, n;
+	static char prefix[256];
+	static int prefix_len;
+	static unsigned int prefix_age;
+	unsigned int age = (runtime_vars.notify_interval<<1)+10;
+	struct string_s str;
+	int n;
 	char buf[512];
-	char tmstr[30];
-	time_t tm = time(NULL);
+	char tmstr[HTTP_DATE_LEN+1];
 
 	/*
 	 * follow guideline from document "UPnP Device Architecture 1.0"
@@ -233,19 +237,29 @@ SendSSDPResponse(int s, struct sockaddr_in sockname, int st_no,
 	 * SERVER: OS/ver UPnP/1.0 minidlna/1.0
 	 * - check what to put in the 'Cache-Control' header 
 	 * */
-	strftime(tmstr, sizeof(tmstr), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&tm));
-	l = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
-		"CACHE-CONTROL: max-age=%u\r\n"
-		"DATE: %s\r\n"
+	/* the lines before the date only change with notify_interval */
+	if (age != prefix_age)
+	{
+		prefix_len = snprintf(prefix, sizeof(prefix), "HTTP/1.1 200 OK\r\n"
+			"CACHE-CONTROL: max-age=%u\r\n"
+			"EXT:\r\n"
+			"SERVER: " MINIDLNA_SERVER_STRING "\r\n"
+			"DATE: ", age);
+		if (prefix_len >= sizeof(prefix))
+			prefix_len = sizeof(prefix) - 1;
+		prefix_age = age;
+	}
+	str.data = buf;
+	str.size = sizeof(buf);
+	str.off = 0;
+	strcatn(&str, prefix, prefix_len);
+	strcatn(&str, tmstr, http_date(tmstr));
+	strcatf(&str, "\r\n"
 		"ST: %s%s\r\n"
 		"USN: %s%s%s%s\r\n"
-		"EXT:\r\n"
-		"SERVER: " MINIDLNA_SERVER_STRING "\r\n"
 		"LOCATION: http://%s:%u" ROOTDESC_PATH "\r\n"
 		"Content-Length: 0\r\n"
 		"\r\n",
-		(runtime_vars.notify_interval<<1)+10,
-		tmstr,
 		known_service_types[st_no],
 		(st_no > 1 ? "1" : ""),
 		uuidvalue,
@@ -256,7 +270,7 @@ SendSSDPResponse(int s, struct sockaddr_in sockname, int st_no,
 	DPRINTF(E_DEBUG, L_SSDP, "Sending M-SEARCH response to %s:%d ST: %s\n",
 		inet_ntoa(sockname.sin_addr), ntohs(sockname.sin_port),
 		known_service_types[st_no]);
-	n = sendto(s, buf, l, 0,
+	n = sendto(s, buf, str.off, 0,
 	           (struct sockaddr *)&sockname, len_r);
 	if (n < 0)
 		DPRINTF(E_ERROR, L_SSDP, "sendto(udp): %s\n", strerror(errno));
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
@@ -30,6 +31,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
 #ifdef HAVE_INOTIFY
 #include <sys/resource.h>
 #include <poll.h>
@@ -71,6 +74,135 @@ struct watch
 static struct watch *watches;
 static struct watch *lastwatch = NULL;
 
+/* Recordings that are being written, and not yet closed after writing,
+ * so the HTTP server can follow them as they grow.  Only transport
+ * streams qualify: they can be played from any point while they are
+ * written, where most other containers only get their index at the end. */
+#define GROWING_CHECK 5		/* seconds between database lookups of a growing file */
+#define is_followable(file) (ends_with(file, ".ts") || ends_with(file, ".mts") || \
+                             ends_with(file, ".m2ts"))
+static struct growing_file {
+	dev_t dev;
+	ino_t ino;
+	char *path;
+	time_t checked;		/* last looked up in the database */
+} *growing = NULL;
+static int n_growing = 0;
+static int max_growing = 0;
+static pthread_mutex_t growing_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef HAVE_INOTIFY
+/* Mark a file as being written, or as closed.  Returns 1 when the caller
+ * should make sure an open file with data in it is in the database, which
+ * is at most every GROWING_CHECK seconds, as writes come in quickly. */
+static int
+set_growing(const struct stat *st, const char *path, int open)
+{
+	struct growing_file *f = NULL, *tmp;
+	time_t now;
+	int i, ret = 0;
+
+	pthread_mutex_lock(&growing_mutex);
+	for (i = 0; i < n_growing; i++)
+	{
+		if (growing[i].ino == st->st_ino && growing[i].dev == st->st_dev)
+		{
+			f = &growing[i];
+			break;
+		}
+	}
+	if (!open)
+	{
+		if (f)
+		{
+			free(f->path);
+			*f = growing[--n_growing];
+		}
+		pthread_mutex_unlock(&growing_mutex);
+		return 0;
+	}
+	if (!f)
+	{
+		if (n_growing == max_growing)
+		{
+			tmp = realloc(growing, (max_growing ? max_growing * 2 : 16) * sizeof(*growing));
+			if (!tmp)
+			{
+				pthread_mutex_unlock(&growing_mutex);
+				DPRINTF(E_WARN, L_INOTIFY, "Out of memory; not following inode %ju as it grows\n",
+					(uintmax_t)st->st_ino);
+				return 0;
+			}
+			growing = tmp;
+			max_growing = max_growing ? max_growing * 2 : 16;
+		}
+		f = &growing[n_growing];
+		f->path = strdup(path);
+		if (!f->path)
+		{
+			pthread_mutex_unlock(&growing_mutex);
+			return 0;
+		}
+		f->dev = st->st_dev;
+		f->ino = st->st_ino;
+		f->checked = 0;
+		n_growing++;
+	}
+	now = time(NULL);
+	if (st->st_size > 0 && now - f->checked >= GROWING_CHECK)
+	{
+		f->checked = now;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&growing_mutex);
+
+	return ret;
+}
+
+/* A file that was being written, or a directory holding such files,
+ * has been deleted or moved away */
+static void
+forget_growing(const char *path)
+{
+	size_t len = strlen(path);
+	int i;
+
+	pthread_mutex_lock(&growing_mutex);
+	for (i = 0; i < n_growing; i++)
+	{
+		if (strncmp(growing[i].path, path, len) == 0 &&
+		    (growing[i].path[len] == '\0' || growing[i].path[len] == '/'))
+		{
+			free(growing[i].path);
+			growing[i] = growing[--n_growing];
+			i--;
+		}
+	}
+	pthread_mutex_unlock(&growing_mutex);
+}
+#endif
+
+int
+monitor_file_growing(const struct stat *st)
+{
+	int i, ret = 0;
+
+	if (!st->st_ino)
+		return 0;
+	pthread_mutex_lock(&growing_mutex);
+	for (i = 0; i < n_growing; i++)
+	{
+		if (growing[i].ino == st->st_ino && growing[i].dev == st->st_dev)
+		{
+			ret = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&growing_mutex);
+
+	return ret;
+}
+
 static char *
 get_path_from_wd(int wd)
 {
@@ -118,11 +250,11 @@ add_watch(int fd, const char * path)
 	struct watch *nw;
 	int wd;
 
-	wd = inotify_add_watch(fd, path, IN_CREATE|IN_CLOSE_WRITE|IN_DELETE|IN_MOVE);
+	wd = inotify_add_watch(fd, path, IN_CREATE|IN_MODIFY|IN_CLOSE_WRITE|IN_DELETE|IN_MOVE);
 	if( wd < 0 && errno == ENOSPC)
 	{
 		raise_watch_limit(0);
-		wd = inotify_add_watch(fd, path, IN_CREATE|IN_CLOSE_WRITE|IN_DELETE|IN_MOVE);
+		wd = inotify_add_watch(fd, path, IN_CREATE|IN_MODIFY|IN_CLOSE_WRITE|IN_DELETE|IN_MOVE);
 	}
 	if( wd < 0 )
 	{
@@ -705,9 +837,11 @@ start_inotify(void)
 						path_buf, (event->mask & IN_MOVED_TO ? "moved here" : "created"));
 					monitor_insert_directory(pollfds[0].fd, esc_name, path_buf);
 				}
-				else if ( (event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE)) &&
+				else if ( (event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE|IN_MODIFY)) &&
 				          (lstat(path_buf, &st) == 0) )
 				{
+					if( event->mask & IN_CLOSE_WRITE )
+						set_growing(&st, path_buf, 0);
 					if( (event->mask & (IN_MOVED_TO|IN_CREATE)) && (S_ISLNK(st.st_mode) || st.st_nlink > 1) )
 					{
 						DPRINTF(E_DEBUG, L_INOTIFY, "The %s link %s was %s.\n",
@@ -728,12 +862,23 @@ start_inotify(void)
 							monitor_insert_file(esc_name, path_buf);
 						}
 					}
+					/* Also catches writers that reopened an existing file.  A
+					 * recording is added as soon as it has data, so that clients
+					 * can start playing it while it is still being written. */
+					else if( (event->mask & (IN_CREATE|IN_MODIFY)) && S_ISREG(st.st_mode) &&
+					         is_followable(path_buf) && set_growing(&st, path_buf, 1) &&
+					         sql_get_int_field(db, "SELECT 1 from DETAILS where PATH = '%q'", path_buf) <= 0 )
+					{
+						DPRINTF(E_DEBUG, L_INOTIFY, "The file %s is being written.\n", path_buf);
+						monitor_insert_file(esc_name, path_buf);
+					}
 				}
 				else if ( event->mask & (IN_DELETE|IN_MOVED_FROM) )
 				{
 					DPRINTF(E_DEBUG, L_INOTIFY, "The %s %s was %s.\n",
 						(event->mask & IN_ISDIR ? "directory" : "file"),
 						path_buf, (event->mask & IN_MOVED_FROM ? "moved away" : "deleted"));
+					forget_growing(path_buf);
 					if ( event->mask & IN_ISDIR )
 						monitor_remove_directory(pollfds[0].fd, path_buf);
 					else
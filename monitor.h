@@ -3,6 +3,11 @@ int monitor_insert_directory(int fd, char *name, const char * path);
 int monitor_remove_file(const char * path);
 int monitor_remove_directory(int fd, const char * path);
 
+/* monitor_file_growing()
+ * the file has been created and is still open for writing */
+struct stat;
+int monitor_file_growing(const struct stat *st);
+
 #if defined(HAVE_INOTIFY) || defined(HAVE_KQUEUE)
 #define	HAVE_WATCH 1
 int	add_watch(int, const char *);
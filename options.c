@@ -68,7 +68,17 @@ static const struct {
 	{ WIDE_LINKS, "wide_links" },
 	{ TIVO_DISCOVERY, "tivo_discovery" },
 	{ ENABLE_SUBTITLES, "enable_subtitles" },
-	{ PASSWORD_LENGTH, "password_length" }
+	{ PASSWORD_LENGTH, "password_length" },
+	{ KEEPALIVE_TIMEOUT, "keepalive_timeout" },
+	{ KEEPALIVE_REQUESTS, "keepalive_requests" },
+	{ WORKER_THREADS, "worker_threads" },
+	{ MAX_BANDWIDTH, "max_bandwidth" },
+	{ RESIZE_CACHE_SIZE, "resize_cache_size" },
+	{ HTTP_LISTENERS, "http_listeners" },
+	{ MAX_CLIENT_STREAMS, "max_client_streams" },
+	{ MAX_CLIENT_REQUESTS, "max_client_requests" },
+	{ BROWSE_CACHE_SIZE, "browse_cache_size" },
+	{ BANDWIDTH_WEIGHT, "bandwidth_weight" }
 };
 
 int
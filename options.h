@@ -61,7 +61,17 @@ enum upnpconfigoptions {
 	WIDE_LINKS,			/* allow following symlinks outside the defined media_dirs */
 	TIVO_DISCOVERY,			/* TiVo discovery protocol: bonjour or beacon. Defaults to bonjour if supported */
 	ENABLE_SUBTITLES,		/* Enable generic subtitle support for all clients by default */
-	PASSWORD_LENGTH			/* Password */
+	PASSWORD_LENGTH,		/* Password */
+	KEEPALIVE_TIMEOUT,		/* seconds to keep an idle HTTP connection open */
+	KEEPALIVE_REQUESTS,		/* maximum number of requests per HTTP connection */
+	WORKER_THREADS,			/* number of threads answering Browse and Search requests */
+	MAX_BANDWIDTH,			/* total rate at which files are streamed, in KB/s */
+	RESIZE_CACHE_SIZE,		/* MB of resized images kept under db_dir */
+	HTTP_LISTENERS,			/* number of processes accepting HTTP connections */
+	MAX_CLIENT_STREAMS,		/* streams a single client may have open at once */
+	MAX_CLIENT_REQUESTS,		/* Browse/Search requests a single client may have running */
+	BROWSE_CACHE_SIZE,		/* KB of rendered Browse responses kept in memory */
+	BANDWIDTH_WEIGHT		/* share of max_bandwidth given to a client type */
 };
 
 /* readoptionsfile()
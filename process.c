@@ -65,7 +65,7 @@ add_process_info(pid_t pid, struct client_cache_s *client)
 	}
 }
 
-static inline void
+static inline int
 remove_process_info(pid_t pid)
 {
 	struct child *child;
@@ -79,8 +79,10 @@ remove_process_info(pid_t pid)
 		child->pid = 0;
 		if (child->client)
 			child->client->connections--;
-		break;
+		return 1;
 	}
+
+	return 0;
 }
 
 pid_t
@@ -123,8 +125,9 @@ process_handle_child_termination(int signal)
 			else
 				break;
 		}
-		number_of_children--;
-		remove_process_info(pid);
+		/* the scanner and the HTTP listeners aren't counted */
+		if (remove_process_info(pid))
+			number_of_children--;
 	}
 }
 
@@ -0,0 +1,111 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "readahead.h"
+#include "log.h"
+
+#define READAHEAD_SECONDS 4		/* playback time to keep prefetched */
+#define READAHEAD_MIN     (512*1024)
+#define READAHEAD_MAX     (16*1024*1024)
+#define DROP_BEHIND       (4*1024*1024)	/* drop cached pages in chunks this big */
+
+static unsigned long ra_hits = 0;
+static unsigned long ra_misses = 0;
+
+#ifdef HAVE_POSIX_FADVISE
+/* Bytes to keep prefetched, from the average rate since the start */
+static off_t
+window_size(struct readahead *ra, off_t offset)
+{
+	struct timeval now;
+	long long ms;
+	off_t window;
+
+	gettimeofday(&now, NULL);
+	ms = (now.tv_sec - ra->started.tv_sec) * 1000LL +
+	     (now.tv_usec - ra->started.tv_usec) / 1000;
+	if (ms < 1000)
+		return READAHEAD_MIN;
+	window = (offset - ra->start) * READAHEAD_SECONDS * 1000 / ms;
+	if (window < READAHEAD_MIN)
+		window = READAHEAD_MIN;
+	else if (window > READAHEAD_MAX)
+		window = READAHEAD_MAX;
+
+	return window;
+}
+#endif
+
+void
+readahead_start(struct readahead *ra, int fd, off_t offset)
+{
+	ra->start = offset;
+	ra->ahead = offset;
+	ra->behind = offset;
+	gettimeofday(&ra->started, NULL);
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+void
+readahead_update(struct readahead *ra, int fd, off_t offset, off_t len)
+{
+#ifdef HAVE_POSIX_FADVISE
+	off_t window;
+
+	if (offset + len <= ra->ahead)
+		ra_hits++;
+	else
+		ra_misses++;
+
+	/* top the window up once half of it has been consumed */
+	window = window_size(ra, offset);
+	if (ra->ahead < offset)
+		ra->ahead = offset;
+	if (ra->ahead - offset < window / 2)
+	{
+		posix_fadvise(fd, ra->ahead, offset + window - ra->ahead, POSIX_FADV_WILLNEED);
+		DPRINTF(E_MAXDEBUG, L_HTTP, "Prefetching %jd bytes at offset %jd\n",
+			(intmax_t)(offset + window - ra->ahead), (intmax_t)ra->ahead);
+		ra->ahead = offset + window;
+	}
+
+	if (offset - ra->behind >= DROP_BEHIND)
+	{
+		posix_fadvise(fd, ra->behind, offset - ra->behind, POSIX_FADV_DONTNEED);
+		ra->behind = offset;
+	}
+	else if (offset < ra->behind)
+		ra->behind = offset;
+#endif
+}
+
+void
+readahead_stats(unsigned long *hits, unsigned long *misses)
+{
+	*hits = ra_hits;
+	*misses = ra_misses;
+}
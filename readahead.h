@@ -0,0 +1,49 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __READAHEAD_H__
+#define __READAHEAD_H__
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+/* Read-ahead state of a file being streamed.  The window ahead of the
+ * send cursor is sized from the rate at which the client consumes the
+ * file, and pages the cursor has passed are dropped from the cache. */
+struct readahead {
+	off_t start;		/* offset the transfer started at */
+	off_t ahead;		/* end of the range already prefetched */
+	off_t behind;		/* start of the range still cached */
+	struct timeval started;
+};
+
+/* readahead_start()
+ * begin streaming fd from offset */
+void
+readahead_start(struct readahead *ra, int fd, off_t offset);
+
+/* readahead_update()
+ * the range [offset, offset + len) has just been read */
+void
+readahead_update(struct readahead *ra, int fd, off_t offset, off_t len);
+
+/* readahead_stats()
+ * number of reads that were, or were not, already prefetched */
+void
+readahead_stats(unsigned long *hits, unsigned long *misses);
+
+#endif
@@ -30,7 +30,9 @@ char create_objectTable_sqlite[] = "CREATE TABLE OBJECTS ("
 					"CLASS TEXT NOT NULL, "
 					"DETAIL_ID INTEGER DEFAULT NULL, "
                                         "NAME TEXT DEFAULT NULL, "
-					"PASSWORD CHAR(10) DEFAULT '');";
+					"PASSWORD CHAR(10) DEFAULT '', "
+					"CHILD_COUNT INTEGER DEFAULT 0, "
+					"LOCKED_COUNT INTEGER DEFAULT 0);";
 
 char create_detailTable_sqlite[] = "CREATE TABLE DETAILS ("
 					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
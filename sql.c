@@ -16,8 +16,10 @@
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "sql.h"
 #include "upnpglobalvars.h"
@@ -259,6 +261,297 @@ sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 	return str;
 }
 
+/* Prepared statements for the SOAP hot path, kept across requests.
+ * Each connection has a cache of its own, so one busy connection can't
+ * crowd the others out.  Connections are per thread, so only the list
+ * of caches needs the lock; a cache is only used by its own thread. */
+#define SQL_STMT_CACHE 32
+
+struct stmt_cache {
+	sqlite3 *db;
+	struct {
+		char *sql;
+		sqlite3_stmt *stmt;
+		int busy;
+		unsigned long used;
+	} slot[SQL_STMT_CACHE];
+	unsigned long clock;
+	struct stmt_cache *next;
+};
+static struct stmt_cache *stmt_caches;
+static pthread_mutex_t stmt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct stmt_cache *
+get_stmt_cache(sqlite3 *db, int create)
+{
+	struct stmt_cache *c;
+
+	pthread_mutex_lock(&stmt_lock);
+	for (c = stmt_caches; c; c = c->next)
+	{
+		if (c->db == db)
+			break;
+	}
+	if (!c && create)
+	{
+		c = calloc(1, sizeof(*c));
+		if (c)
+		{
+			c->db = db;
+			c->next = stmt_caches;
+			stmt_caches = c;
+		}
+	}
+	pthread_mutex_unlock(&stmt_lock);
+
+	return c;
+}
+
+sqlite3_stmt *
+sql_prepare_cached(sqlite3 *db, const char *sql)
+{
+	struct stmt_cache *c;
+	sqlite3_stmt *stmt;
+	int i, slot = -1;
+	char *copy;
+
+	c = get_stmt_cache(db, 1);
+	for (i = 0; c && i < SQL_STMT_CACHE; i++)
+	{
+		if (!c->slot[i].sql || c->slot[i].busy ||
+		    strcmp(c->slot[i].sql, sql) != 0)
+			continue;
+		c->slot[i].busy = 1;
+		c->slot[i].used = ++c->clock;
+		return c->slot[i].stmt;
+	}
+
+	if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+		return NULL;
+	}
+	if (!c)
+		return stmt;
+
+	/* Take a free slot, or evict the least recently used statement */
+	for (i = 0; i < SQL_STMT_CACHE; i++)
+	{
+		if (!c->slot[i].sql)
+		{
+			slot = i;
+			break;
+		}
+		if (!c->slot[i].busy &&
+		    (slot < 0 || c->slot[i].used < c->slot[slot].used))
+			slot = i;
+	}
+	if (slot < 0)
+		return stmt;
+	copy = strdup(sql);
+	if (!copy)
+		return stmt;
+	if (c->slot[slot].sql)
+	{
+		sqlite3_finalize(c->slot[slot].stmt);
+		free(c->slot[slot].sql);
+	}
+	c->slot[slot].sql = copy;
+	c->slot[slot].stmt = stmt;
+	c->slot[slot].busy = 1;
+	c->slot[slot].used = ++c->clock;
+
+	return stmt;
+}
+
+void
+sql_release_cached(sqlite3_stmt *stmt)
+{
+	struct stmt_cache *c;
+	int i;
+
+	if (!stmt)
+		return;
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	c = get_stmt_cache(sqlite3_db_handle(stmt), 0);
+	for (i = 0; c && i < SQL_STMT_CACHE; i++)
+	{
+		if (c->slot[i].sql && c->slot[i].stmt == stmt)
+		{
+			c->slot[i].busy = 0;
+			return;
+		}
+	}
+	/* Not cached; it was a one-off */
+	sqlite3_finalize(stmt);
+}
+
+void
+sql_flush_cached(sqlite3 *db)
+{
+	struct stmt_cache *c, **prev;
+	int i;
+
+	pthread_mutex_lock(&stmt_lock);
+	for (prev = &stmt_caches; (c = *prev); prev = &c->next)
+	{
+		if (c->db == db)
+		{
+			*prev = c->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stmt_lock);
+	if (!c)
+		return;
+
+	for (i = 0; i < SQL_STMT_CACHE; i++)
+	{
+		if (!c->slot[i].sql)
+			continue;
+		sqlite3_finalize(c->slot[i].stmt);
+		free(c->slot[i].sql);
+	}
+	free(c);
+}
+
+/* Bind a named parameter if the statement uses it. */
+int
+sql_bind_text(sqlite3_stmt *stmt, const char *name, const char *value)
+{
+	int idx = sqlite3_bind_parameter_index(stmt, name);
+
+	if (!idx)
+		return SQLITE_OK;
+	return sqlite3_bind_text(stmt, idx, value, -1, SQLITE_STATIC);
+}
+
+int
+sql_bind_int(sqlite3_stmt *stmt, const char *name, int value)
+{
+	int idx = sqlite3_bind_parameter_index(stmt, name);
+
+	if (!idx)
+		return SQLITE_OK;
+	return sqlite3_bind_int(stmt, idx, value);
+}
+
+/* Each object's CHILD_COUNT, and how many of those children have a
+ * password, are kept up to date by triggers on OBJECTS.  A fresh scan
+ * installs them only once it is done, so that they don't slow it down,
+ * and the counts are then filled in here in one pass. */
+int
+db_child_counts(sqlite3 *db)
+{
+	int ret;
+
+	ret = sql_exec(db, "BEGIN");
+	if (ret != SQLITE_OK)
+		return ret;
+	ret = sql_exec(db, "UPDATE OBJECTS set"
+	                   " CHILD_COUNT = (SELECT count(*) from OBJECTS c"
+	                   "  where c.PARENT_ID = OBJECTS.OBJECT_ID),"
+	                   " LOCKED_COUNT = (SELECT count(*) from OBJECTS c"
+	                   "  where c.PARENT_ID = OBJECTS.OBJECT_ID and ifnull(c.PASSWORD, '') != '')"
+	                   " where CLASS glob 'container*'");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "CREATE TRIGGER IF NOT EXISTS TRG_OBJECTS_INSERT"
+		                   " AFTER INSERT ON OBJECTS BEGIN"
+		                   " UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT + 1,"
+		                   "  LOCKED_COUNT = LOCKED_COUNT + (ifnull(new.PASSWORD, '') != '')"
+		                   "  where OBJECT_ID = new.PARENT_ID;"
+		                   " END");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "CREATE TRIGGER IF NOT EXISTS TRG_OBJECTS_DELETE"
+		                   " AFTER DELETE ON OBJECTS BEGIN"
+		                   " UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT - 1,"
+		                   "  LOCKED_COUNT = LOCKED_COUNT - (ifnull(old.PASSWORD, '') != '')"
+		                   "  where OBJECT_ID = old.PARENT_ID;"
+		                   " END");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "CREATE TRIGGER IF NOT EXISTS TRG_OBJECTS_MOVE"
+		                   " AFTER UPDATE OF PARENT_ID, PASSWORD ON OBJECTS BEGIN"
+		                   " UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT - 1,"
+		                   "  LOCKED_COUNT = LOCKED_COUNT - (ifnull(old.PASSWORD, '') != '')"
+		                   "  where OBJECT_ID = old.PARENT_ID;"
+		                   " UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT + 1,"
+		                   "  LOCKED_COUNT = LOCKED_COUNT + (ifnull(new.PASSWORD, '') != '')"
+		                   "  where OBJECT_ID = new.PARENT_ID;"
+		                   " END");
+	sql_exec(db, ret == SQLITE_OK ? "COMMIT" : "ROLLBACK");
+
+	return ret;
+}
+
+/* Search criteria that look for a substring of the title, artist, album
+ * or genre are answered from a trigram FTS5 index on those columns.  It
+ * is kept current by triggers on DETAILS, and like the child counts it is
+ * only built once a fresh scan is done.  SQLite builds without FTS5 or
+ * the trigram tokenizer (3.34) keep using LIKE. */
+int
+db_text_index(sqlite3 *db)
+{
+	int ret;
+
+	if (sql_get_int_field(db, "SELECT count(*) from sqlite_master where name = 'DETAILS_FTS'") > 0)
+		return SQLITE_OK;
+	if (sqlite3_libversion_number() < 3034000 ||
+	    !sqlite3_compileoption_used("ENABLE_FTS5"))
+	{
+		DPRINTF(E_INFO, L_DB_SQL, "SQLite %s has no FTS5 trigram tokenizer; "
+			"Search will not use a text index\n", sqlite3_libversion());
+		return SQLITE_ERROR;
+	}
+
+	ret = sql_exec(db, "BEGIN");
+	if (ret != SQLITE_OK)
+		return ret;
+	ret = sql_exec(db, "CREATE VIRTUAL TABLE DETAILS_FTS USING fts5"
+	                   "(TITLE, ARTIST, ALBUM, GENRE,"
+	                   " content='DETAILS', content_rowid='ID', tokenize='trigram')");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "CREATE TRIGGER TRG_DETAILS_FTS_INSERT"
+		                   " AFTER INSERT ON DETAILS BEGIN"
+		                   " INSERT into DETAILS_FTS (rowid, TITLE, ARTIST, ALBUM, GENRE)"
+		                   "  values (new.ID, new.TITLE, new.ARTIST, new.ALBUM, new.GENRE);"
+		                   " END");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "CREATE TRIGGER TRG_DETAILS_FTS_DELETE"
+		                   " AFTER DELETE ON DETAILS BEGIN"
+		                   " INSERT into DETAILS_FTS (DETAILS_FTS, rowid, TITLE, ARTIST, ALBUM, GENRE)"
+		                   "  values ('delete', old.ID, old.TITLE, old.ARTIST, old.ALBUM, old.GENRE);"
+		                   " END");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "CREATE TRIGGER TRG_DETAILS_FTS_UPDATE"
+		                   " AFTER UPDATE OF TITLE, ARTIST, ALBUM, GENRE ON DETAILS BEGIN"
+		                   " INSERT into DETAILS_FTS (DETAILS_FTS, rowid, TITLE, ARTIST, ALBUM, GENRE)"
+		                   "  values ('delete', old.ID, old.TITLE, old.ARTIST, old.ALBUM, old.GENRE);"
+		                   " INSERT into DETAILS_FTS (rowid, TITLE, ARTIST, ALBUM, GENRE)"
+		                   "  values (new.ID, new.TITLE, new.ARTIST, new.ALBUM, new.GENRE);"
+		                   " END");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "INSERT into DETAILS_FTS (DETAILS_FTS) values ('rebuild')");
+	sql_exec(db, ret == SQLITE_OK ? "COMMIT" : "ROLLBACK");
+
+	return ret;
+}
+
+/* Whether db_text_index() has built the index yet.  Once it exists it is
+ * only ever dropped along with the whole database. */
+int
+db_has_text_index(sqlite3 *db)
+{
+	static int found = 0;
+
+	if (!found)
+		found = sql_get_int_field(db, "SELECT count(*) from sqlite_master"
+		                              " where name = 'DETAILS_FTS'") > 0;
+
+	return found;
+}
+
 int
 db_upgrade(sqlite3 *db)
 {
@@ -294,6 +587,23 @@ db_upgrade(sqlite3 *db)
 	    ret = sql_exec(db, "ALTER TABLE OBJECTS ADD COLUMN PASSWORD CHAR(10) DEFAULT NULL");
 	    if (ret != SQLITE_OK) return -1;
 	}
+	if (db_vers < 13)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 13);
+		ret = sql_exec(db, "ALTER TABLE OBJECTS ADD CHILD_COUNT INTEGER DEFAULT 0");
+		if (ret == SQLITE_OK)
+			ret = sql_exec(db, "ALTER TABLE OBJECTS ADD LOCKED_COUNT INTEGER DEFAULT 0");
+		if (ret == SQLITE_OK)
+			ret = db_child_counts(db);
+		if (ret != SQLITE_OK)
+			return 12;
+	}
+	if (db_vers < 14)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 14);
+		/* Without FTS5, Search just keeps using LIKE */
+		db_text_index(db);
+	}
 
 	sql_exec(db, "PRAGMA user_version = %d", DB_VERSION);
 
@@ -33,12 +33,26 @@
 #ifndef HAVE_SQLITE3_PREPARE_V2
 #define sqlite3_prepare_v2 sqlite3_prepare
 #endif
+#ifndef HAVE_SQLITE3_PREPARE_V3
+#define sqlite3_prepare_v3(db, sql, len, flags, stmt, tail) sqlite3_prepare_v2(db, sql, len, stmt, tail)
+#endif
+#ifndef SQLITE_PREPARE_PERSISTENT
+#define SQLITE_PREPARE_PERSISTENT 0
+#endif
 
 int sql_exec(sqlite3 *db, const char *fmt, ...);
 int sql_get_table(sqlite3 *db, const char *zSql, char ***pazResult, int *pnRow, int *pnColumn);
 int sql_get_int_field(sqlite3 *db, const char *fmt, ...);
 int64_t sql_get_int64_field(sqlite3 *db, const char *fmt, ...);
 char * sql_get_text_field(sqlite3 *db, const char *fmt, ...);
+sqlite3_stmt * sql_prepare_cached(sqlite3 *db, const char *sql);
+void sql_release_cached(sqlite3_stmt *stmt);
+void sql_flush_cached(sqlite3 *db);
+int sql_bind_text(sqlite3_stmt *stmt, const char *name, const char *value);
+int sql_bind_int(sqlite3_stmt *stmt, const char *name, int value);
+int db_child_counts(sqlite3 *db);
+int db_text_index(sqlite3 *db);
+int db_has_text_index(sqlite3 *db);
 int db_upgrade(sqlite3 *db);
 
 #endif
@@ -54,6 +54,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/param.h>
@@ -114,6 +116,101 @@ LIST_HEAD(listheadnotif, upnp_event_notify) notifylist = { NULL };
 #define MAX_SUBSCRIBERS 500
 static uint16_t nsubscribers = 0;
 
+/* With http_listeners, a SUBSCRIBE, its renewals and its UNSUBSCRIBE may
+ * each be accepted by a different process.  Subscriptions are then also
+ * kept in a table shared by all of them, and only the main process sends
+ * events: upnpevents_sync() takes in the subscriptions added elsewhere,
+ * and drops the ones removed elsewhere. */
+#define SHARED_CALLBACK_LEN 512
+struct shared_subscriber {
+	int used;
+	enum subscriber_service_enum service;
+	time_t timeout;
+	char uuid[42];
+	char callback[SHARED_CALLBACK_LEN];
+};
+static struct shared_subscribers {
+	pthread_mutex_t lock;
+	struct shared_subscriber sub[MAX_SUBSCRIBERS];
+} *shared = NULL;
+
+#define SHARED_IN_LISTENER() (shared && GETFLAG(HTTP_LISTENER_MASK))
+
+/* Look up a subscription in the shared table.  Call with the lock held. */
+static struct shared_subscriber *
+shared_find(const char *sid)
+{
+	int i;
+
+	for (i = 0; i < MAX_SUBSCRIBERS; i++)
+	{
+		if (shared->sub[i].used && memcmp(sid, shared->sub[i].uuid, 41) == 0)
+			return &shared->sub[i];
+	}
+	return NULL;
+}
+
+static int
+shared_add(const struct subscriber *sub)
+{
+	int i, ret = -1;
+
+	pthread_mutex_lock(&shared->lock);
+	for (i = 0; i < MAX_SUBSCRIBERS; i++)
+	{
+		if (!shared->sub[i].used)
+		{
+			shared->sub[i].used = 1;
+			shared->sub[i].service = sub->service;
+			shared->sub[i].timeout = sub->timeout;
+			memcpy(shared->sub[i].uuid, sub->uuid, sizeof(sub->uuid));
+			strncpyt(shared->sub[i].callback, sub->callback, SHARED_CALLBACK_LEN);
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&shared->lock);
+
+	return ret;
+}
+
+static int
+shared_remove(const char *sid)
+{
+	struct shared_subscriber *ssub;
+
+	pthread_mutex_lock(&shared->lock);
+	ssub = shared_find(sid);
+	if (ssub)
+		ssub->used = 0;
+	pthread_mutex_unlock(&shared->lock);
+
+	return ssub ? 0 : -1;
+}
+
+/* Set up the shared table.  This has to happen before the HTTP listener
+ * processes are forked. */
+int
+upnpevents_share(void)
+{
+	pthread_mutexattr_t attr;
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ|PROT_WRITE,
+	              MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+	{
+		shared = NULL;
+		return -1;
+	}
+	memset(shared, 0, sizeof(*shared));
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&shared->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	return 0;
+}
+
 /* create a new subscriber */
 static struct subscriber *
 newSubscriber(const char * eventurl, const char * callback, int callbacklen)
@@ -157,11 +254,27 @@ upnpevents_addSubscriber(const char * eventurl,
 	       eventurl, callbacklen, callback, timeout);
 	if (nsubscribers >= MAX_SUBSCRIBERS)
 		return NULL;
+	if (shared && callbacklen >= SHARED_CALLBACK_LEN)
+		return NULL;
 	tmp = newSubscriber(eventurl, callback, callbacklen);
 	if(!tmp)
 		return NULL;
 	if(timeout)
 		tmp->timeout = time(NULL) + timeout;
+	if (shared && shared_add(tmp) != 0)
+	{
+		free(tmp);
+		return NULL;
+	}
+	/* the main process will send the events */
+	if (SHARED_IN_LISTENER())
+	{
+		static char uuid[42];
+
+		memcpy(uuid, tmp->uuid, sizeof(uuid));
+		free(tmp);
+		return uuid;
+	}
 	LIST_INSERT_HEAD(&subscriberlist, tmp, entries);
 	nsubscribers++;
 	upnp_event_create_notify(tmp);
@@ -173,23 +286,45 @@ int
 renewSubscription(const char * sid, int sidlen, int timeout)
 {
 	struct subscriber * sub;
+	struct shared_subscriber *ssub;
+
+	if (shared)
+	{
+		/* upnpevents_sync() passes it on to the main process' copy */
+		pthread_mutex_lock(&shared->lock);
+		ssub = shared_find(sid);
+		if (ssub)
+			ssub->timeout = (timeout ? time(NULL) + timeout : 0);
+		pthread_mutex_unlock(&shared->lock);
+		if (!ssub)
+			return -1;
+		if (SHARED_IN_LISTENER())
+			return 0;
+	}
 	for(sub = subscriberlist.lh_first; sub != NULL; sub = sub->entries.le_next) {
 		if(memcmp(sid, sub->uuid, 41) == 0) {
 			sub->timeout = (timeout ? time(NULL) + timeout : 0);
 			return 0;
 		}
 	}
-	return -1;
+	return shared ? 0 : -1;
 }
 
 int
 upnpevents_removeSubscriber(const char * sid, int sidlen)
 {
 	struct subscriber * sub;
+	int ret = -1;
 	if(!sid)
 		return -1;
 	DPRINTF(E_DEBUG, L_HTTP, "removeSubscriber(%.*s)\n",
 	       sidlen, sid);
+	if (shared)
+	{
+		ret = shared_remove(sid);
+		if (SHARED_IN_LISTENER())
+			return ret;
+	}
 	for(sub = subscriberlist.lh_first; sub != NULL; sub = sub->entries.le_next) {
 		if(memcmp(sid, sub->uuid, 41) == 0) {
 			if(sub->notify) {
@@ -201,7 +336,7 @@ upnpevents_removeSubscriber(const char * sid, int sidlen)
 			return 0;
 		}
 	}
-	return -1;
+	return ret;
 }
 
 void
@@ -445,6 +580,8 @@ void upnpevents_gc(void)
 				obj->sub->notify = NULL;
 			/* remove also the subscriber from the list if there was an error */
 			if(obj->state == EError && obj->sub) {
+				if (shared)
+					shared_remove(obj->sub->uuid);
 				LIST_REMOVE(obj->sub, entries);
 				nsubscribers--;
 				free(obj->sub);
@@ -460,6 +597,8 @@ void upnpevents_gc(void)
 	for(sub = subscriberlist.lh_first; sub != NULL; ) {
 		subnext = sub->entries.le_next;
 		if(sub->timeout && curtime > sub->timeout && sub->notify == NULL) {
+			if (shared)
+				shared_remove(sub->uuid);
 			LIST_REMOVE(sub, entries);
 			nsubscribers--;
 			free(sub);
@@ -467,3 +606,57 @@ void upnpevents_gc(void)
 		sub = subnext;
 	}
 }
+
+/* Bring the main process' subscriber list in line with the shared table */
+void
+upnpevents_sync(void)
+{
+	struct subscriber *sub, *next;
+	struct shared_subscriber *ssub;
+	int i;
+
+	if (!shared || GETFLAG(HTTP_LISTENER_MASK))
+		return;
+
+	pthread_mutex_lock(&shared->lock);
+	for (sub = subscriberlist.lh_first; sub != NULL; sub = next) {
+		next = sub->entries.le_next;
+		ssub = shared_find(sub->uuid);
+		if (ssub) {
+			sub->timeout = ssub->timeout;
+			continue;
+		}
+		/* unsubscribed in another process */
+		if (sub->notify)
+			sub->notify->sub = NULL;
+		LIST_REMOVE(sub, entries);
+		nsubscribers--;
+		free(sub);
+	}
+	for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+		size_t len;
+
+		ssub = &shared->sub[i];
+		if (!ssub->used)
+			continue;
+		for (sub = subscriberlist.lh_first; sub != NULL; sub = sub->entries.le_next) {
+			if (memcmp(ssub->uuid, sub->uuid, 41) == 0)
+				break;
+		}
+		if (sub)
+			continue;
+		/* subscribed in another process */
+		len = strlen(ssub->callback);
+		sub = calloc(1, sizeof(struct subscriber) + len + 1);
+		if (!sub)
+			break;
+		sub->service = ssub->service;
+		sub->timeout = ssub->timeout;
+		memcpy(sub->uuid, ssub->uuid, sizeof(sub->uuid));
+		memcpy(sub->callback, ssub->callback, len + 1);
+		LIST_INSERT_HEAD(&subscriberlist, sub, entries);
+		nsubscribers++;
+		upnp_event_create_notify(sub);
+	}
+	pthread_mutex_unlock(&shared->lock);
+}
@@ -67,6 +67,10 @@ void upnpevents_gc(void);
 
 int renewSubscription(const char * sid, int sidlen, int timeout);
 
+/* Share subscriptions with the HTTP listener processes */
+int upnpevents_share(void);
+void upnpevents_sync(void);
+
 #ifdef USE_MINIUPNPDCTL
 void write_events_details(int s);
 #endif
@@ -66,7 +66,7 @@
 #endif
 
 #define USE_FORK 1
-#define DB_VERSION 12
+#define DB_VERSION 14
 
 #ifdef READYNAS
 # define LOGFILE_NAME "upnp-av.log"
@@ -179,6 +179,7 @@
 #define DLNA_FLAG_TM_B           0x00400000
 #define DLNA_FLAG_TM_I           0x00800000
 #define DLNA_FLAG_TM_S           0x01000000
+#define DLNA_FLAG_SN_INCREASE    0x04000000
 #define DLNA_FLAG_LOP_BYTES      0x20000000
 #define DLNA_FLAG_LOP_NPT        0x40000000
 
@@ -204,6 +205,7 @@ extern uint32_t runtime_flags;
 #define RESCAN_MASK           0x0200
 #define SUBTITLES_MASK        0x0400
 #define FORCE_ALPHASORT_MASK  0x0800
+#define HTTP_LISTENER_MASK    0x1000	/* extra HTTP listener, see http_listeners */
 
 #define SETFLAG(mask)	runtime_flags |= mask
 #define GETFLAG(mask)	(runtime_flags & mask)
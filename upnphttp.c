@@ -47,12 +47,14 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/param.h>
+#include <poll.h>
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -82,9 +84,16 @@
 #include "clients.h"
 #include "process.h"
 #include "sendfile.h"
+#include "uring.h"
+#include "bandwidth.h"
+#include "monitor.h"
+#include "imgcache.h"
+#include "browsecache.h"
 
 #define MAX_BUFFER_SIZE 2147483647
 #define MIN_BUFFER_SIZE 65536
+#define MAX_CHUNKED_SIZE (1024 * 1024)	/* most of a chunked request body we accept */
+#define FOLLOW_IDLE 30		/* seconds a growing file may stall before the stream ends */
 
 #define INIT_STR(s, d) { s.data = d; s.size = sizeof(d); s.off = 0; }
 
@@ -103,18 +112,66 @@ static void SendResp_resizedimg(struct upnphttp *, char * url);
 static void SendResp_thumbnail(struct upnphttp *, char * url);
 static void SendResp_dlnafile(struct upnphttp *, char * url);
 static void Process_upnphttp(struct event *ev);
+static void continue_transfer(struct upnphttp *h);
+static void end_transfer(struct upnphttp *h);
+static void start_transfer(struct upnphttp *h, struct string_s *header, int fd, off_t offset, off_t end_offset);
+static int queue_data(struct upnphttp *h, const void *data, size_t len, void *tofree);
+static void make_etag(char *buf, long long id, time_t mtime, off_t size);
+static void put_connection_date(struct upnphttp *h, struct string_s *str);
+static void add_validators(struct string_s *str, const char *etag, time_t mtime);
+static int check_not_modified(struct upnphttp *h, const char *etag, time_t mtime);
+
+/* room for make_etag() */
+#define ETAG_LEN 64
+
+static int number_of_transfers = 0;
+
+/* Connections are recycled, along with a reasonably sized res_buf */
+#define MAX_FREE_UPNPHTTP 16
+#define MAX_FREE_RES_BUF  65536
+static LIST_HEAD(, upnphttp) free_upnphttp = LIST_HEAD_INITIALIZER(free_upnphttp);
+static int n_free_upnphttp = 0;
 
 struct upnphttp * 
 New_upnphttp(int s)
 {
 	struct upnphttp * ret;
+	char * res_buf = NULL;
+	int res_buf_alloclen = 0;
+	int flags;
 	if(s<0)
 		return NULL;
-	ret = (struct upnphttp *)malloc(sizeof(struct upnphttp));
-	if(ret == NULL)
-		return NULL;
-	memset(ret, 0, sizeof(struct upnphttp));
+	ret = LIST_FIRST(&free_upnphttp);
+	if(ret)
+	{
+		LIST_REMOVE(ret, entries);
+		n_free_upnphttp--;
+		res_buf = ret->res_buf;
+		res_buf_alloclen = ret->res_buf_alloclen;
+	}
+	else
+	{
+		ret = (struct upnphttp *)malloc(sizeof(struct upnphttp));
+		if(ret == NULL)
+			return NULL;
+	}
+	/* the arena needs no clearing */
+	memset(ret, 0, offsetof(struct upnphttp, req_arena));
+	ret->req_buf = ret->req_arena;
+	ret->req_buf[0] = '\0';
+	ret->req_bufalloc = sizeof(ret->req_arena);
+	ret->req_contentlen = -1;
+	ret->res_buf = res_buf;
+	ret->res_buf_alloclen = res_buf_alloclen;
+	ret->res_fd = -1;
+	ret->res_pipe[0] = ret->res_pipe[1] = -1;
 	ret->ev = (struct event ){ .fd = s, .rdwr = EVENT_READ, .process = Process_upnphttp, .data = ret };
+	/* responses are queued rather than sent with blocking writes */
+	flags = fcntl(s, F_GETFL, 0);
+	if(flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0)
+		DPRINTF(E_WARN, L_HTTP, "Failed to make socket non-blocking: %s\n", strerror(errno));
+	if(runtime_vars.keepalive_timeout > 0)
+		ret->deadline = time(NULL) + runtime_vars.keepalive_timeout;
 	event_module.add(&ret->ev);
 	return ret;
 }
@@ -122,7 +179,15 @@ New_upnphttp(int s)
 void
 CloseSocket_upnphttp(struct upnphttp * h)
 {
-
+	/* the event loop does this once the worker thread is done,
+	 * or once the output queue has drained */
+	if(h->state == 5 || h->state == 3)
+		return;
+	if(h->reqflags & FLAG_KEEPALIVE)
+	{
+		h->state = 4;
+		return;
+	}
 	event_module.del(&h->ev, EV_FLAG_CLOSING);
 	if(close(h->ev.fd) < 0)
 	{
@@ -137,313 +202,406 @@ Delete_upnphttp(struct upnphttp * h)
 {
 	if(h)
 	{
+		if(h->state == 3)
+			end_transfer(h);
+		h->reqflags &= ~FLAG_KEEPALIVE;
+		/* abandoned by the workers, and no longer in the event loop */
+		if(h->state == 5 && h->ev.fd >= 0)
+		{
+			close(h->ev.fd);
+			h->ev.fd = -1;
+		}
 		if(h->ev.fd >= 0)
 			CloseSocket_upnphttp(h);
-		free(h->req_buf);
+		if(h->req_buf != h->req_arena)
+			free(h->req_buf);
+		if(n_free_upnphttp < MAX_FREE_UPNPHTTP)
+		{
+			if(h->res_buf_alloclen > MAX_FREE_RES_BUF)
+			{
+				free(h->res_buf);
+				h->res_buf = NULL;
+				h->res_buf_alloclen = 0;
+			}
+			LIST_INSERT_HEAD(&free_upnphttp, h, entries);
+			n_free_upnphttp++;
+			return;
+		}
 		free(h->res_buf);
 		free(h);
 	}
 }
 
-/* parse HttpHeaders of the REQUEST */
+/* parse one header line of the REQUEST */
 static void
-ParseHttpHeaders(struct upnphttp * h)
+ParseHttpHeader(struct upnphttp * h, char * line, char * colon)
 {
-	int client = 0;
-	char * line;
-	char * colon;
+	int client = h->req_clienttype;
 	char * p;
 	int n;
-	line = h->req_buf;
-	/* TODO : check if req_buf, contentoff are ok */
-	while(line < (h->req_buf + h->req_contentoff))
+
+	if(strncasecmp(line, "Connection", 10)==0)
+	{
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		if(strncasecmp(p, "close", 5)==0)
+			h->reqflags |= FLAG_CLOSE;
+		else if(strncasecmp(p, "keep-alive", 10)==0)
+			h->reqflags |= FLAG_KEEPALIVE;
+	}
+	else if(strncasecmp(line, "Content-Length", 14)==0)
+	{
+		p = colon;
+		while(*p && (*p < '0' || *p > '9'))
+			p++;
+		h->req_contentlen = atoi(p);
+		if(h->req_contentlen < 0) {
+			DPRINTF(E_WARN, L_HTTP, "Invalid Content-Length %d", h->req_contentlen);
+			h->req_contentlen = 0;
+		}
+	}
+	else if(strncasecmp(line, "SOAPAction", 10)==0)
+	{
+		p = colon;
+		n = 0;
+		while(*p == ':' || *p == ' ' || *p == '\t')
+			p++;
+		while(p[n] >= ' ')
+			n++;
+		if(n >= 2 &&
+		   ((p[0] == '"' && p[n-1] == '"') ||
+		    (p[0] == '\'' && p[n-1] == '\'')))
+		{
+			p++;
+			n -= 2;
+		}
+		h->req_soapAction = p;
+		h->req_soapActionLen = n;
+	}
+	else if(strncasecmp(line, "Callback", 8)==0)
 	{
-		colon = strchr(line, ':');
-		if(colon)
+		p = colon;
+		while(*p && *p != '<' && *p != '\r' )
+			p++;
+		n = 0;
+		while(p[n] && p[n] != '>' && p[n] != '\r' )
+			n++;
+		h->req_Callback = p + 1;
+		h->req_CallbackLen = MAX(0, n - 1);
+	}
+	else if(strncasecmp(line, "SID", 3)==0)
+	{
+		//zqiu: fix bug for test 4.0.5
+		//Skip extra headers like "SIDHEADER: xxxxxx xxx"
+		for(p=line+3;p<colon;p++)
 		{
-			if(strncasecmp(line, "Content-Length", 14)==0)
-			{
-				p = colon;
-				while(*p && (*p < '0' || *p > '9'))
-					p++;
-				h->req_contentlen = atoi(p);
-				if(h->req_contentlen < 0) {
-					DPRINTF(E_WARN, L_HTTP, "Invalid Content-Length %d", h->req_contentlen);
-					h->req_contentlen = 0;
-				}
-			}
-			else if(strncasecmp(line, "SOAPAction", 10)==0)
-			{
-				p = colon;
-				n = 0;
-				while(*p == ':' || *p == ' ' || *p == '\t')
-					p++;
-				while(p[n] >= ' ')
-					n++;
-				if(n >= 2 &&
-				   ((p[0] == '"' && p[n-1] == '"') ||
-				    (p[0] == '\'' && p[n-1] == '\'')))
-				{
-					p++;
-					n -= 2;
-				}
-				h->req_soapAction = p;
-				h->req_soapActionLen = n;
-			}
-			else if(strncasecmp(line, "Callback", 8)==0)
-			{
-				p = colon;
-				while(*p && *p != '<' && *p != '\r' )
-					p++;
-				n = 0;
-				while(p[n] && p[n] != '>' && p[n] != '\r' )
-					n++;
-				h->req_Callback = p + 1;
-				h->req_CallbackLen = MAX(0, n - 1);
-			}
-			else if(strncasecmp(line, "SID", 3)==0)
-			{
-				//zqiu: fix bug for test 4.0.5
-				//Skip extra headers like "SIDHEADER: xxxxxx xxx"
-				for(p=line+3;p<colon;p++)
-				{
-					if(!isspace(*p))
-					{
-						p = NULL; //unexpected header
-						break;
-					}
-				}
-				if(p) {
-					p = colon + 1;
-					while(isspace(*p))
-						p++;
-					n = 0;
-					while(p[n] && !isspace(p[n]))
-						n++;
-					h->req_SID = p;
-					h->req_SIDLen = n;
-				}
-			}
-			else if(strncasecmp(line, "NT", 2)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				n = 0;
-				while(p[n] && !isspace(p[n]))
-					n++;
-				h->req_NT = p;
-				h->req_NTLen = n;
-			}
-			/* Timeout: Seconds-nnnn */
-			/* TIMEOUT
-			Recommended. Requested duration until subscription expires,
-			either number of seconds or infinite. Recommendation
-			by a UPnP Forum working committee. Defined by UPnP vendor.
-			Consists of the keyword "Second-" followed (without an
-			intervening space) by either an integer or the keyword "infinite". */
-			else if(strncasecmp(line, "Timeout", 7)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "Second-", 7)==0) {
-					h->req_Timeout = atoi(p+7);
-				}
-			}
-			// Range: bytes=xxx-yyy
-			else if(strncasecmp(line, "Range", 5)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "bytes=", 6)==0) {
-					h->reqflags |= FLAG_RANGE;
-					h->req_RangeStart = strtoll(p+6, &colon, 10);
-					h->req_RangeEnd = colon ? atoll(colon+1) : 0;
-					DPRINTF(E_DEBUG, L_HTTP, "Range Start-End: %lld - %lld\n",
-						(long long)h->req_RangeStart,
-						h->req_RangeEnd ? (long long)h->req_RangeEnd : -1);
-				}
-			}
-			else if(strncasecmp(line, "Host", 4)==0)
-			{
-				int i;
-				h->reqflags |= FLAG_HOST;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for(n = 0; n < n_lan_addr; n++)
-				{
-					for(i = 0; lan_addr[n].str[i]; i++)
-					{
-						if(lan_addr[n].str[i] != p[i])
-							break;
-					}
-					if(i && !lan_addr[n].str[i])
-					{
-						h->iface = n;
-						break;
-					}
-				}
-			}
-			else if(strncasecmp(line, "User-Agent", 10)==0)
-			{
-				int i;
-				/* Skip client detection if we already detected it. */
-				if( client )
-					goto next_header;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for (i = 0; client_types[i].name; i++)
-				{
-					if (client_types[i].match_type != EUserAgent)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
-				}
-			}
-			else if(strncasecmp(line, "X-AV-Client-Info", 16)==0)
-			{
-				int i;
-				/* Skip client detection if we already detected it. */
-				if( client && client_types[client].type < EStandardDLNA150 )
-					goto next_header;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for (i = 0; client_types[i].name; i++)
-				{
-					if (client_types[i].match_type != EXAVClientInfo)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
-				}
-			}
-			else if(strncasecmp(line, "Transfer-Encoding", 17)==0)
+			if(!isspace(*p))
 			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "chunked", 7)==0)
-				{
-					h->reqflags |= FLAG_CHUNKED;
-				}
-			}
-			else if(strncasecmp(line, "Accept-Language", 15)==0)
-			{
-				h->reqflags |= FLAG_LANGUAGE;
-			}
-			else if(strncasecmp(line, "getcontentFeatures.dlna.org", 27)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if( (*p != '1') || !isspace(p[1]) )
-					h->reqflags |= FLAG_INVALID_REQ;
-			}
-			else if(strncasecmp(line, "TimeSeekRange.dlna.org", 22)==0)
-			{
-				h->reqflags |= FLAG_TIMESEEK;
-			}
-			else if(strncasecmp(line, "PlaySpeed.dlna.org", 18)==0)
-			{
-				h->reqflags |= FLAG_PLAYSPEED;
-			}
-			else if(strncasecmp(line, "realTimeInfo.dlna.org", 21)==0)
-			{
-				h->reqflags |= FLAG_REALTIMEINFO;
+				p = NULL; //unexpected header
+				break;
 			}
-			else if(strncasecmp(line, "getAvailableSeekRange.dlna.org", 21)==0)
+		}
+		if(p) {
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			n = 0;
+			while(p[n] && !isspace(p[n]))
+				n++;
+			h->req_SID = p;
+			h->req_SIDLen = n;
+		}
+	}
+	else if(strncasecmp(line, "NT", 2)==0)
+	{
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		n = 0;
+		while(p[n] && !isspace(p[n]))
+			n++;
+		h->req_NT = p;
+		h->req_NTLen = n;
+	}
+	/* Timeout: Seconds-nnnn */
+	/* TIMEOUT
+	Recommended. Requested duration until subscription expires,
+	either number of seconds or infinite. Recommendation
+	by a UPnP Forum working committee. Defined by UPnP vendor.
+	Consists of the keyword "Second-" followed (without an
+	intervening space) by either an integer or the keyword "infinite". */
+	else if(strncasecmp(line, "Timeout", 7)==0)
+	{
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		if(strncasecmp(p, "Second-", 7)==0) {
+			h->req_Timeout = atoi(p+7);
+		}
+	}
+	// Range: bytes=xxx-yyy[,...]
+	else if(strncasecmp(line, "Range", 5)==0)
+	{
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		if(strncasecmp(p, "bytes=", 6)==0) {
+			/* parsed against the file size by parse_byteranges() */
+			h->reqflags |= FLAG_RANGE;
+			h->req_RangeList = p + 6;
+			DPRINTF(E_DEBUG, L_HTTP, "Range: %.*s\n",
+				(int)strcspn(h->req_RangeList, "\r\n"), h->req_RangeList);
+		}
+	}
+	else if(strncasecmp(line, "If-None-Match", 13)==0)
+	{
+		p = colon + 1;
+		while(*p == ' ' || *p == '\t')
+			p++;
+		h->req_IfNoneMatch = p;
+	}
+	else if(strncasecmp(line, "If-Modified-Since", 17)==0)
+	{
+		p = colon + 1;
+		while(*p == ' ' || *p == '\t')
+			p++;
+		h->req_IfModifiedSince = parse_http_date(p);
+	}
+	else if(strncasecmp(line, "Host", 4)==0)
+	{
+		int i;
+		h->reqflags |= FLAG_HOST;
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		for(n = 0; n < n_lan_addr; n++)
+		{
+			for(i = 0; lan_addr[n].str[i]; i++)
 			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if( (*p != '1') || !isspace(p[1]) )
-					h->reqflags |= FLAG_INVALID_REQ;
+				if(lan_addr[n].str[i] != p[i])
+					break;
 			}
-			else if(strncasecmp(line, "transferMode.dlna.org", 21)==0)
+			if(i && !lan_addr[n].str[i])
 			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "Streaming", 9)==0)
-				{
-					h->reqflags |= FLAG_XFERSTREAMING;
-				}
-				if(strncasecmp(p, "Interactive", 11)==0)
-				{
-					h->reqflags |= FLAG_XFERINTERACTIVE;
-				}
-				if(strncasecmp(p, "Background", 10)==0)
-				{
-					h->reqflags |= FLAG_XFERBACKGROUND;
-				}
+				h->iface = n;
+				break;
 			}
-			else if(strncasecmp(line, "getCaptionInfo.sec", 18)==0)
+		}
+	}
+	else if(strncasecmp(line, "User-Agent", 10)==0)
+	{
+		int i;
+		/* Skip client detection if we already detected it. */
+		if( client )
+			return;
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		for (i = 0; client_types[i].name; i++)
+		{
+			if (client_types[i].match_type != EUserAgent)
+				continue;
+			if (strstrc(p, client_types[i].match, '\r') != NULL)
 			{
-				h->reqflags |= FLAG_CAPTION;
+				client = i;
+				break;
 			}
-			else if(strncasecmp(line, "FriendlyName", 12)==0)
+		}
+	}
+	else if(strncasecmp(line, "X-AV-Client-Info", 16)==0)
+	{
+		int i;
+		/* Skip client detection if we already detected it. */
+		if( client && client_types[client].type < EStandardDLNA150 )
+			return;
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		for (i = 0; client_types[i].name; i++)
+		{
+			if (client_types[i].match_type != EXAVClientInfo)
+				continue;
+			if (strstrc(p, client_types[i].match, '\r') != NULL)
 			{
-				int i;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for (i = 0; client_types[i].name; i++)
-				{
-					if (client_types[i].match_type != EFriendlyName)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
-				}
+				client = i;
+				break;
 			}
-			else if(strncasecmp(line, "uctt.upnp.org:", 14)==0)
+		}
+	}
+	else if(strncasecmp(line, "Transfer-Encoding", 17)==0)
+	{
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		if(strncasecmp(p, "chunked", 7)==0)
+		{
+			h->reqflags |= FLAG_CHUNKED;
+		}
+	}
+	else if(strncasecmp(line, "Accept-Language", 15)==0)
+	{
+		h->reqflags |= FLAG_LANGUAGE;
+	}
+	else if(strncasecmp(line, "getcontentFeatures.dlna.org", 27)==0)
+	{
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		if( (*p != '1') || !isspace(p[1]) )
+			h->reqflags |= FLAG_INVALID_REQ;
+	}
+	else if(strncasecmp(line, "TimeSeekRange.dlna.org", 22)==0)
+	{
+		h->reqflags |= FLAG_TIMESEEK;
+	}
+	else if(strncasecmp(line, "PlaySpeed.dlna.org", 18)==0)
+	{
+		h->reqflags |= FLAG_PLAYSPEED;
+	}
+	else if(strncasecmp(line, "realTimeInfo.dlna.org", 21)==0)
+	{
+		h->reqflags |= FLAG_REALTIMEINFO;
+	}
+	else if(strncasecmp(line, "getAvailableSeekRange.dlna.org", 21)==0)
+	{
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		if( (*p != '1') || !isspace(p[1]) )
+			h->reqflags |= FLAG_INVALID_REQ;
+	}
+	else if(strncasecmp(line, "transferMode.dlna.org", 21)==0)
+	{
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		if(strncasecmp(p, "Streaming", 9)==0)
+		{
+			h->reqflags |= FLAG_XFERSTREAMING;
+		}
+		if(strncasecmp(p, "Interactive", 11)==0)
+		{
+			h->reqflags |= FLAG_XFERINTERACTIVE;
+		}
+		if(strncasecmp(p, "Background", 10)==0)
+		{
+			h->reqflags |= FLAG_XFERBACKGROUND;
+		}
+	}
+	else if(strncasecmp(line, "getCaptionInfo.sec", 18)==0)
+	{
+		h->reqflags |= FLAG_CAPTION;
+	}
+	else if(strncasecmp(line, "FriendlyName", 12)==0)
+	{
+		int i;
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		for (i = 0; client_types[i].name; i++)
+		{
+			if (client_types[i].match_type != EFriendlyName)
+				continue;
+			if (strstrc(p, client_types[i].match, '\r') != NULL)
 			{
-				/* Conformance testing */
-				SETFLAG(DLNA_STRICT_MASK);
+				client = i;
+				break;
 			}
 		}
-next_header:
-		line = strstr(line, "\r\n");
-		if (!line)
-			return;
-		line += 2;
 	}
-	if( h->reqflags & FLAG_CHUNKED )
+	else if(strncasecmp(line, "uctt.upnp.org:", 14)==0)
 	{
-		char *endptr;
-		h->req_chunklen = -1;
-		if( h->req_buflen <= h->req_contentoff )
-			return;
-		while( (line < (h->req_buf + h->req_buflen)) &&
-		       (h->req_chunklen = strtol(line, &endptr, 16)) &&
-		       (endptr != line) )
+		/* Conformance testing */
+		SETFLAG(DLNA_STRICT_MASK);
+	}
+	h->req_clienttype = client;
+}
+
+/* Parse the header lines received since the last call.
+ * Returns 1 once the blank line ending the headers is in. */
+static int
+ParseHttpHeaders(struct upnphttp * h)
+{
+	char * line;
+	char * eol;
+	char * colon;
+	int i;
+
+	while(h->req_parsed < h->req_buflen)
+	{
+		line = h->req_buf + h->req_parsed;
+		eol = memchr(line, '\n', h->req_buflen - h->req_parsed);
+		if(!eol)
+			return 0;
+		h->req_parsed = eol + 1 - h->req_buf;
+		if(line == h->req_buf)
 		{
-			endptr = strstr(endptr, "\r\n");
-			if (!endptr)
+			/* request line; set the interface here initially,
+			 * in case there is no Host header */
+			for(i = 0; i<n_lan_addr; i++)
 			{
-				return;
+				if( (h->clientaddr.s_addr & lan_addr[i].mask.s_addr)
+				   == (lan_addr[i].addr.s_addr & lan_addr[i].mask.s_addr))
+				{
+					h->iface = i;
+					break;
+				}
 			}
-			line = endptr+h->req_chunklen+2;
+			continue;
+		}
+		if(eol == line || (eol == line + 1 && *line == '\r'))
+		{
+			h->req_contentoff = h->req_parsed;
+			return 1;
 		}
+		colon = memchr(line, ':', eol - line);
+		if(colon)
+			ParseHttpHeader(h, line, colon);
+	}
+	return 0;
+}
 
-		if( endptr == line )
+/* Walk the chunks of a chunked body that have come in since the last
+ * call.  Returns 1 once the last chunk is in, 0 if more has to be
+ * received, and -1 if the body is malformed. */
+static int
+scan_chunks(struct upnphttp * h)
+{
+	char *line, *eol, *endptr;
+	long int len;
+
+	if( !h->req_chunkoff )
+		h->req_chunkoff = h->req_contentoff;
+	while( h->req_chunkoff < h->req_buflen )
+	{
+		line = h->req_buf + h->req_chunkoff;
+		eol = strstr(line, "\r\n");
+		if( !eol )
+			return 0;
+		len = strtol(line, &endptr, 16);
+		if( endptr == line || len < 0 )
+			return -1;
+		if( !len )
+			return 1;
+		/* the whole body has to fit, so bigger chunks can't be real */
+		if( len > MAX_CHUNKED_SIZE - (eol + 4 - (h->req_buf + h->req_contentoff)) )
 		{
-			h->req_chunklen = -1;
-			return;
+			DPRINTF(E_WARN, L_HTTP, "Chunked request body too large\n");
+			return -1;
 		}
+		h->req_chunkoff = eol + 2 + len + 2 - h->req_buf;
 	}
+
+	return 0;
+}
+
+/* Once all headers are in, look up the client */
+static void
+FinishHttpHeaders(struct upnphttp * h)
+{
+	int client = h->req_clienttype;
+
 	/* If the client type wasn't found, search the cache.
 	 * This is done because a lot of clients like to send a
 	 * different User-Agent with different types of requests. */
@@ -467,6 +625,18 @@ next_header:
 	}
 }
 
+/* Decide whether the connection stays open after this request */
+static void
+check_keepalive(struct upnphttp * h)
+{
+	if( runtime_vars.keepalive_timeout <= 0 ||
+	    h->req_count + 1 >= runtime_vars.keepalive_requests ||
+	    (h->reqflags & (FLAG_CLOSE|FLAG_CHUNKED)) )
+		h->reqflags &= ~FLAG_KEEPALIVE;
+	else if( strcmp(h->HttpVer, "HTTP/1.1") == 0 )
+		h->reqflags |= FLAG_KEEPALIVE;
+}
+
 /* very minimalistic 400 error message */
 static void
 Send400(struct upnphttp * h)
@@ -476,6 +646,7 @@ Send400(struct upnphttp * h)
 		"<BODY><H1>Bad Request</H1>The request is invalid"
 		" for this HTTP version.</BODY></HTML>\r\n";
 	h->respflags = FLAG_HTML;
+	h->reqflags &= ~FLAG_KEEPALIVE;
 	BuildResp2_upnphttp(h, 400, "Bad Request",
 	                    body400, sizeof(body400) - 1);
 	SendResp_upnphttp(h);
@@ -527,15 +698,16 @@ Send406(struct upnphttp * h)
 	CloseSocket_upnphttp(h);
 }
 
-/* very minimalistic 416 error message */
+/* very minimalistic 416 error message, with the size of the file */
 static void
-Send416(struct upnphttp * h)
+Send416(struct upnphttp * h, off_t size)
 {
 	static const char body416[] =
 		"<HTML><HEAD><TITLE>416 Requested Range Not Satisfiable</TITLE></HEAD>"
 		"<BODY><H1>Requested Range Not Satisfiable</H1>The requested range"
 		" was outside the file's size.</BODY></HTML>\r\n";
-	h->respflags = FLAG_HTML;
+	h->respflags = FLAG_HTML | FLAG_CONTENT_RANGE;
+	h->res_end = size - 1;
 	BuildResp2_upnphttp(h, 416, "Requested Range Not Satisfiable",
 	                    body416, sizeof(body416) - 1);
 	SendResp_upnphttp(h);
@@ -551,12 +723,28 @@ Send500(struct upnphttp * h)
 		"<BODY><H1>Internal Server Error</H1>Server encountered "
 		"and Internal Error.</BODY></HTML>\r\n";
 	h->respflags = FLAG_HTML;
+	h->reqflags &= ~FLAG_KEEPALIVE;
 	BuildResp2_upnphttp(h, 500, "Internal Server Errror",
 	                    body500, sizeof(body500) - 1);
 	SendResp_upnphttp(h);
 	CloseSocket_upnphttp(h);
 }
 
+/* very minimalistic 503 error message, for clients over their limits */
+void
+Send503(struct upnphttp * h)
+{
+	static const char body503[] =
+		"<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>"
+		"<BODY><H1>Service Unavailable</H1>Too many requests"
+		" from this client.</BODY></HTML>\r\n";
+	h->respflags = FLAG_HTML | FLAG_RETRY_AFTER;
+	BuildResp2_upnphttp(h, 503, "Service Unavailable",
+	                    body503, sizeof(body503) - 1);
+	SendResp_upnphttp(h);
+	CloseSocket_upnphttp(h);
+}
+
 /* very minimalistic 501 error message */
 void
 Send501(struct upnphttp * h)
@@ -566,29 +754,145 @@ Send501(struct upnphttp * h)
 		"<BODY><H1>Not Implemented</H1>The HTTP Method "
 		"is not implemented by this server.</BODY></HTML>\r\n";
 	h->respflags = FLAG_HTML;
+	h->reqflags &= ~FLAG_KEEPALIVE;
 	BuildResp2_upnphttp(h, 501, "Not Implemented",
 	                    body501, sizeof(body501) - 1);
 	SendResp_upnphttp(h);
 	CloseSocket_upnphttp(h);
 }
 
-/* Sends the description generated by the parameter */
+/* The descriptions only depend on settings that are fixed once the
+ * server is up, and control points fetch them over and over, so each
+ * variant is generated once and then served from memory. */
+enum desc_variant {
+	DESC_ROOT,
+	DESC_ROOT_XBOX,
+	DESC_ROOT_SAMSUNG,
+	DESC_CONTENTDIRECTORY,
+	DESC_CONNECTIONMGR,
+	DESC_MSREGISTRAR,
+	DESC_COUNT
+};
+
+static struct desc {
+	char * (*gen)(int *);
+	char *body;
+	int len;
+	char *header;	/* the header lines that never change */
+	int hlen;
+	char etag[ETAG_LEN];
+} descs[DESC_COUNT] = {
+	[DESC_ROOT] = { genRootDesc },
+	[DESC_ROOT_XBOX] = { genRootDesc },
+	[DESC_ROOT_SAMSUNG] = { genRootDescSamsung },
+	[DESC_CONTENTDIRECTORY] = { genContentDirectory },
+	[DESC_CONNECTIONMGR] = { genConnectionManager },
+	[DESC_MSREGISTRAR] = { genX_MS_MediaReceiverRegistrar },
+};
+static time_t descs_time;
+
+static char *
+gen_xbox_desc(struct desc *d)
+{
+	/* Xbox 360s need a special model number and friendly_name to
+	 * recognize the server */
+	char model_sav[2];
+	char *desc;
+	int i = 0;
+
+	memcpy(model_sav, modelnumber, 2);
+	strcpy(modelnumber, "1");
+	if( !strchr(friendly_name, ':') )
+	{
+		i = strlen(friendly_name);
+		snprintf(friendly_name+i, FRIENDLYNAME_MAX_LEN-i, ": 1");
+	}
+	desc = d->gen(&d->len);
+	if( i )
+		friendly_name[i] = '\0';
+	memcpy(modelnumber, model_sav, 2);
+
+	return desc;
+}
+
+int
+BuildDescs_upnphttp(void)
+{
+	char header[512];
+	char date[HTTP_DATE_LEN+1];
+	struct string_s str;
+	struct desc *d;
+	int ret = 0;
+
+	descs_time = time(NULL);
+	for( d = descs; d < descs + DESC_COUNT; d++ )
+	{
+		free(d->body);
+		free(d->header);
+		d->header = NULL;
+		if( d == &descs[DESC_ROOT_XBOX] )
+			d->body = gen_xbox_desc(d);
+		else
+			d->body = d->gen(&d->len);
+		if( !d->body )
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Failed to generate XML description\n");
+			ret = -1;
+			continue;
+		}
+		make_etag(d->etag, 0, descs_time, d->len);
+
+		INIT_STR(str, header);
+		strcatf(&str, "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+		              "Content-Length: %d\r\n"
+		              "Server: " MINIDLNA_SERVER_STRING "\r\n"
+		              "EXT:\r\n", d->len);
+		strcatf(&str, "ETag: %s\r\nLast-Modified: ", d->etag);
+		strcatn(&str, date, http_time(date, descs_time));
+		strcats(&str, "\r\n");
+		d->header = strdup(header);
+		d->hlen = str.off;
+		if( !d->header )
+		{
+			free(d->body);
+			d->body = NULL;
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/* Sends one of the prebuilt descriptions */
 static void
-sendXMLdesc(struct upnphttp * h, char * (f)(int *))
+sendXMLdesc(struct upnphttp * h, enum desc_variant variant)
 {
-	char * desc;
-	int len;
-	desc = f(&len);
-	if(!desc)
+	const struct desc *d = &descs[variant];
+	char header[512];
+	struct string_s str;
+
+	if(!d->body)
 	{
-		DPRINTF(E_ERROR, L_HTTP, "Failed to generate XML description\n");
+		DPRINTF(E_ERROR, L_HTTP, "XML description is not available\n");
 		Send500(h);
 		return;
 	}
-	BuildResp_upnphttp(h, desc, len);
-	SendResp_upnphttp(h);
+	if( check_not_modified(h, d->etag, descs_time) )
+		return;
+
+	INIT_STR(str, header);
+	strcats(&str, "HTTP/1.1 200 OK\r\n");
+	put_connection_date(h, &str);
+	strcatn(&str, d->header, d->hlen);
+	if(h->reqflags & FLAG_LANGUAGE)
+		strcats(&str, "Content-Language: en\r\n");
+	strcats(&str, "\r\n");
+
+	/* the buffer stays around, so it is sent straight from there */
+	if(h->req_command != EHead)
+		queue_data(h, d->body, d->len, NULL);
+	start_transfer(h, &str, -1, 0, -1);
 	CloseSocket_upnphttp(h);
-	free(desc);
 }
 
 #ifdef READYNAS
@@ -612,8 +916,10 @@ static void
 SendResp_presentation(struct upnphttp * h)
 {
 	struct string_s str;
-	char body[4096];
+	char body[8192];
 	int a, v, p, i;
+	unsigned long hits, misses;
+	size_t bytes;
 
 	INIT_STR(str, body);
 
@@ -642,19 +948,31 @@ SendResp_presentation(struct upnphttp * h)
 	strcatf(&str,
 		"<h3>Connected clients</h3>"
 		"<table border=1 cellpadding=10>"
-		"<tr><td>ID</td><td>Type</td><td>IP Address</td><td>HW Address</td><td>Connections</td></tr>");
+		"<tr><td>ID</td><td>Type</td><td>IP Address</td><td>HW Address</td><td>Connections</td><td>Turned away</td></tr>");
 	for (i = 0; i < CLIENT_CACHE_SLOTS; i++)
 	{
 		if (!clients[i].addr.s_addr)
 			continue;
-		strcatf(&str, "<tr><td>%d</td><td>%s</td><td>%s</td><td>%02X:%02X:%02X:%02X:%02X:%02X</td><td>%d</td></tr>",
+		strcatf(&str, "<tr><td>%d</td><td>%s</td><td>%s</td><td>%02X:%02X:%02X:%02X:%02X:%02X</td><td>%d</td><td>%lu</td></tr>",
 				i, clients[i].type->name, inet_ntoa(clients[i].addr),
 				clients[i].mac[0], clients[i].mac[1], clients[i].mac[2],
-				clients[i].mac[3], clients[i].mac[4], clients[i].mac[5], clients[i].connections);
+				clients[i].mac[3], clients[i].mac[4], clients[i].mac[5], clients[i].connections,
+				clients[i].rejected);
 	}
 	strcatf(&str, "</table>");
 
-	strcatf(&str, "<br>%d connection%s currently open<br>", number_of_children, (number_of_children == 1 ? "" : "s"));
+	i = number_of_children + number_of_transfers;
+	strcatf(&str, "<br>%d connection%s currently open<br>", i, (i == 1 ? "" : "s"));
+	readahead_stats(&hits, &misses);
+	strcatf(&str, "Read-ahead: %lu hit%s, %lu miss%s<br>",
+		hits, (hits == 1 ? "" : "s"), misses, (misses == 1 ? "" : "es"));
+	browsecache_stats(&hits, &misses, &bytes);
+	strcatf(&str, "Browse cache: %lu hit%s, %lu miss%s, %zu KB held<br>",
+		hits, (hits == 1 ? "" : "s"), misses, (misses == 1 ? "" : "es"), bytes / 1024);
+	strcatf(&str, "Turned away: %lu over max_client_streams, %lu over their share"
+		" of max_connections, %lu over max_client_requests<br>",
+		client_admit_rejects(ADMIT_CLIENT_STREAMS), client_admit_rejects(ADMIT_OVERLOAD),
+		client_admit_rejects(ADMIT_CLIENT_REQUESTS));
 	strcatf(&str, "</BODY></HTML>\r\n");
 
 	BuildResp_upnphttp(h, str.data, str.off);
@@ -683,6 +1001,7 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 				"<html><body>Bad request</body></html>";
 			DPRINTF(E_WARN, L_HTTP, "No SOAPAction in HTTP headers\n");
 			h->respflags = FLAG_HTML;
+			h->reqflags &= ~FLAG_KEEPALIVE;
 			BuildResp2_upnphttp(h, 400, "Bad Request",
 			                    err400str, sizeof(err400str) - 1);
 			SendResp_upnphttp(h);
@@ -842,39 +1161,32 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 		HttpVer[i] = *(p++);
 	HttpVer[i] = '\0';
 
-	/* set the interface here initially, in case there is no Host header */
-	for(i = 0; i<n_lan_addr; i++)
-	{
-		if( (h->clientaddr.s_addr & lan_addr[i].mask.s_addr)
-		   == (lan_addr[i].addr.s_addr & lan_addr[i].mask.s_addr))
-		{
-			h->iface = i;
-			break;
-		}
-	}
-
-	ParseHttpHeaders(h);
+	check_keepalive(h);
 
 	/* see if we need to wait for remaining data */
 	if( (h->reqflags & FLAG_CHUNKED) )
 	{
-		if( h->req_chunklen == -1)
+		i = scan_chunks(h);
+		if( i < 0 )
 		{
 			Send400(h);
 			return;
 		}
-		if( h->req_chunklen )
+		if( i == 0 )
 		{
 			h->state = 2;
 			return;
 		}
 		char *chunkstart, *chunk, *endptr, *endbuf;
+		char *bufend = h->req_buf + h->req_buflen;
 		chunk = endbuf = chunkstart = h->req_buf + h->req_contentoff;
 
-		while( (h->req_chunklen = strtol(chunk, &endptr, 16)) && (endptr != chunk) )
+		while( chunk < bufend &&
+		       (h->req_chunklen = strtol(chunk, &endptr, 16)) && (endptr != chunk) )
 		{
 			endptr = strstr(endptr, "\r\n");
-			if (!endptr)
+			if( !endptr || h->req_chunklen < 0 ||
+			    h->req_chunklen > bufend - (endptr + 2) )
 			{
 				Send400(h);
 				return;
@@ -927,40 +1239,28 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 			/* If it's a Xbox360, we might need a special friendly_name to be recognized */
 			if( h->req_client && h->req_client->type->type == EXbox )
 			{
-				char model_sav[2];
-				i = 0;
-				memcpy(model_sav, modelnumber, 2);
-				strcpy(modelnumber, "1");
-				if( !strchr(friendly_name, ':') )
-				{
-					i = strlen(friendly_name);
-					snprintf(friendly_name+i, FRIENDLYNAME_MAX_LEN-i, ": 1");
-				}
-				sendXMLdesc(h, genRootDesc);
-				if( i )
-					friendly_name[i] = '\0';
-				memcpy(modelnumber, model_sav, 2);
+				sendXMLdesc(h, DESC_ROOT_XBOX);
 			}
 			else if( h->req_client && h->req_client->type->flags & FLAG_SAMSUNG_DCM10 )
 			{
-				sendXMLdesc(h, genRootDescSamsung);
+				sendXMLdesc(h, DESC_ROOT_SAMSUNG);
 			}
 			else
 			{
-				sendXMLdesc(h, genRootDesc);
+				sendXMLdesc(h, DESC_ROOT);
 			}
 		}
 		else if(strcmp(CONTENTDIRECTORY_PATH, HttpUrl) == 0)
 		{
-			sendXMLdesc(h, genContentDirectory);
+			sendXMLdesc(h, DESC_CONTENTDIRECTORY);
 		}
 		else if(strcmp(CONNECTIONMGR_PATH, HttpUrl) == 0)
 		{
-			sendXMLdesc(h, genConnectionManager);
+			sendXMLdesc(h, DESC_CONNECTIONMGR);
 		}
 		else if(strcmp(X_MS_MEDIARECEIVERREGISTRAR_PATH, HttpUrl) == 0)
 		{
-			sendXMLdesc(h, genX_MS_MediaReceiverRegistrar);
+			sendXMLdesc(h, DESC_MSREGISTRAR);
 		}
 		else if(strncmp(HttpUrl, "/MediaItems/", 12) == 0)
 		{
@@ -1044,104 +1344,387 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 	}
 }
 
+/* Process the request in req_buf once all of its headers are in */
 static void
-Process_upnphttp(struct event *ev)
+ProcessBufferedQuery_upnphttp(struct upnphttp * h)
 {
-	char buf[2048];
-	struct upnphttp *h = ev->data;
-	int n;
+	if(ParseHttpHeaders(h))
+	{
+		/* no Content-Length header */
+		if(h->req_contentlen < 0)
+			h->req_contentlen = h->req_buflen - h->req_contentoff;
+		/* only once; a chunked body may take many more reads */
+		FinishHttpHeaders(h);
+		ProcessHttpQuery_upnphttp(h);
+	}
+}
 
-	switch(h->state)
+/* Make room for size bytes in req_buf.  Requests start out in the
+ * connection's arena, and only move to the heap when they outgrow it.
+ * The header values pointing into req_buf follow it around. */
+static int
+grow_req_buf(struct upnphttp * h, int size)
+{
+	const char ** ptrs[] = { &h->req_soapAction, &h->req_Callback,
+	                         &h->req_NT, &h->req_SID, &h->req_RangeList,
+	                         &h->req_IfNoneMatch };
+	ptrdiff_t offs[sizeof(ptrs) / sizeof(ptrs[0])];
+	char * buf;
+	int alloc, i;
+
+	if(size <= h->req_bufalloc)
+		return 0;
+	alloc = MAX(h->req_bufalloc * 2, size);
+	for(i = 0; i < sizeof(offs) / sizeof(offs[0]); i++)
+		offs[i] = *ptrs[i] ? *ptrs[i] - h->req_buf : -1;
+	if(h->req_buf == h->req_arena)
 	{
-	case 0:
-		n = recv(h->ev.fd, buf, 2048, 0);
-		if(n<0)
-		{
-			DPRINTF(E_ERROR, L_HTTP, "recv (state0): %s\n", strerror(errno));
-			h->state = 100;
-		}
-		else if(n==0)
-		{
-			DPRINTF(E_WARN, L_HTTP, "HTTP Connection closed unexpectedly\n");
-			h->state = 100;
-		}
-		else
-		{
-			int new_req_buflen;
-			const char * endheaders;
-			/* if 1st arg of realloc() is null,
-			 * realloc behaves the same as malloc() */
-			new_req_buflen = n + h->req_buflen + 1;
-			if (new_req_buflen >= 1024 * 1024)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive headers too large (received %d bytes)\n", new_req_buflen);
-				h->state = 100;
-				break;
-			}
-			h->req_buf = (char *)realloc(h->req_buf, new_req_buflen);
-			if (!h->req_buf)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive headers: %s\n", strerror(errno));
-				h->state = 100;
-				break;
-			}
-			memcpy(h->req_buf + h->req_buflen, buf, n);
-			h->req_buflen += n;
-			h->req_buf[h->req_buflen] = '\0';
-			/* search for the string "\r\n\r\n" */
-			endheaders = strstr(h->req_buf, "\r\n\r\n");
-			if(endheaders)
-			{
-				h->req_contentoff = endheaders - h->req_buf + 4;
-				h->req_contentlen = h->req_buflen - h->req_contentoff;
-				ProcessHttpQuery_upnphttp(h);
-			}
-		}
-		break;
+		buf = malloc(alloc);
+		if(buf)
+			memcpy(buf, h->req_buf, h->req_buflen + 1);
+	}
+	else
+		buf = realloc(h->req_buf, alloc);
+	if(!buf)
+		return -1;
+	h->req_buf = buf;
+	h->req_bufalloc = alloc;
+	for(i = 0; i < sizeof(offs) / sizeof(offs[0]); i++)
+		if(offs[i] >= 0)
+			*ptrs[i] = buf + offs[i];
+
+	return 0;
+}
+
+/* Reset a persistent connection for its next request.  Anything the
+ * client pipelined behind the previous request is already in req_buf,
+ * and gets processed straight away. */
+static void
+next_request(struct upnphttp * h)
+{
+	int used;
+
+	used = h->req_contentoff;
+	if(h->req_command == EPost)
+		used += h->req_contentlen;
+	if(used > h->req_buflen)
+		used = h->req_buflen;
+	h->req_buflen -= used;
+	if(h->req_buf != h->req_arena && h->req_buflen < sizeof(h->req_arena))
+	{
+		/* back to the arena after an oversized request */
+		memcpy(h->req_arena, h->req_buf + used, h->req_buflen);
+		free(h->req_buf);
+		h->req_buf = h->req_arena;
+		h->req_bufalloc = sizeof(h->req_arena);
+	}
+	else
+		memmove(h->req_buf, h->req_buf + used, h->req_buflen);
+	h->req_buf[h->req_buflen] = '\0';
+
+	/* back from a queued response */
+	if(h->ev.rdwr == EVENT_WRITE)
+	{
+		event_module.del(&h->ev, 0);
+		h->ev.rdwr = EVENT_READ;
+		event_module.add(&h->ev);
+	}
+
+	h->state = 0;
+	h->req_count++;
+	h->deadline = time(NULL) + runtime_vars.keepalive_timeout;
+	h->req_contentlen = -1;
+	h->req_contentoff = 0;
+	h->req_parsed = 0;
+	h->req_clienttype = 0;
+	h->req_command = EUnknown;
+	h->req_soapAction = NULL;
+	h->req_soapActionLen = 0;
+	h->req_Callback = NULL;
+	h->req_CallbackLen = 0;
+	h->req_NT = NULL;
+	h->req_NTLen = 0;
+	h->req_Timeout = 0;
+	h->req_SID = NULL;
+	h->req_SIDLen = 0;
+	h->req_RangeStart = 0;
+	h->req_RangeEnd = 0;
+	h->req_RangeList = NULL;
+	h->req_IfNoneMatch = NULL;
+	h->req_IfModifiedSince = 0;
+	h->req_chunklen = 0;
+	h->req_chunkoff = 0;
+	h->reqflags = 0;
+	h->res_buflen = 0;
+	h->res_sent = 0;
+	h->respflags = 0;
+
+	if(h->req_buflen)
+		ProcessBufferedQuery_upnphttp(h);
+}
+
+void
+Resume_upnphttp(struct upnphttp * h)
+{
+	h->state = 0;
+	SendResp_upnphttp(h);
+	CloseSocket_upnphttp(h);
+	while(h->state == 4)
+		next_request(h);
+}
+
+void
+Unthrottle_upnphttp(struct upnphttp * h)
+{
+	if(h->state != 3 || !(h->respflags & FLAG_THROTTLED))
+		return;
+	if(!bandwidth_limit(h->req_client, 1))
+		return;
+	h->respflags &= ~FLAG_THROTTLED;
+	event_module.add(&h->ev);
+}
+
+int
+Follow_upnphttp(struct upnphttp * h)
+{
+	struct stat st;
+
+	if(h->state != 3 || !(h->respflags & FLAG_FOLLOWING))
+		return 0;
+	if(fstat(h->res_fd, &st) == 0 && st.st_size <= h->res_end + 1 &&
+	   monitor_file_growing(&st) && time(NULL) - h->res_follow < FOLLOW_IDLE)
+		return 1;
+	h->respflags &= ~FLAG_FOLLOWING;
+	event_module.add(&h->ev);
+	return 0;
+}
+
+time_t
+Timeout_upnphttp(struct upnphttp * h, time_t now)
+{
+	if(h->state > 2 || !h->deadline)
+		return 0;
+	if(now < h->deadline)
+		return h->deadline;
+	DPRINTF(E_DEBUG, L_HTTP, "Closing idle HTTP connection after %d request%s\n",
+		h->req_count, h->req_count == 1 ? "" : "s");
+	h->reqflags &= ~FLAG_KEEPALIVE;
+	CloseSocket_upnphttp(h);
+	return 0;
+}
+
+static void
+Process_upnphttp(struct event *ev)
+{
+	struct upnphttp *h = ev->data;
+	int n;
+
+	switch(h->state)
+	{
+	case 0:
 	case 1:
 	case 2:
-		n = recv(h->ev.fd, buf, sizeof(buf), 0);
-		if(n < 0)
+		/* receive straight into req_buf, leaving room for a NUL */
+		if(h->req_bufalloc - h->req_buflen <= 1024 &&
+		   grow_req_buf(h, h->req_buflen + 2048 + 1) < 0)
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Receive request: %s\n", strerror(errno));
+			h->state = 100;
+			break;
+		}
+		n = recv(h->ev.fd, h->req_buf + h->req_buflen,
+		         h->req_bufalloc - h->req_buflen - 1, 0);
+		if(n<0)
 		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
 			DPRINTF(E_ERROR, L_HTTP, "recv (state%d): %s\n", h->state, strerror(errno));
 			h->state = 100;
 		}
-		else if(n == 0)
+		else if(n==0)
 		{
 			DPRINTF(E_WARN, L_HTTP, "HTTP Connection closed unexpectedly\n");
 			h->state = 100;
 		}
 		else
 		{
-			buf[sizeof(buf)-1] = '\0';
-			/*fwrite(buf, 1, n, stdout);*/	/* debug */
-			h->req_buf = (char *)realloc(h->req_buf, n + h->req_buflen);
-			if (!h->req_buf)
+			h->req_buflen += n;
+			h->req_buf[h->req_buflen] = '\0';
+			if(h->deadline)
+				h->deadline = time(NULL) + runtime_vars.keepalive_timeout;
+			if(h->state == 0)
 			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive request body: %s\n", strerror(errno));
+				if (h->req_buflen + 1 >= 1024 * 1024)
+				{
+					DPRINTF(E_ERROR, L_HTTP, "Receive headers too large (received %d bytes)\n", h->req_buflen + 1);
+					h->state = 100;
+					break;
+				}
+				ProcessBufferedQuery_upnphttp(h);
+			}
+			else if(h->state == 2 &&
+			        h->req_buflen - h->req_contentoff > MAX_CHUNKED_SIZE)
+			{
+				DPRINTF(E_ERROR, L_HTTP, "Chunked request body too large\n");
 				h->state = 100;
-				break;
 			}
-			memcpy(h->req_buf + h->req_buflen, buf, n);
-			h->req_buflen += n;
-			if((h->req_buflen - h->req_contentoff) >= h->req_contentlen)
+			else if((h->req_buflen - h->req_contentoff) >= h->req_contentlen)
 			{
-				/* Need the struct to point to the realloc'd memory locations */
 				if( h->state == 1 )
-				{
-					ParseHttpHeaders(h);
 					ProcessHTTPPOST_upnphttp(h);
-				}
 				else if( h->state == 2 )
-				{
 					ProcessHttpQuery_upnphttp(h);
-				}
 			}
 		}
 		break;
+	case 3:
+		continue_transfer(h);
+		break;
 	default:
 		DPRINTF(E_WARN, L_HTTP, "Unexpected state: %d\n", h->state);
 	}
+	while(h->state == 4)
+		next_request(h);
+}
+
+/* Entity tag for a response built from object id, as it was at
+ * mtime, size bytes long */
+static void
+make_etag(char *buf, long long id, time_t mtime, off_t size)
+{
+	snprintf(buf, ETAG_LEN, "\"%llx-%lx-%jx\"",
+	         id, (long)mtime, (intmax_t)size);
+}
+
+/* The fixed lines of each kind of response, put together by the
+ * compiler, so that building a header is mostly a matter of copying
+ * one of these.  They start with the 200 status line, which
+ * put_prefix() swaps for another one when needed. */
+#define STATUS_200 "HTTP/1.1 200 OK\r\n"
+#define SERVER_EXT "Server: " MINIDLNA_SERVER_STRING "\r\nEXT:\r\n"
+static const char soap_prefix[] =
+	STATUS_200
+	"Content-Type: text/xml; charset=\"utf-8\"\r\n"
+	SERVER_EXT;
+static const char html_prefix[] =
+	STATUS_200
+	"Content-Type: text/html\r\n"
+	SERVER_EXT;
+static const char media_prefix[] =
+	STATUS_200
+	SERVER_EXT
+	"realTimeInfo.dlna.org: DLNA.ORG_TLAG=*\r\n";
+static const char image_prefix[] =
+	STATUS_200
+	SERVER_EXT
+	"realTimeInfo.dlna.org: DLNA.ORG_TLAG=*\r\n"
+	"Content-Type: image/jpeg\r\n";
+static const char not_modified_prefix[] =
+	"HTTP/1.1 304 Not Modified\r\n"
+	SERVER_EXT;
+
+static void
+put_prefix(struct string_s *str, const char *prefix, int len,
+           int respcode, const char *respmsg)
+{
+	int skip = sizeof(STATUS_200) - 1;
+
+	if(respcode == 200)
+		strcatn(str, prefix, len);
+	else
+	{
+		strcatf(str, "HTTP/1.1 %d %s\r\n", respcode, respmsg);
+		strcatn(str, prefix + skip, len - skip);
+	}
+}
+#define strcatprefix(str, prefix, respcode, respmsg) \
+	put_prefix(str, prefix, sizeof(prefix) - 1, respcode, respmsg)
+
+/* The Connection and Date lines, which every response has */
+static void
+put_connection_date(struct upnphttp *h, struct string_s *str)
+{
+	char date[HTTP_DATE_LEN+1];
+
+	if(h->reqflags & FLAG_KEEPALIVE)
+		strcats(str, "Connection: keep-alive\r\nDate: ");
+	else
+		strcats(str, "Connection: close\r\nDate: ");
+	strcatn(str, date, http_date(date));
+	strcats(str, "\r\n");
+}
+
+static void
+add_validators(struct string_s *str, const char *etag, time_t mtime)
+{
+	char date[HTTP_DATE_LEN+1];
+
+	strcatf(str, "ETag: %s\r\nLast-Modified: ", etag);
+	strcatn(str, date, http_time(date, mtime));
+	strcats(str, "\r\n");
+}
+
+/* Does etag appear in an If-None-Match list?  The weak comparison
+ * applies, so W/ prefixes are ignored. */
+static int
+etag_match(const char *list, const char *etag)
+{
+	const char *p = list, *end;
+	size_t len = strlen(etag);
+
+	while( *p && *p != '\r' && *p != '\n' )
+	{
+		while( *p == ' ' || *p == '\t' || *p == ',' )
+			p++;
+		if( *p == '*' )
+			return 1;
+		if( strncmp(p, "W/", 2) == 0 )
+			p += 2;
+		end = p;
+		if( *end == '"' )
+			end = strchr(end + 1, '"');
+		else
+			end = NULL;
+		if( !end )
+			break;
+		end++;
+		if( (size_t)(end - p) == len && memcmp(p, etag, len) == 0 )
+			return 1;
+		p = end;
+	}
+
+	return 0;
+}
+
+/* Answer a conditional GET or HEAD with 304 Not Modified if the
+ * client's copy is still current.  If-None-Match, when present,
+ * takes precedence over If-Modified-Since.  Returns 1 if the
+ * response was sent. */
+static int
+check_not_modified(struct upnphttp *h, const char *etag, time_t mtime)
+{
+	char header[512];
+	struct string_s str;
+
+	if( h->req_IfNoneMatch )
+	{
+		if( !etag_match(h->req_IfNoneMatch, etag) )
+			return 0;
+	}
+	else if( !h->req_IfModifiedSince || mtime > h->req_IfModifiedSince )
+		return 0;
+
+	DPRINTF(E_DEBUG, L_HTTP, "Not modified: %s\n", etag);
+	INIT_STR(str, header);
+	strcats(&str, not_modified_prefix);
+	put_connection_date(h, &str);
+	add_validators(&str, etag, mtime);
+	strcats(&str, "\r\n");
+
+	start_transfer(h, &str, -1, 0, -1);
+	CloseSocket_upnphttp(h);
+
+	return 1;
 }
 
 /* with response code and response message
@@ -1152,29 +1735,30 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
                      const char * respmsg,
                      int bodylen)
 {
-	static const char httpresphead[] =
-		"%s %d %s\r\n"
-		"Content-Type: %s\r\n"
-		"Connection: close\r\n"
-		"Content-Length: %d\r\n"
-		"Server: " MINIDLNA_SERVER_STRING "\r\n";
-	time_t curtime = time(NULL);
-	char date[30];
 	int templen;
+	int chunked = (bodylen < 0);
 	struct string_s res;
-	if(!h->res_buf)
+	if(chunked)
+		bodylen = 0;
+	templen = 512 + bodylen;
+	if(h->res_buf_alloclen < templen)
 	{
-		templen = sizeof(httpresphead) + 256 + bodylen;
-		h->res_buf = (char *)malloc(templen);
+		h->res_buf = (char *)realloc(h->res_buf, templen);
 		h->res_buf_alloclen = templen;
 	}
 	res.data = h->res_buf;
 	res.size = h->res_buf_alloclen;
 	res.off = 0;
-	strcatf(&res, httpresphead, "HTTP/1.1",
-	              respcode, respmsg,
-	              (h->respflags&FLAG_HTML)?"text/html":"text/xml; charset=\"utf-8\"",
-							 bodylen);
+	/* only the variable fields get formatted */
+	if(h->respflags & FLAG_HTML)
+		strcatprefix(&res, html_prefix, respcode, respmsg);
+	else
+		strcatprefix(&res, soap_prefix, respcode, respmsg);
+	put_connection_date(h, &res);
+	if(chunked)
+		strcats(&res, "Transfer-Encoding: chunked\r\n");
+	else
+		strcatf(&res, "Content-Length: %d\r\n", bodylen);
 	/* Additional headers */
 	if(h->respflags & FLAG_TIMEOUT) {
 		strcatf(&res, "Timeout: Second-");
@@ -1187,14 +1771,18 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	if(h->respflags & FLAG_SID) {
 		strcatf(&res, "SID: %.*s\r\n", h->req_SIDLen, h->req_SID);
 	}
+	if(h->respflags & FLAG_RETRY_AFTER) {
+		strcats(&res, "Retry-After: 1\r\n");
+	}
+	if(h->respflags & FLAG_CONTENT_RANGE) {
+		strcatf(&res, "Content-Range: bytes */%jd\r\n", (intmax_t)(h->res_end + 1));
+	}
 	if(h->reqflags & FLAG_LANGUAGE) {
-		strcatf(&res, "Content-Language: en\r\n");
+		strcats(&res, "Content-Language: en\r\n");
 	}
-	strftime(date, 30,"%a, %d %b %Y %H:%M:%S GMT" , gmtime(&curtime));
-	strcatf(&res, "Date: %s\r\n", date);
-	strcatf(&res, "EXT:\r\n");
-	strcatf(&res, "\r\n");
+	strcats(&res, "\r\n");
 	h->res_buflen = res.off;
+	h->res_sent = 0;
 	if(h->res_buf_alloclen < (h->res_buflen + bodylen))
 	{
 		h->res_buf = (char *)realloc(h->res_buf, (h->res_buflen + bodylen));
@@ -1202,143 +1790,641 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	}
 }
 
-void
-BuildResp2_upnphttp(struct upnphttp * h, int respcode,
-                    const char * respmsg,
-                    const char * body, int bodylen)
+void
+BuildResp2_upnphttp(struct upnphttp * h, int respcode,
+                    const char * respmsg,
+                    const char * body, int bodylen)
+{
+	BuildHeader_upnphttp(h, respcode, respmsg, bodylen);
+	if( h->req_command == EHead )
+		return;
+	if(body)
+		memcpy(h->res_buf + h->res_buflen, body, bodylen);
+	h->res_buflen += bodylen;
+}
+
+/* responding 200 OK ! */
+void
+BuildResp_upnphttp(struct upnphttp *h, const char *body, int bodylen)
+{
+	BuildResp2_upnphttp(h, 200, "OK", body, bodylen);
+}
+
+void
+SendResp_upnphttp(struct upnphttp * h)
+{
+	if(h->state == 5)
+		return;
+	DPRINTF(E_DEBUG, L_HTTP, "HTTP RESPONSE: %.*s\n", h->res_buflen, h->res_buf);
+	start_transfer(h, NULL, -1, 0, -1);
+}
+
+/* A worker thread has the connection to itself while it is out of the
+ * event loop, so it can write to the socket directly, waiting up to
+ * STREAM_TIMEOUT seconds each time the client's window is full. */
+#define STREAM_TIMEOUT 30
+
+static int
+write_all(int fd, struct iovec *iov, int iovcnt)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	struct msghdr msg;
+	ssize_t n;
+
+	while( iovcnt > 0 )
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if( n < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			if( (errno == EAGAIN || errno == EWOULDBLOCK) &&
+			    poll(&pfd, 1, STREAM_TIMEOUT * 1000) > 0 )
+				continue;
+			DPRINTF(E_WARN, L_HTTP, "Streaming response: %s\n",
+				errno == EAGAIN ? "client stopped reading" : strerror(errno));
+			return -1;
+		}
+		while( iovcnt > 0 && (size_t)n >= iov->iov_len )
+		{
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if( iovcnt > 0 )
+		{
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+int
+Stream_upnphttp(struct upnphttp *h, const void *data, size_t len)
+{
+	struct iovec iov[4];
+	char size[24];
+	int n = 0;
+
+	if( h->res_sent < h->res_buflen )
+	{
+		iov[n].iov_base = h->res_buf + h->res_sent;
+		iov[n++].iov_len = h->res_buflen - h->res_sent;
+		h->res_sent = h->res_buflen;
+	}
+	if( !data )
+	{
+		iov[n].iov_base = "0\r\n\r\n";
+		iov[n++].iov_len = 5;
+	}
+	else if( len )
+	{
+		iov[n].iov_base = size;
+		iov[n++].iov_len = snprintf(size, sizeof(size), "%lx\r\n", (unsigned long)len);
+		iov[n].iov_base = (void *)data;
+		iov[n++].iov_len = len;
+		iov[n].iov_base = "\r\n";
+		iov[n++].iov_len = 2;
+	}
+
+	return write_all(h->ev.fd, iov, n);
+}
+
+/* Add a buffer to the output queue, to be sent after res_buf.  If
+ * tofree is set, it is freed once the transfer ends. */
+static int
+queue_data(struct upnphttp *h, const void *data, size_t len, void *tofree)
+{
+	if( h->res_iovcnt >= MAX_RES_IOV )
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Output queue full\n");
+		free(tofree);
+		return -1;
+	}
+	h->res_iov[h->res_iovcnt].iov_base = (void *)data;
+	h->res_iov[h->res_iovcnt].iov_len = len;
+	h->res_iovfree[h->res_iovcnt] = tofree;
+	h->res_iovcnt++;
+
+	return 0;
+}
+
+/* Write out what is queued in memory, res_buf up to end and then the
+ * queued buffers, with as few system calls as the socket allows.
+ * Returns 1 if the socket is full, 0 once it is all sent, and -1 on
+ * error. */
+static int
+send_queued(struct upnphttp *h, int end, int more)
+{
+	struct iovec iov[MAX_RES_IOV + 1];
+	struct msghdr msg;
+	ssize_t n;
+	size_t len;
+	int i;
+
+	while( h->res_sent < end || h->res_iovidx < h->res_iovcnt )
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		if( h->res_sent < end )
+		{
+			iov[0].iov_base = h->res_buf + h->res_sent;
+			iov[0].iov_len = end - h->res_sent;
+			msg.msg_iovlen = 1;
+		}
+		for( i = h->res_iovidx; i < h->res_iovcnt; i++ )
+			iov[msg.msg_iovlen++] = h->res_iov[i];
+		/* this is writev(), but with room for MSG_MORE */
+		n = sendmsg(h->ev.fd, &msg, more ? MSG_MORE : 0);
+		if( n < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			if( errno == EAGAIN || errno == EWOULDBLOCK )
+				return 1;
+			DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %s\n", strerror(errno));
+			return -1;
+		}
+		if( h->res_sent < end )
+		{
+			len = end - h->res_sent;
+			if( len > (size_t)n )
+				len = n;
+			h->res_sent += len;
+			n -= len;
+		}
+		while( n > 0 )
+		{
+			struct iovec *v = &h->res_iov[h->res_iovidx];
+			if( (size_t)n < v->iov_len )
+			{
+				v->iov_base = (char *)v->iov_base + n;
+				v->iov_len -= n;
+				break;
+			}
+			n -= v->iov_len;
+			v->iov_len = 0;
+			h->res_iovidx++;
+		}
+	}
+
+	return 0;
+}
+
+/* Stop writing to a client that has used up its share of
+ * max_bandwidth, until the next refill */
+static int
+throttle_transfer(struct upnphttp *h)
+{
+	event_module.del(&h->ev, 0);
+	h->respflags |= FLAG_THROTTLED;
+	return 1;
+}
+
+/* What is known not to work on each filesystem, so that later
+ * transfers from it go straight to a method that does */
+#define MAX_XFER_DEVS 16
+static struct {
+	dev_t dev;
+	uint32_t flags;		/* FLAG_NOSENDFILE, FLAG_NOSPLICE */
+} xfer_devs[MAX_XFER_DEVS];
+static int n_xfer_devs;
+
+static uint32_t
+xfer_dev_flags(dev_t dev)
+{
+	int i;
+
+	for( i = 0; i < n_xfer_devs && i < MAX_XFER_DEVS; i++ )
+		if( xfer_devs[i].dev == dev )
+			return xfer_devs[i].flags;
+	return 0;
+}
+
+/* Don't try flag's method on this transfer's filesystem again */
+static void
+xfer_unsupported(struct upnphttp *h, uint32_t flag)
+{
+	int i;
+
+	h->respflags |= flag;
+	for( i = 0; i < n_xfer_devs && i < MAX_XFER_DEVS; i++ )
+	{
+		if( xfer_devs[i].dev == h->res_dev )
+		{
+			xfer_devs[i].flags |= flag;
+			return;
+		}
+	}
+	/* once the table is full, the oldest entries make way */
+	i = n_xfer_devs++ % MAX_XFER_DEVS;
+	xfer_devs[i].dev = h->res_dev;
+	xfer_devs[i].flags = flag;
+}
+
+/* Push as much of the pending file range as the socket will take
+ * without blocking.  Returns 1 if data remains to be sent, 0 once
+ * the range is complete, and -1 on error. */
+static int
+send_file_chunk(struct upnphttp *h)
+{
+	static char buf[MIN_BUFFER_SIZE];
+	off_t send_size;
+	off_t ret;
+#if HAVE_SENDFILE
+	off_t prev;
+
+	if( !(h->respflags & FLAG_NOSENDFILE) )
+	{
+		prev = h->res_offset;
+		send_size = ( ((h->res_end - h->res_offset) < MAX_BUFFER_SIZE) ? (h->res_end - h->res_offset + 1) : MAX_BUFFER_SIZE);
+		send_size = bandwidth_limit(h->req_client, send_size);
+		if( !send_size )
+			return throttle_transfer(h);
+		ret = sys_sendfile(h->ev.fd, h->res_fd, &h->res_offset, send_size);
+		if( ret == -1 )
+		{
+			if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+				return 1;
+			DPRINTF(E_DEBUG, L_HTTP, "sendfile error :: error no. %d [%s]\n", errno, strerror(errno));
+			/* If sendfile isn't supported on the filesystem, don't bother trying to use it again. */
+			if( errno == EINVAL )
+				xfer_unsupported(h, FLAG_NOSENDFILE);
+			else if( errno == EOVERFLOW )
+				h->respflags |= FLAG_NOSENDFILE;
+			else
+				return -1;
+		}
+		else if( h->res_offset == prev )
+		{
+			DPRINTF(E_WARN, L_HTTP, "Unexpected end of file at offset %jd\n", (intmax_t)prev);
+			return -1;
+		}
+		else
+		{
+			bandwidth_charge(h->req_client, h->res_offset - prev);
+			readahead_update(&h->res_ra, h->res_fd, prev, h->res_offset - prev);
+			return (h->res_offset <= h->res_end);
+		}
+	}
+#endif
+#ifdef HAVE_SPLICE
+	/* Next best is splice(), which still keeps the data in the kernel,
+	 * through a pipe of the connection's own */
+	if( !(h->respflags & FLAG_NOSPLICE) && h->res_pipe[0] < 0 && pipe(h->res_pipe) != 0 )
+	{
+		DPRINTF(E_WARN, L_HTTP, "pipe: %s\n", strerror(errno));
+		h->res_pipe[0] = h->res_pipe[1] = -1;
+		h->respflags |= FLAG_NOSPLICE;
+	}
+	if( !(h->respflags & FLAG_NOSPLICE) )
+	{
+		if( !h->res_piped )
+		{
+			loff_t in = h->res_offset;
+			send_size = (((h->res_end - h->res_offset) < MIN_BUFFER_SIZE) ? (h->res_end - h->res_offset + 1) : MIN_BUFFER_SIZE);
+			ret = splice(h->res_fd, &in, h->res_pipe[1], NULL, send_size, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+			if( ret > 0 )
+				h->res_piped = ret;
+			else if( ret == -1 && (errno == EAGAIN || errno == EINTR) )
+				return 1;
+			else if( ret == -1 && errno == EINVAL )
+			{
+				DPRINTF(E_DEBUG, L_HTTP, "splice not supported, reading the file\n");
+				xfer_unsupported(h, FLAG_NOSPLICE);
+			}
+			else
+			{
+				DPRINTF(E_DEBUG, L_HTTP, "splice error :: error no. %d [%s]\n", errno, strerror(errno));
+				return -1;
+			}
+		}
+		if( h->res_piped )
+		{
+			send_size = bandwidth_limit(h->req_client, h->res_piped);
+			if( !send_size )
+				return throttle_transfer(h);
+			ret = splice(h->res_pipe[0], NULL, h->ev.fd, NULL, send_size,
+			             SPLICE_F_MOVE|SPLICE_F_NONBLOCK|SPLICE_F_MORE);
+			if( ret == -1 )
+			{
+				if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+					return 1;
+				DPRINTF(E_DEBUG, L_HTTP, "splice error :: error no. %d [%s]\n", errno, strerror(errno));
+				return -1;
+			}
+			bandwidth_charge(h->req_client, ret);
+			readahead_update(&h->res_ra, h->res_fd, h->res_offset, ret);
+			h->res_offset += ret;
+			h->res_piped -= ret;
+			return (h->res_offset <= h->res_end);
+		}
+	}
+#endif
+	/* Fall back to regular I/O.  Whatever the socket doesn't accept
+	 * is simply read again on the next round, so the buffer can be
+	 * shared between all transfers. */
+	send_size = (((h->res_end - h->res_offset) < MIN_BUFFER_SIZE) ? (h->res_end - h->res_offset + 1) : MIN_BUFFER_SIZE);
+	send_size = bandwidth_limit(h->req_client, send_size);
+	if( !send_size )
+		return throttle_transfer(h);
+	ret = pread(h->res_fd, buf, send_size, h->res_offset);
+	if( ret <= 0 )
+	{
+		if( ret == -1 && errno == EINTR )
+			return 1;
+		DPRINTF(E_DEBUG, L_HTTP, "read error :: error no. %d [%s]\n", errno, strerror(errno));
+		return -1;
+	}
+	ret = send(h->ev.fd, buf, ret, 0);
+	if( ret == -1 )
+	{
+		if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+			return 1;
+		DPRINTF(E_DEBUG, L_HTTP, "write error :: error no. %d [%s]\n", errno, strerror(errno));
+		return -1;
+	}
+	bandwidth_charge(h->req_client, ret);
+	readahead_update(&h->res_ra, h->res_fd, h->res_offset, ret);
+	h->res_offset += ret;
+
+	return (h->res_offset <= h->res_end);
+}
+
+/* Hand a response over to the event loop.  The header is copied to
+ * res_buf, unless it is NULL because the whole response was built
+ * there already.  Whatever is in memory goes out right away, as far
+ * as the socket allows; the rest, and the file range, are then
+ * written out from Process_upnphttp() whenever the socket becomes
+ * writable, so a slow client never holds up the rest of the server.
+ * fd, if there is a file to send, is closed once the transfer ends. */
+static void
+start_transfer(struct upnphttp *h, struct string_s *header, int fd, off_t offset, off_t end_offset)
+{
+	if( header )
+	{
+		if( h->res_buf_alloclen < header->off )
+		{
+			char *buf = realloc(h->res_buf, header->off);
+			if( !buf )
+			{
+				DPRINTF(E_ERROR, L_HTTP, "Out of memory starting transfer\n");
+				if( fd >= 0 )
+					close(fd);
+				h->res_fd = -1;
+				end_transfer(h);
+				h->reqflags &= ~FLAG_KEEPALIVE;
+				return;
+			}
+			h->res_buf = buf;
+			h->res_buf_alloclen = header->off;
+		}
+		memcpy(h->res_buf, header->data, header->off);
+		h->res_buflen = header->off;
+	}
+	h->res_sent = 0;
+	h->res_fd = fd;
+	h->res_offset = offset;
+	h->res_end = end_offset;
+
+	if( fd < 0 )
+	{
+		/* a response in memory usually fits in the socket buffer */
+		switch( send_queued(h, h->res_buflen, 0) )
+		{
+		case 0:
+			end_transfer(h);
+			return;
+		case -1:
+			end_transfer(h);
+			h->reqflags &= ~FLAG_KEEPALIVE;
+			return;
+		}
+	}
+	else
+	{
+		struct stat st;
+
+		if( fstat(fd, &st) == 0 )
+		{
+			h->res_dev = st.st_dev;
+			h->respflags |= xfer_dev_flags(st.st_dev);
+		}
+		if( h->req_command != EHead )
+			readahead_start(&h->res_ra, fd, offset);
+		number_of_transfers++;
+		if( h->req_client )
+			h->req_client->connections++;
+	}
+
+	event_module.del(&h->ev, 0);
+	h->ev.rdwr = EVENT_WRITE;
+	event_module.add(&h->ev);
+	h->state = 3;
+}
+
+/* Release the output queue and the file, once the response is out
+ * or the connection is going away */
+static void
+end_transfer(struct upnphttp *h)
+{
+	int i;
+
+	/* back in the event loop, so that it can be closed */
+	if( h->respflags & (FLAG_THROTTLED|FLAG_FOLLOWING) )
+	{
+		h->respflags &= ~(FLAG_THROTTLED|FLAG_FOLLOWING);
+		event_module.add(&h->ev);
+	}
+	h->res_follow = 0;
+	for( i = 0; i < h->res_iovcnt; i++ )
+		free(h->res_iovfree[i]);
+	h->res_iovcnt = 0;
+	h->res_iovidx = 0;
+	free(h->res_parts);
+	h->res_parts = NULL;
+	h->res_nparts = 0;
+	h->res_part = 0;
+	if( h->res_pipe[0] >= 0 )
+	{
+		close(h->res_pipe[0]);
+		close(h->res_pipe[1]);
+		h->res_pipe[0] = h->res_pipe[1] = -1;
+		h->res_piped = 0;
+	}
+	if( h->res_fd >= 0 )
+	{
+		close(h->res_fd);
+		h->res_fd = -1;
+		number_of_transfers--;
+		if( h->req_client )
+			h->req_client->connections--;
+	}
+	if( h->state == 3 )
+		h->state = 0;
+}
+
+/* The file has been sent through io_uring, which hands the
+ * socket back to the event loop */
+static void
+uring_transfer_done(void *data, off_t offset, int error)
 {
-	BuildHeader_upnphttp(h, respcode, respmsg, bodylen);
-	if( h->req_command == EHead )
+	struct upnphttp *h = data;
+	int flags;
+
+	h->res_offset = offset;
+	event_module.add(&h->ev);
+	flags = fcntl(h->ev.fd, F_GETFL, 0);
+	if( flags >= 0 )
+		fcntl(h->ev.fd, F_SETFL, flags | O_NONBLOCK);
+	/* on to the next part of a multipart/byteranges response,
+	 * or to whatever has been added to a growing file */
+	if( !error && (h->res_follow || h->res_part + 1 < h->res_nparts) )
 		return;
-	if(body)
-		memcpy(h->res_buf + h->res_buflen, body, bodylen);
-	h->res_buflen += bodylen;
+	end_transfer(h);
+	if( error )
+		h->reqflags &= ~FLAG_KEEPALIVE;
+	CloseSocket_upnphttp(h);
+	while(h->state == 4)
+		next_request(h);
 }
 
-/* responding 200 OK ! */
-void
-BuildResp_upnphttp(struct upnphttp *h, const char *body, int bodylen)
+/* A growing file has been sent as far as it went.  Queue the chunk
+ * it has grown by since, or the last chunk once the writer is done
+ * with it.  Returns 1 if there is more to send, 0 if the transfer has
+ * to wait for the file to grow, and -1 on error. */
+static int
+follow_file(struct upnphttp *h)
 {
-	BuildResp2_upnphttp(h, 200, "OK", body, bodylen);
-}
+	struct string_s str;
+	struct stat st;
 
-void
-SendResp_upnphttp(struct upnphttp * h)
-{
-	int n;
-	DPRINTF(E_DEBUG, L_HTTP, "HTTP RESPONSE: %.*s\n", h->res_buflen, h->res_buf);
-	n = send(h->ev.fd, h->res_buf, h->res_buflen, 0);
-	if(n<0)
+	if( fstat(h->res_fd, &st) < 0 )
 	{
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %s\n", strerror(errno));
+		DPRINTF(E_ERROR, L_HTTP, "fstat: %s\n", strerror(errno));
+		return -1;
 	}
-	else if(n < h->res_buflen)
+	if( st.st_size <= h->res_end + 1 && monitor_file_growing(&st) &&
+	    time(NULL) - h->res_follow < FOLLOW_IDLE )
 	{
-		/* TODO : handle correctly this case */
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %d bytes sent (out of %d)\n",
-						n, h->res_buflen);
+		/* Follow_upnphttp() checks on it again */
+		event_module.del(&h->ev, 0);
+		h->respflags |= FLAG_FOLLOWING;
+		return 0;
 	}
-}
-
-static int
-send_data(struct upnphttp * h, char * header, size_t size, int flags)
-{
-	int n;
 
-	n = send(h->ev.fd, header, size, flags);
-	if(n<0)
-	{
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %s\n", strerror(errno));
-	} 
-	else if(n < h->res_buflen)
+	/* res_buf has gone out, so it can hold the chunk framing */
+	str.data = h->res_buf;
+	str.size = h->res_buf_alloclen;
+	str.off = 0;
+	if( h->res_end >= 0 )
+		strcats(&str, "\r\n");
+	if( st.st_size > h->res_end + 1 )
 	{
-		/* TODO : handle correctly this case */
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %d bytes sent (out of %d)\n",
-						n, h->res_buflen);
+		strcatf(&str, "%jx\r\n", (intmax_t)(st.st_size - h->res_end - 1));
+		h->res_offset = h->res_end + 1;
+		h->res_end = st.st_size - 1;
+		h->res_follow = time(NULL);
 	}
 	else
 	{
-		return 0;
+		DPRINTF(E_DEBUG, L_HTTP, "Growing file done at %jd bytes\n", (intmax_t)st.st_size);
+		strcats(&str, "0\r\n\r\n");
+		h->res_follow = 0;
 	}
+	h->res_buflen = str.off;
+	h->res_sent = 0;
+
 	return 1;
 }
 
 static void
-send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
+continue_transfer(struct upnphttp *h)
 {
-	off_t send_size;
-	off_t ret;
-	char *buf = NULL;
-#if HAVE_SENDFILE
-	int try_sendfile = 1;
-#endif
+	int n, end, file;
 
-	while( offset <= end_offset )
+	for(;;)
 	{
-#if HAVE_SENDFILE
-		if( try_sendfile )
+		/* text preceding the current part */
+		end = h->res_nparts ? h->res_parts[h->res_part].buf_end : h->res_buflen;
+		file = (h->req_command != EHead && h->res_fd >= 0 && h->res_offset <= h->res_end);
+		n = send_queued(h, end, file);
+		if( n > 0 )
+			return;
+		if( n < 0 )
+			goto error;
+		if( file )
 		{
-			send_size = ( ((end_offset - offset) < MAX_BUFFER_SIZE) ? (end_offset - offset + 1) : MAX_BUFFER_SIZE);
-			ret = sys_sendfile(h->ev.fd, sendfd, &offset, send_size);
-			if( ret == -1 )
-			{
-				DPRINTF(E_DEBUG, L_HTTP, "sendfile error :: error no. %d [%s]\n", errno, strerror(errno));
-				/* If sendfile isn't supported on the filesystem, don't bother trying to use it again. */
-				if( errno == EOVERFLOW || errno == EINVAL )
-					try_sendfile = 0;
-				else if( errno != EAGAIN )
-					break;
-			}
-			else
+			/* Once the header is out, io_uring can take over the socket,
+			 * unless the transfer has to be paced */
+			if( runtime_vars.max_bandwidth <= 0 &&
+			    uring_send_file(h->ev.fd, h->res_fd, h->res_offset, h->res_end,
+			                    uring_transfer_done, h) == 0 )
 			{
-				//DPRINTF(E_DEBUG, L_HTTP, "sent %lld bytes to %d. offset is now %lld.\n", ret, h->socket, offset);
-				continue;
+				event_module.del(&h->ev, 0);
+				n = fcntl(h->ev.fd, F_GETFL, 0);
+				if( n >= 0 )
+					fcntl(h->ev.fd, F_SETFL, n & ~O_NONBLOCK);
+				return;
 			}
+			n = send_file_chunk(h);
+			if( n > 0 )
+				return;
+			if( n < 0 )
+				goto error;
 		}
-#endif
-		/* Fall back to regular I/O */
-		if( !buf )
-			buf = malloc(MIN_BUFFER_SIZE);
-		send_size = (((end_offset - offset) < MIN_BUFFER_SIZE) ? (end_offset - offset + 1) : MIN_BUFFER_SIZE);
-		lseek(sendfd, offset, SEEK_SET);
-		ret = read(sendfd, buf, send_size);
-		if( ret == -1 ) {
-			DPRINTF(E_DEBUG, L_HTTP, "read error :: error no. %d [%s]\n", errno, strerror(errno));
-			if( errno == EAGAIN )
-				continue;
-			else
-				break;
-		}
-		ret = write(h->ev.fd, buf, ret);
-		if( ret == -1 ) {
-			DPRINTF(E_DEBUG, L_HTTP, "write error :: error no. %d [%s]\n", errno, strerror(errno));
-			if( errno == EAGAIN )
+		if( h->res_follow )
+		{
+			n = follow_file(h);
+			if( n > 0 )
 				continue;
-			else
-				break;
+			if( n == 0 )
+				return;
+			goto error;
 		}
-		offset += ret;
+		if( ++h->res_part >= h->res_nparts )
+			break;
+		h->res_offset = h->res_parts[h->res_part].start;
+		h->res_end = h->res_parts[h->res_part].end;
+		if( h->res_offset <= h->res_end )
+			readahead_start(&h->res_ra, h->res_fd, h->res_offset);
 	}
-	free(buf);
+	end_transfer(h);
+	CloseSocket_upnphttp(h);
+	return;
+error:
+	end_transfer(h);
+	h->reqflags &= ~FLAG_KEEPALIVE;
+	CloseSocket_upnphttp(h);
 }
 
 static void
-start_dlna_header(struct string_s *str, int respcode, const char *tmode, const char *mime)
+start_dlna_header(struct upnphttp *h, struct string_s *str, int respcode, const char *tmode, const char *mime)
 {
-	char date[30];
-	time_t now;
+	strcatprefix(str, media_prefix, respcode, "OK");
+	put_connection_date(h, str);
+	strcats(str, "transferMode.dlna.org: ");
+	strcatn(str, tmode, strlen(tmode));
+	strcats(str, "\r\nContent-Type: ");
+	strcatn(str, mime, strlen(mime));
+	strcats(str, "\r\n");
+}
 
-	now = time(NULL);
-	strftime(date, sizeof(date),"%a, %d %b %Y %H:%M:%S GMT" , gmtime(&now));
-	strcatf(str, "HTTP/1.1 %d OK\r\n"
-	             "Connection: close\r\n"
-	             "Date: %s\r\n"
-	             "Server: " MINIDLNA_SERVER_STRING "\r\n"
-	             "EXT:\r\n"
-	             "realTimeInfo.dlna.org: DLNA.ORG_TLAG=*\r\n"
-	             "transferMode.dlna.org: %s\r\n"
-	             "Content-Type: %s\r\n",
-	             respcode, date, tmode, mime);
+/* start_dlna_header() for the JPEG thumbnails and resized images,
+ * which only differ in their transfer mode */
+static void
+start_image_header(struct upnphttp *h, struct string_s *str, const char *tmode)
+{
+	strcats(str, image_prefix);
+	put_connection_date(h, str);
+	strcats(str, "transferMode.dlna.org: ");
+	strcatn(str, tmode, strlen(tmode));
+	strcats(str, "\r\n");
 }
 
 static int
@@ -1386,6 +2472,7 @@ SendResp_icon(struct upnphttp * h, char * icon)
 {
 	char header[512];
 	char mime[12] = "image/";
+	char etag[ETAG_LEN];
 	char *data;
 	int size;
 	struct string_s str;
@@ -1425,16 +2512,20 @@ SendResp_icon(struct upnphttp * h, char * icon)
 		return;
 	}
 
+	/* the icons are built in, so they only change with the binary */
+	make_etag(etag, 0, startup_time, size);
+	if( check_not_modified(h, etag, startup_time) )
+		return;
+
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", mime);
+	start_dlna_header(h, &str, 200, "Interactive", mime);
+	add_validators(&str, etag, startup_time);
 	strcatf(&str, "Content-Length: %d\r\n\r\n", size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
-	{
-		if( h->req_command != EHead )
-			send_data(h, data, size, 0);
-	}
+	if( h->req_command != EHead )
+		queue_data(h, data, size, NULL);
+	start_transfer(h, &str, -1, 0, -1);
 	CloseSocket_upnphttp(h);
 }
 
@@ -1442,10 +2533,12 @@ static void
 SendResp_albumArt(struct upnphttp * h, char * object)
 {
 	char header[512];
+	char etag[ETAG_LEN];
 	char *path;
 	off_t size;
 	long long id;
 	int fd;
+	struct stat st;
 	struct string_s str;
 
 	if( h->reqflags & (FLAG_XFERSTREAMING|FLAG_RANGE) )
@@ -1476,22 +2569,30 @@ SendResp_albumArt(struct upnphttp * h, char * object)
 		return;
 	}
 	sqlite3_free(path);
-	size = lseek(fd, 0, SEEK_END);
-	lseek(fd, 0, SEEK_SET);
+	if( fstat(fd, &st) != 0 )
+	{
+		close(fd);
+		Send500(h);
+		return;
+	}
+	size = st.st_size;
+
+	make_etag(etag, id, st.st_mtime, size);
+	if( check_not_modified(h, etag, st.st_mtime) )
+	{
+		close(fd);
+		return;
+	}
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "image/jpeg");
+	start_image_header(h, &str, "Interactive");
+	add_validators(&str, etag, st.st_mtime);
 	strcatf(&str, "Content-Length: %jd\r\n"
 	              "contentFeatures.dlna.org: DLNA.ORG_PN=JPEG_TN\r\n\r\n",
 	              (intmax_t)size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
-	{
-		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
-	}
-	close(fd);
+	start_transfer(h, &str, fd, 0, size-1);
 	CloseSocket_upnphttp(h);
 }
 
@@ -1531,15 +2632,10 @@ SendResp_caption(struct upnphttp * h, char * object)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "smi/caption");
+	start_dlna_header(h, &str, 200, "Interactive", "smi/caption");
 	strcatf(&str, "Content-Length: %jd\r\n\r\n", (intmax_t)size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
-	{
-		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
-	}
-	close(fd);
+	start_transfer(h, &str, fd, 0, size-1);
 	CloseSocket_upnphttp(h);
 }
 
@@ -1547,11 +2643,14 @@ static void
 SendResp_thumbnail(struct upnphttp * h, char * object)
 {
 	char header[512];
+	char etag[ETAG_LEN];
 	char *path;
 	long long id;
 	ExifData *ed;
 	ExifLoader *l;
+	struct stat st;
 	struct string_s str;
+	char *data;
 
 	if( h->reqflags & (FLAG_XFERSTREAMING|FLAG_RANGE) )
 	{
@@ -1570,7 +2669,7 @@ SendResp_thumbnail(struct upnphttp * h, char * object)
 	}
 	DPRINTF(E_INFO, L_HTTP, "Serving thumbnail for ObjectId: %lld [%s]\n", id, path);
 
-	if( access(path, F_OK) != 0 )
+	if( stat(path, &st) != 0 )
 	{
 		DPRINTF(E_ERROR, L_HTTP, "Error accessing %s\n", path);
 		Send404(h);
@@ -1578,6 +2677,15 @@ SendResp_thumbnail(struct upnphttp * h, char * object)
 		return;
 	}
 
+	/* the thumbnail is embedded in the file, so it changes with it;
+	 * a current client copy saves parsing the EXIF data at all */
+	make_etag(etag, id, st.st_mtime, st.st_size);
+	if( check_not_modified(h, etag, st.st_mtime) )
+	{
+		sqlite3_free(path);
+		return;
+	}
+
 	l = exif_loader_new();
 	exif_loader_write_file(l, path);
 	ed = exif_loader_get_data(l);
@@ -1594,17 +2702,27 @@ SendResp_thumbnail(struct upnphttp * h, char * object)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "image/jpeg");
+	start_image_header(h, &str, "Interactive");
+	add_validators(&str, etag, st.st_mtime);
 	strcatf(&str, "Content-Length: %jd\r\n"
 	              "contentFeatures.dlna.org: DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1\r\n\r\n",
 	              (intmax_t)ed->size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	if( h->req_command != EHead )
 	{
-		if( h->req_command != EHead )
-			send_data(h, (char *)ed->data, ed->size, 0);
+		/* the thumbnail has to outlive the exif data */
+		data = malloc(ed->size);
+		if( !data )
+		{
+			exif_data_unref(ed);
+			Send500(h);
+			return;
+		}
+		memcpy(data, ed->data, ed->size);
+		queue_data(h, data, ed->size, data);
 	}
 	exif_data_unref(ed);
+	start_transfer(h, &str, -1, 0, -1);
 	CloseSocket_upnphttp(h);
 }
 
@@ -1631,6 +2749,14 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	image_s *imsrc = NULL, *imdst = NULL;
 	int scale = 1;
 	const char *tmode;
+	struct imgcache_key ckey;
+	struct stat st;
+	char etag[ETAG_LEN];
+	off_t cached;
+	int fd;
+#if USE_FORK
+	pid_t newpid = -1;
+#endif
 
 	id = strtoll(object, &saveptr, 10);
 	snprintf(buf, sizeof(buf), "SELECT PATH, RESOLUTION, ROTATION from DETAILS where ID = '%lld'", (long long)id);
@@ -1646,7 +2772,7 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 		resolution = result[4];
 		rotate = result[5] ? atoi(result[5]) : 0;
 	}
-	if( !file_path || !resolution || (access(file_path, F_OK) != 0) )
+	if( !file_path || !resolution || (stat(file_path, &st) != 0) )
 	{
 		DPRINTF(E_WARN, L_HTTP, "%s not found, responding ERROR 404\n", object);
 		sqlite3_free_table(result);
@@ -1686,15 +2812,6 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 		}
 	}
 
-#if USE_FORK
-	pid_t newpid = 0;
-	newpid = process_fork(h->req_client);
-	if( newpid > 0 )
-	{
-		CloseSocket_upnphttp(h);
-		goto resized_error;
-	}
-#endif
 	if( h->reqflags & (FLAG_XFERSTREAMING|FLAG_RANGE) )
 	{
 		DPRINTF(E_WARN, L_HTTP, "Client tried to specify transferMode as Streaming with an image!\n");
@@ -1727,7 +2844,7 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	if( ret != 2 )
 	{
 		Send500(h);
-		return;
+		goto resized_error;
 	}
 	/* Figure out the best destination resolution we can use */
 	dstw = width;
@@ -1762,6 +2879,52 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	else if( srcw>>2 >= dstw && srch>>2 >= dsth )
 		scale = 2;
 
+	/* the output depends on the source file and the geometry */
+	make_etag(etag, id, st.st_mtime,
+	          ((off_t)rotate << 32) | ((off_t)dstw << 16) | dsth);
+	if( check_not_modified(h, etag, st.st_mtime) )
+		goto resized_error;
+
+	/* Slideshows ask for the same photos at the same sizes over and
+	 * over, so serve those from the cache without resizing again */
+	ckey.id = id;
+	ckey.width = dstw;
+	ckey.height = dsth;
+	ckey.rotate = rotate;
+	ckey.mtime = st.st_mtime;
+	fd = imgcache_open(&ckey, &cached);
+	if( fd >= 0 )
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Serving cached %dx%d image\n", dstw, dsth);
+		INIT_STR(str, header);
+		tmode = (h->reqflags & FLAG_XFERBACKGROUND) ? "Background" : "Interactive";
+		start_image_header(h, &str, tmode);
+		add_validators(&str, etag, st.st_mtime);
+		strcatf(&str, "contentFeatures.dlna.org: %sDLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\r\n"
+		              "Content-Length: %jd\r\n\r\n",
+		              dlna_pn, dlna_flags, 0, (intmax_t)cached);
+		start_transfer(h, &str, fd, 0, cached - 1);
+		CloseSocket_upnphttp(h);
+		goto resized_error;
+	}
+
+#if USE_FORK
+	/* The child serves the image, so this connection can't be reused */
+	h->reqflags &= ~FLAG_KEEPALIVE;
+	newpid = process_fork(h->req_client);
+	if( newpid > 0 )
+	{
+		CloseSocket_upnphttp(h);
+		goto resized_error;
+	}
+	/* there is no event loop here to drain the output queue */
+	if( newpid == 0 )
+	{
+		ret = fcntl(h->ev.fd, F_GETFL, 0);
+		if( ret >= 0 )
+			fcntl(h->ev.fd, F_SETFL, ret & ~O_NONBLOCK);
+	}
+#endif
 	INIT_STR(str, header);
 
 #if USE_FORK
@@ -1770,67 +2933,57 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	else
 #endif
 		tmode = "Interactive";
-	start_dlna_header(&str, 200, tmode, "image/jpeg");
+	start_image_header(h, &str, tmode);
+	add_validators(&str, etag, st.st_mtime);
 	strcatf(&str, "contentFeatures.dlna.org: %sDLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\r\n",
 	              dlna_pn, dlna_flags, 0);
 
-	if( strcmp(h->HttpVer, "HTTP/1.0") == 0 )
-	{
-		chunked = 0;
-		imsrc = image_new_from_jpeg(file_path, 1, NULL, 0, scale, rotate);
-	}
-	else
+	chunked = (strcmp(h->HttpVer, "HTTP/1.0") != 0);
+	if( chunked && h->req_command == EHead )
 	{
-		chunked = 1;
 		strcatf(&str, "Transfer-Encoding: chunked\r\n\r\n");
+		start_transfer(h, &str, -1, 0, -1);
+		CloseSocket_upnphttp(h);
+		goto resized_error;
 	}
 
-	if( !chunked )
+	imsrc = image_new_from_jpeg(file_path, 1, NULL, 0, scale, rotate);
+	if( !imsrc )
 	{
-		if( !imsrc )
-		{
-			DPRINTF(E_WARN, L_HTTP, "Unable to open image %s!\n", file_path);
-			Send500(h);
-			goto resized_error;
-		}
-
-		imdst = image_resize(imsrc, dstw, dsth);
-		data = image_save_to_jpeg_buf(imdst, &size);
-
-		strcatf(&str, "Content-Length: %d\r\n\r\n", size);
+		DPRINTF(E_WARN, L_HTTP, "Unable to open image %s!\n", file_path);
+		Send500(h);
+		goto resized_error;
 	}
+	imdst = image_resize(imsrc, dstw, dsth);
+	data = image_save_to_jpeg_buf(imdst, &size);
+	if( !data )
+	{
+		Send500(h);
+		goto resized_error;
+	}
+	imgcache_store(&ckey, data, size);
 
-	if( (send_data(h, str.data, str.off, 0) == 0) && (h->req_command != EHead) )
+	/* the image goes out as a single chunk */
+	if( chunked )
+		strcatf(&str, "Transfer-Encoding: chunked\r\n\r\n%x\r\n", size);
+	else
+		strcatf(&str, "Content-Length: %d\r\n\r\n", size);
+	if( h->req_command != EHead )
 	{
+		queue_data(h, data, size, data);
 		if( chunked )
-		{
-			imsrc = image_new_from_jpeg(file_path, 1, NULL, 0, scale, rotate);
-			if( !imsrc )
-			{
-				DPRINTF(E_WARN, L_HTTP, "Unable to open image %s!\n", file_path);
-				Send500(h);
-				goto resized_error;
-			}
-			imdst = image_resize(imsrc, dstw, dsth);
-			data = image_save_to_jpeg_buf(imdst, &size);
-
-			ret = sprintf(buf, "%x\r\n", size);
-			send_data(h, buf, ret, MSG_MORE);
-			send_data(h, (char *)data, size, MSG_MORE);
-			send_data(h, "\r\n0\r\n\r\n", 7, 0);
-		}
-		else
-		{
-			send_data(h, (char *)data, size, 0);
-		}
+			queue_data(h, "\r\n0\r\n\r\n", 7, NULL);
 	}
+	else
+		free(data);
+	start_transfer(h, &str, -1, 0, -1);
 	DPRINTF(E_INFO, L_HTTP, "Done serving %s\n", file_path);
+	CloseSocket_upnphttp(h);
+resized_error:
 	if( imsrc )
 		image_free(imsrc);
 	if( imdst )
 		image_free(imdst);
-	CloseSocket_upnphttp(h);
-resized_error:
 	sqlite3_free_table(result);
 #if USE_FORK
 	if( newpid == 0 )
@@ -1838,6 +2991,66 @@ resized_error:
 #endif
 }
 
+/* Parse a set of byte ranges such as "0-499,-500" against a file of the
+ * given size.  Returns the number of satisfiable ranges, -1 if the set is
+ * malformed, or -2 if it has more ranges than we are willing to serve. */
+static int
+parse_byteranges(const char *p, off_t size, struct byterange *ranges)
+{
+	char *end;
+	off_t start, last;
+	int n = 0;
+
+	for(;;)
+	{
+		while(*p == ' ' || *p == '\t')
+			p++;
+		if(*p == '-')
+		{
+			/* the final N bytes */
+			last = strtoll(p + 1, &end, 10);
+			if(end == p + 1 || last < 0)
+				return -1;
+			/* "-0" is well formed, but selects nothing */
+			if(last == 0)
+				start = size;
+			else
+				start = (last < size) ? size - last : 0;
+			last = size - 1;
+		}
+		else
+		{
+			start = strtoll(p, &end, 10);
+			if(end == p || *end != '-' || start < 0)
+				return -1;
+			p = end + 1;
+			last = strtoll(p, &end, 10);
+			if(end == p || last >= size)
+				last = size - 1;
+			else if(last < start)
+				return -1;
+		}
+		p = end;
+		if(start < size)
+		{
+			if(n == MAX_RANGES)
+				return -2;
+			ranges[n].start = start;
+			ranges[n].end = last;
+			n++;
+		}
+		while(*p == ' ' || *p == '\t')
+			p++;
+		if(*p != ',')
+			break;
+		p++;
+	}
+	if(*p && *p != '\r' && *p != '\n')
+		return -1;
+
+	return n;
+}
+
 static void
 SendResp_dlnafile(struct upnphttp *h, char *object)
 {
@@ -1846,22 +3059,26 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	char buf[128];
 	char **result;
 	int rows, ret;
-	off_t total, offset, size;
+	off_t total, size;
 	int64_t id;
 	int sendfh;
 	uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B;
 	uint32_t cflags = h->req_client ? h->req_client->type->flags : 0;
 	const char *tmode;
 	enum client_types ctype = h->req_client ? h->req_client->type->type : 0;
+	struct byterange ranges[MAX_RANGES];
+	struct byterange *parts = NULL;
+	char boundary[32], ctype_buf[96];
+	char *body = NULL;
+	int nranges = 0, i;
+	int follow;
+	struct stat st;
 	static struct { int64_t id;
 	                enum client_types client;
 	                char path[PATH_MAX];
 	                char mime[32];
 	                char dlna[96];
 	              } last_file = { 0, 0 };
-#if USE_FORK
-	pid_t newpid = 0;
-#endif
 
 	id = strtoll(object, NULL, 10);
 	if( cflags & FLAG_MS_PFS )
@@ -1880,6 +3097,11 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			return;
 		}
 	}
+	if( h->req_command != EHead && client_admit_stream(h->req_client) != ADMIT_OK )
+	{
+		Send503(h);
+		return;
+	}
 	if( id != last_file.id || ctype != last_file.client )
 	{
 		snprintf(buf, sizeof(buf), "SELECT PATH, MIME, DLNA_PN from DETAILS where ID = '%lld'", (long long)id);
@@ -1929,14 +3151,6 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			last_file.dlna[0] = '\0';
 		sqlite3_free_table(result);
 	}
-#if USE_FORK
-	newpid = process_fork(h->req_client);
-	if( newpid > 0 )
-	{
-		CloseSocket_upnphttp(h);
-		return;
-	}
-#endif
 
 	DPRINTF(E_INFO, L_HTTP, "Serving DetailID: %lld [%s]\n", (long long)id, last_file.path);
 
@@ -1946,7 +3160,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		{
 			DPRINTF(E_WARN, L_HTTP, "Client tried to specify transferMode as Streaming with an image!\n");
 			Send406(h);
-			goto error;
+			return;
 		}
 	}
 	else if( h->reqflags & FLAG_XFERINTERACTIVE )
@@ -1955,7 +3169,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		{
 			DPRINTF(E_WARN, L_HTTP, "Bad realTimeInfo flag with Interactive request!\n");
 			Send400(h);
-			goto error;
+			return;
 		}
 		if( strncmp(last_file.mime, "image", 5) != 0 )
 		{
@@ -1965,58 +3179,146 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			if( !(cflags & FLAG_SAMSUNG) || GETFLAG(DLNA_STRICT_MASK) )
 			{
 				Send406(h);
-				goto error;
+				return;
 			}
 		}
 	}
 
-	offset = h->req_RangeStart;
 	sendfh = _open_file(last_file.path);
 	if( sendfh < 0 ) {
 		if (sendfh == -403)
 			Send403(h);
 		else
 			Send404(h);
-		goto error;
+		return;
 	}
 	size = lseek(sendfh, 0, SEEK_END);
 	lseek(sendfh, 0, SEEK_SET);
 
+	/* A recording that is still being written is sent with chunked
+	 * encoding, and followed as it grows rather than stopping at its
+	 * current size.  Only a request for the whole file qualifies. */
+	follow = ( h->req_command != EHead && strcmp(h->HttpVer, "HTTP/1.0") != 0 &&
+	           (!(h->reqflags & FLAG_RANGE) ||
+	            (strncmp(h->req_RangeList, "0-", 2) == 0 &&
+	             strchr(" \t\r\n", h->req_RangeList[2]))) &&
+	           fstat(sendfh, &st) == 0 && monitor_file_growing(&st) );
+	if( follow )
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Following growing file from %jd bytes\n", (intmax_t)size);
+		h->reqflags &= ~FLAG_RANGE;
+		dlna_flags |= DLNA_FLAG_SN_INCREASE;
+	}
+
 	INIT_STR(str, header);
 
-#if USE_FORK
-	if( (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) )
+	if( h->reqflags & FLAG_XFERBACKGROUND )
 		tmode = "Background";
 	else
-#endif
 	if( strncmp(last_file.mime, "image", 5) == 0 )
 		tmode = "Interactive";
 	else
 		tmode = "Streaming";
 
-	start_dlna_header(&str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, last_file.mime);
-
 	if( h->reqflags & FLAG_RANGE )
 	{
-		if( !h->req_RangeEnd || h->req_RangeEnd == size )
-		{
-			h->req_RangeEnd = size - 1;
-		}
-		if( (h->req_RangeStart > h->req_RangeEnd) || (h->req_RangeStart < 0) )
+		nranges = parse_byteranges(h->req_RangeList, size, ranges);
+		if( nranges == -1 )
 		{
 			DPRINTF(E_WARN, L_HTTP, "Specified range was invalid!\n");
 			Send400(h);
 			close(sendfh);
-			goto error;
+			return;
 		}
-		if( h->req_RangeEnd >= size )
+		else if( nranges == 0 )
 		{
 			DPRINTF(E_WARN, L_HTTP, "Specified range was outside file boundaries!\n");
-			Send416(h);
+			Send416(h, size);
 			close(sendfh);
-			goto error;
+			return;
+		}
+		else if( nranges < 0 )
+		{
+			/* serving the whole file is always allowed */
+			DPRINTF(E_WARN, L_HTTP, "Too many ranges requested, sending the whole file\n");
+			h->reqflags &= ~FLAG_RANGE;
+			nranges = 0;
+		}
+		else if( nranges == 1 )
+		{
+			h->req_RangeStart = ranges[0].start;
+			h->req_RangeEnd = ranges[0].end;
+			nranges = 0;
+		}
+	}
+
+	if( nranges > 1 )
+	{
+		off_t data = 0;
+		int partlen, len;
+
+		/* Lay out the part headers after the response header, and
+		 * work out the Content-Length from them. */
+		snprintf(boundary, sizeof(boundary), "%08x%08x",
+		         (unsigned int)time(NULL), (unsigned int)random());
+		snprintf(ctype_buf, sizeof(ctype_buf), "multipart/byteranges; boundary=%s", boundary);
+		partlen = nranges * (sizeof(boundary) + sizeof(last_file.mime) + 128) + sizeof(boundary) + 16;
+		body = malloc(partlen);
+		parts = calloc(nranges + 1, sizeof(struct byterange));
+		if( !body || !parts )
+		{
+			free(body);
+			free(parts);
+			close(sendfh);
+			Send500(h);
+			return;
+		}
+		len = 0;
+		for( i = 0; i < nranges; i++ )
+		{
+			len += snprintf(body + len, partlen - len,
+			                "%s--%s\r\n"
+			                "Content-Type: %s\r\n"
+			                "Content-Range: bytes %jd-%jd/%jd\r\n\r\n",
+			                i ? "\r\n" : "", boundary, last_file.mime,
+			                (intmax_t)ranges[i].start, (intmax_t)ranges[i].end,
+			                (intmax_t)size);
+			parts[i] = ranges[i];
+			parts[i].buf_end = len;
+			data += ranges[i].end - ranges[i].start + 1;
+		}
+		len += snprintf(body + len, partlen - len, "\r\n--%s--\r\n", boundary);
+		parts[nranges].buf_end = len;
+		parts[nranges].start = 1;
+		parts[nranges].end = 0;
+
+		str.size = sizeof(header) + len;
+		str.data = malloc(str.size);
+		if( !str.data )
+		{
+			free(body);
+			free(parts);
+			close(sendfh);
+			Send500(h);
+			return;
 		}
+		total = data + len;
+		start_dlna_header(h, &str, 206, tmode, ctype_buf);
+	}
+	else
+		start_dlna_header(h, &str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, last_file.mime);
 
+	if( follow )
+	{
+		h->req_RangeEnd = size - 1;
+		strcats(&str, "Transfer-Encoding: chunked\r\n");
+	}
+	else if( nranges > 1 )
+	{
+		strcatf(&str, "Content-Length: %jd\r\n", (intmax_t)total);
+	}
+	else if( h->reqflags & FLAG_RANGE )
+	{
 		total = h->req_RangeEnd - h->req_RangeStart + 1;
 		strcatf(&str, "Content-Length: %jd\r\n"
 		              "Content-Range: bytes %jd-%jd/%jd\r\n",
@@ -2054,18 +3356,32 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	              last_file.dlna, 1, 0, dlna_flags, 0);
 
 	//DEBUG DPRINTF(E_DEBUG, L_HTTP, "RESPONSE: %s\n", str.data);
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	if( nranges > 1 )
 	{
+		/* the part headers follow the response header in res_buf */
 		if( h->req_command != EHead )
-			send_file(h, sendfh, offset, h->req_RangeEnd);
+		{
+			for( i = 0; i <= nranges; i++ )
+				parts[i].buf_end += str.off;
+			strcatn(&str, body, parts[nranges].buf_end - str.off);
+		}
+		start_transfer(h, &str, sendfh, parts[0].start, parts[0].end);
+		if( h->state == 3 && h->req_command != EHead )
+		{
+			h->res_parts = parts;
+			h->res_nparts = nranges + 1;
+			parts = NULL;
+		}
+		CloseSocket_upnphttp(h);
+		free(parts);
+		free(body);
+		free(str.data);
+		return;
 	}
-	close(sendfh);
-
+	if( follow && size > 0 )
+		strcatf(&str, "%jx\r\n", (intmax_t)size);
+	start_transfer(h, &str, sendfh, h->req_RangeStart, h->req_RangeEnd);
+	if( follow && h->state == 3 )
+		h->res_follow = time(NULL);
 	CloseSocket_upnphttp(h);
-error:
-#if USE_FORK
-	if( newpid == 0 )
-		_exit(0);
-#endif
-	return;
 }
@@ -49,12 +49,28 @@
 #ifndef __UPNPHTTP_H__
 #define __UPNPHTTP_H__
 
+#include <stddef.h>
 #include <netinet/in.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 #include "minidlnatypes.h"
+#include "readahead.h"
 #include "config.h"
 
+/* requests up to this size are read without allocating */
+#define REQ_ARENA_SIZE 4096
+
+/* most byte ranges served in one multipart/byteranges response */
+#define MAX_RANGES 16
+
+/* milliseconds between checks on a growing file that has been sent
+ * as far as it goes */
+#define FOLLOW_INTERVAL 250
+
+/* most buffers queued to go out after res_buf */
+#define MAX_RES_IOV 4
+
 /* server: HTTP header returned in all HTTP responses : */
 #define MINIDLNA_SERVER_STRING	OS_VERSION " DLNADOC/1.50 UPnP/1.0 " SERVER_NAME "/" MINIDLNA_VERSION
 
@@ -62,6 +78,10 @@
  states :
   0 - waiting for data to read
   1 - waiting for HTTP Post Content.
+  2 - waiting for chunked HTTP Post Content.
+  3 - sending the output queue, driven by socket writability
+  4 - response sent, connection kept open for the next request
+  5 - being processed by a worker thread
   ...
   >= 100 - to be deleted
 */
@@ -74,17 +94,30 @@ enum httpCommands {
 	EUnSubscribe
 };
 
+/* One part of a multipart/byteranges response: the text up to
+ * res_buf[buf_end] goes out first, then the file range start-end */
+struct byterange {
+	int buf_end;
+	off_t start;
+	off_t end;
+};
+
 struct upnphttp {
 	struct event ev;
 	struct in_addr clientaddr;	/* client address */
 	int iface;
 	int state;
+	int req_count;		/* requests served on this connection */
+	time_t deadline;	/* close if still idle at this time */
 	char HttpVer[16];
 	/* request */
 	char * req_buf;
 	int req_buflen;
+	int req_bufalloc;
 	int req_contentlen;
 	int req_contentoff;     /* header length */
+	int req_parsed;		/* header lines parsed so far */
+	int req_clienttype;	/* client_types[] entry detected from the headers */
 	enum httpCommands req_command;
 	struct client_cache_s * req_client;
 	const char * req_soapAction;
@@ -98,16 +131,37 @@ struct upnphttp {
 	int req_SIDLen;
 	off_t req_RangeStart;
 	off_t req_RangeEnd;
+	const char * req_RangeList;	/* the ranges after "bytes=" */
+	const char * req_IfNoneMatch;
+	time_t req_IfModifiedSince;
 	long int req_chunklen;
+	ptrdiff_t req_chunkoff;	/* next chunk header of a chunked body to check */
 	uint32_t reqflags;
 	/* response */
 	char * res_buf;
 	int res_buflen;
 	int res_buf_alloclen;
 	uint32_t respflags;
+	int res_sent;		/* bytes of res_buf already sent */
+	struct iovec res_iov[MAX_RES_IOV];	/* sent after res_buf, before the file */
+	void * res_iovfree[MAX_RES_IOV];	/* freed when the transfer ends */
+	int res_iovcnt;
+	int res_iovidx;		/* first buffer not yet completely sent */
+	int res_fd;		/* file being transferred in state 3, or -1 */
+	dev_t res_dev;		/* and the filesystem it is on */
+	int res_pipe[2];	/* for splice(), or -1 */
+	size_t res_piped;	/* bytes from res_offset on waiting in res_pipe */
+	off_t res_offset;
+	off_t res_end;
+	struct byterange * res_parts;	/* multipart/byteranges transfer */
+	int res_nparts;
+	int res_part;
+	time_t res_follow;	/* when the growing file being followed last grew */
+	struct readahead res_ra;
 	/*int res_contentlen;*/
 	/*int res_contentoff;*/		/* header length */
 	LIST_ENTRY(upnphttp) entries;
+	char req_arena[REQ_ARENA_SIZE];	/* req_buf, unless the request outgrows it */
 };
 
 #define FLAG_TIMEOUT            0x00000001
@@ -127,6 +181,14 @@ struct upnphttp {
 #define FLAG_XFERINTERACTIVE    0x00002000
 #define FLAG_XFERBACKGROUND     0x00004000
 #define FLAG_CAPTION            0x00008000
+#define FLAG_NOSENDFILE         0x00010000
+#define FLAG_KEEPALIVE          0x00020000
+#define FLAG_CLOSE              0x00040000
+#define FLAG_THROTTLED          0x00080000
+#define FLAG_FOLLOWING          0x00100000
+#define FLAG_NOSPLICE           0x00200000
+#define FLAG_RETRY_AFTER        0x00400000
+#define FLAG_CONTENT_RANGE      0x00800000
 
 #ifndef MSG_MORE
 #define MSG_MORE 0
@@ -136,17 +198,54 @@ struct upnphttp {
 struct upnphttp *
 New_upnphttp(int);
 
-/* CloseSocket_upnphttp() */
+/* CloseSocket_upnphttp()
+ * called once the response has been sent.  The socket is closed,
+ * unless the connection is persistent, in which case it goes back
+ * to waiting for the next request. */
 void
 CloseSocket_upnphttp(struct upnphttp *);
 
+/* Timeout_upnphttp()
+ * close the connection if it has been idle for too long.
+ * returns the time at which it will expire, or 0 if it
+ * is not waiting for a request */
+time_t
+Timeout_upnphttp(struct upnphttp *, time_t now);
+
+/* Resume_upnphttp()
+ * send the response a worker thread built, once the connection
+ * is back in the event loop */
+void
+Resume_upnphttp(struct upnphttp *);
+
+/* Unthrottle_upnphttp()
+ * resume a transfer that was waiting for its client's share
+ * of max_bandwidth to be refilled */
+void
+Unthrottle_upnphttp(struct upnphttp *);
+
+/* Follow_upnphttp()
+ * resume a transfer that was waiting for the file it follows to grow.
+ * returns 1 if it has to wait some more */
+int
+Follow_upnphttp(struct upnphttp *);
+
 /* Delete_upnphttp() */
 void
 Delete_upnphttp(struct upnphttp *);
 
+/* BuildDescs_upnphttp()
+ * generate the device and service descriptions, which are then
+ * served as they are.  Call it again, while no transfer is running,
+ * if anything they contain changes.
+ * returns -1 if one of them could not be generated */
+int
+BuildDescs_upnphttp(void);
+
 /* BuildHeader_upnphttp()
  * build the header for the HTTP Response
- * also allocate the buffer for body data */
+ * also allocate the buffer for body data.  A bodylen of -1 announces
+ * a chunked body, to be sent with Stream_upnphttp() */
 void
 BuildHeader_upnphttp(struct upnphttp * h, int respcode,
                      const char * respmsg,
@@ -170,10 +269,20 @@ void
 Send500(struct upnphttp *);
 void
 Send501(struct upnphttp *);
+void
+Send503(struct upnphttp *);
 
 /* SendResp_upnphttp() */
 void
 SendResp_upnphttp(struct upnphttp *);
 
+/* Stream_upnphttp()
+ * from a worker thread, send len bytes of a chunked body straight to
+ * the socket, after the headers if they haven't gone out yet, waiting
+ * for the client to take them.  data NULL ends the body.
+ * returns -1 if the client stopped reading */
+int
+Stream_upnphttp(struct upnphttp *h, const void *data, size_t len);
+
 #endif
 
@@ -73,6 +73,12 @@
 #include "sql.h"
 #include "log.h"
 #include "upnpevents.h"
+#include "workers.h"
+#include "browsecache.h"
+#include "didl.h"
+
+/* What parse_sort_criteria() may order by */
+#define SEARCH_SORT_COLUMNS "o.CLASS, d.TITLE, d.DATE, d.DISC, d.TRACK, d.ALBUM"
 
 #ifdef __sparc__ /* Sorting takes too long on slow processors with very large containers */
 # define __SORT_LIMIT if( totalMatches < 10000 )
@@ -132,20 +138,20 @@ _SoapError(struct upnphttp * h, int errCode, const char * errDesc, const char *f
 	CloseSocket_upnphttp(h);
 }
 
+static const char beforebody[] =
+	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	"<s:Body>";
+
+static const char afterbody[] =
+	"</s:Body>"
+	"</s:Envelope>\r\n";
+
 static void
 BuildSendAndCloseSoapResp(struct upnphttp * h,
                           const char * body, int bodylen)
 {
-	static const char beforebody[] =
-		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
-		"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-		"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-		"<s:Body>";
-
-	static const char afterbody[] =
-		"</s:Body>"
-		"</s:Envelope>\r\n";
-
 	if (!body || bodylen < 0)
 	{
 		Send500(h);
@@ -168,6 +174,48 @@ BuildSendAndCloseSoapResp(struct upnphttp * h,
 	CloseSocket_upnphttp(h);
 }
 
+/* A Browse or Search result that outgrows its buffer is sent on as a
+ * chunk, with the headers and envelope ahead of the first one, and the
+ * buffer is then reused for the rows that follow */
+static int
+FlushSoapResp(struct Response *args)
+{
+	struct string_s *str = args->str;
+
+	if (!args->streaming)
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Streaming large SOAP response\n");
+		BuildHeader_upnphttp(args->h, 200, "OK", -1);
+		args->streaming = 1;
+		if (Stream_upnphttp(args->h, beforebody, sizeof(beforebody) - 1) < 0)
+			return -1;
+	}
+	if (Stream_upnphttp(args->h, str->data, str->off) < 0)
+		return -1;
+	str->off = 0;
+
+	return 0;
+}
+
+static void
+SendAndCloseSoapResult(struct upnphttp *h, struct Response *args)
+{
+	struct string_s *str = args->str;
+
+	if (!args->streaming)
+	{
+		BuildSendAndCloseSoapResp(h, str->data, str->off);
+		return;
+	}
+	if (Stream_upnphttp(h, str->data, str->off) < 0 ||
+	    Stream_upnphttp(h, afterbody, sizeof(afterbody) - 1) < 0 ||
+	    Stream_upnphttp(h, NULL, 0) < 0)
+		h->reqflags &= ~FLAG_KEEPALIVE;
+	/* all of it has been sent already */
+	h->res_buflen = 0;
+	CloseSocket_upnphttp(h);
+}
+
 static void
 GetSystemUpdateID(struct upnphttp * h, const char * action)
 {
@@ -725,17 +773,50 @@ _alphasort_alt_title(char **title, char **alt_title, int requested, int returned
 	free(old_title);
 }
 
+/* Append "http://<address>:<port>/<dir>/<name><suffix>" for the interface
+ * the request came in on */
+static void
+add_url(struct Response *args, const char *dir, const char *name, const char *suffix)
+{
+	struct string_s *str = args->str;
+
+	didl_lit(str, "http://");
+	didl_text(str, lan_addr[args->iface].str);
+	didl_lit(str, ":");
+	didl_int(str, runtime_vars.port);
+	didl_lit(str, "/");
+	didl_text(str, dir);
+	didl_lit(str, "/");
+	didl_text(str, name);
+	didl_text(str, suffix);
+}
+
+/* Append "<prefix>http://.../AlbumArt/<album_art>-<detailID>.jpg<suffix>" */
+static void
+add_album_art(struct Response *args, const char *prefix, const char *album_art,
+              const char *detailID, const char *suffix)
+{
+	struct string_s *str = args->str;
+
+	didl_text(str, prefix);
+	add_url(args, "AlbumArt", album_art, "-");
+	didl_text(str, detailID);
+	didl_lit(str, ".jpg");
+	didl_text(str, suffix);
+}
+
 inline static void
 add_resized_res(int srcw, int srch, int reqw, int reqh, char *dlna_pn,
                 char *detailID, struct Response *args)
 {
+	struct string_s *str = args->str;
 	int dstw = reqw;
 	int dsth = reqh;
 
 	if( (args->flags & FLAG_NO_RESIZE) && reqw > 160 && reqh > 160 )
 		return;
 
-	strcatf(args->str, "&lt;res ");
+	didl_lit(str, "&lt;res ");
 	if( args->filter & FILTER_RES_RESOLUTION )
 	{
 		dstw = reqw;
@@ -744,15 +825,23 @@ add_resized_res(int srcw, int srch, int reqw, int reqh, char *dlna_pn,
 			dsth = reqh;
 			dstw = (((reqh<<10)/srch) * srcw>>10);
 		}
-		strcatf(args->str, "resolution=\"%dx%d\" ", dstw, dsth);
+		didl_lit(str, "resolution=\"");
+		didl_int(str, dstw);
+		didl_lit(str, "x");
+		didl_int(str, dsth);
+		didl_lit(str, "\" ");
 	}
-	strcatf(args->str, "protocolInfo=\"http-get:*:image/jpeg:"
-	                          "DLNA.ORG_PN=%s;DLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\"&gt;"
-	                          "http://%s:%d/Resized/%s.jpg?width=%d,height=%d"
-	                          "&lt;/res&gt;",
-	                          dlna_pn, DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B|DLNA_FLAG_TM_I, 0,
-	                          lan_addr[args->iface].str, runtime_vars.port,
-	                          detailID, dstw, dsth);
+	didl_lit(str, "protocolInfo=\"http-get:*:image/jpeg:DLNA.ORG_PN=");
+	didl_text(str, dlna_pn);
+	didl_lit(str, ";DLNA.ORG_CI=1;DLNA.ORG_FLAGS=");
+	didl_hex(str, DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B|DLNA_FLAG_TM_I, 8);
+	didl_hex(str, 0, 24);
+	didl_lit(str, "\"&gt;");
+	add_url(args, "Resized", detailID, ".jpg?width=");
+	didl_int(str, dstw);
+	didl_lit(str, ",height=");
+	didl_int(str, dsth);
+	didl_lit(str, "&lt;/res&gt;");
 }
 
 inline static void
@@ -760,69 +849,154 @@ add_res(char *size, char *duration, char *bitrate, char *sampleFrequency,
         char *nrAudioChannels, char *resolution, char *dlna_pn, char *mime,
         char *detailID, const char *ext, struct Response *args)
 {
-	strcatf(args->str, "&lt;res ");
+	struct string_s *str = args->str;
+
+	didl_lit(str, "&lt;res ");
 	if( size && (args->filter & FILTER_RES_SIZE) ) {
-		strcatf(args->str, "size=\"%s\" ", size);
+		didl_attr(str, "size", size);
 	}
 	if( duration && (args->filter & FILTER_RES_DURATION) ) {
-		strcatf(args->str, "duration=\"%s\" ", duration);
+		didl_attr(str, "duration", duration);
 	}
 	if( bitrate && (args->filter & FILTER_RES_BITRATE) ) {
 		int br = atoi(bitrate);
 		if(args->flags & FLAG_MS_PFS)
 			br /= 8;
-		strcatf(args->str, "bitrate=\"%d\" ", br);
+		didl_lit(str, "bitrate=\"");
+		didl_int(str, br);
+		didl_lit(str, "\" ");
 	}
 	if( sampleFrequency && (args->filter & FILTER_RES_SAMPLEFREQUENCY) ) {
-		strcatf(args->str, "sampleFrequency=\"%s\" ", sampleFrequency);
+		didl_attr(str, "sampleFrequency", sampleFrequency);
 	}
 	if( nrAudioChannels && (args->filter & FILTER_RES_NRAUDIOCHANNELS) ) {
-		strcatf(args->str, "nrAudioChannels=\"%s\" ", nrAudioChannels);
+		didl_attr(str, "nrAudioChannels", nrAudioChannels);
 	}
 	if( resolution && (args->filter & FILTER_RES_RESOLUTION) ) {
-		strcatf(args->str, "resolution=\"%s\" ", resolution);
+		didl_attr(str, "resolution", resolution);
 	}
 	if( args->filter & FILTER_PV_SUBTITLE )
 	{
 		if( args->flags & FLAG_HAS_CAPTIONS )
 		{
 			if( args->filter & FILTER_PV_SUBTITLE_FILE_TYPE )
-				strcatf(args->str, "pv:subtitleFileType=\"SRT\" ");
-			if( args->filter & FILTER_PV_SUBTITLE_FILE_URI )
-				strcatf(args->str, "pv:subtitleFileUri=\"http://%s:%d/Captions/%s.srt\" ",
-					lan_addr[args->iface].str, runtime_vars.port, detailID);
+				didl_lit(str, "pv:subtitleFileType=\"SRT\" ");
+			if( args->filter & FILTER_PV_SUBTITLE_FILE_URI ) {
+				didl_lit(str, "pv:subtitleFileUri=\"");
+				add_url(args, "Captions", detailID, ".srt");
+				didl_lit(str, "\" ");
+			}
 		}
 	}
-	strcatf(args->str, "protocolInfo=\"http-get:*:%s:%s\"&gt;"
-	                          "http://%s:%d/MediaItems/%s.%s"
-	                          "&lt;/res&gt;",
-	                          mime, dlna_pn, lan_addr[args->iface].str,
-	                          runtime_vars.port, detailID, ext);
+	didl_lit(str, "protocolInfo=\"http-get:*:");
+	didl_text(str, mime);
+	didl_lit(str, ":");
+	didl_text(str, dlna_pn);
+	didl_lit(str, "\"&gt;");
+	add_url(args, "MediaItems", detailID, ".");
+	didl_text(str, ext);
+	didl_lit(str, "&lt;/res&gt;");
+}
+
+/* Object queries are cached as prepared statements, so the client's PINs
+ * are bound as one parameter: ":pw" holds ",1234,5678," and is matched
+ * with instr() rather than spliced in as an "in ('1234','5678')" list. */
+#define PASSWORD_WHERE(t) "(" t "password is null or " t "password = '' or " \
+                          "instr(:pw, ',' || " t "password || ',') > 0)"
+
+static char *
+password_list(const char *password)
+{
+	char *list, *p;
+
+	list = p = malloc((password ? strlen(password) : 0) + 3);
+	if (!list)
+		return NULL;
+	*p++ = ',';
+	for (; password && *password; password++)
+	{
+		if (*password != '\'')
+			*p++ = *password;
+	}
+	*p++ = ',';
+	*p = '\0';
+
+	return list;
+}
+
+static void
+bind_object_params(sqlite3_stmt *stmt, const char *id, const char *glob, const char *pw)
+{
+	sql_bind_text(stmt, ":id", id);
+	sql_bind_text(stmt, ":glob", glob);
+	sql_bind_text(stmt, ":pw", pw);
+}
+
+static int
+count_objects(sqlite3 *db, const char *sql, const char *id, const char *glob, const char *password)
+{
+	sqlite3_stmt *stmt;
+	char *pw;
+	int ret;
+
+	stmt = sql_prepare_cached(db, sql);
+	if (!stmt)
+		return -1;
+	pw = password_list(password);
+	bind_object_params(stmt, id, glob, pw);
+	switch (sqlite3_step(stmt))
+	{
+		case SQLITE_ROW:
+			ret = sqlite3_column_int(stmt, 0);
+			break;
+		case SQLITE_DONE:
+			ret = 0;
+			break;
+		default:
+			DPRINTF(E_WARN, L_DB_SQL, "%s: step failed: %s\n%s\n", __func__, sqlite3_errmsg(db), sql);
+			ret = -1;
+			break;
+	}
+	sql_release_cached(stmt);
+	free(pw);
+
+	return ret;
 }
 
 static int
-get_child_count(const char *object, struct magic_container_s *magic, const char *password)
+get_child_count(sqlite3 *db, const char *object, struct magic_container_s *magic, const char *password)
 {
 	int ret;
 
 	if (magic && magic->child_count) {
 		if (strcmp(magic->child_count, "OBJECTS") == 0) {
-			ret = sql_get_int_field(db, "SELECT count(*) from %s where (password is null or password = '' or password in (%s))", magic->child_count, password ? password : "''");
+			ret = count_objects(db, "SELECT count(*) from OBJECTS where " PASSWORD_WHERE(""),
+			                    NULL, NULL, password);
 		} else {
-			ret = sql_get_int_field(db, "SELECT count(*) from %s", magic->child_count);
+			char *sql = sqlite3_mprintf("SELECT count(*) from %s", magic->child_count);
+			ret = count_objects(db, sql, NULL, NULL, password);
+			sqlite3_free(sql);
 		}
 
-	} else if (magic && magic->objectid && *(magic->objectid)) {
-		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s' and (password is null or password = '' or password in (%s));", *(magic->objectid), password ? password : "''");
 	} else {
-		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s' and (password is null or password = '' or password in (%s));", object, password ? password : "''");
+		if (magic && magic->objectid && *(magic->objectid))
+			object = *(magic->objectid);
+		/* The scanner keeps CHILD_COUNT up to date, except during the
+		 * first scan; children behind a password are counted here. */
+		ret = -1;
+		if (!GETFLAG(SCANNING_MASK))
+			ret = count_objects(db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = :id and LOCKED_COUNT = 0",
+			                    object, NULL, NULL);
+		if (ret <= 0)
+			ret = count_objects(db, "SELECT count(*) from OBJECTS where PARENT_ID = :id and " PASSWORD_WHERE(""),
+			                    object, NULL, password);
 	}
 
 	return (ret > 0) ? ret : 0;
 }
 
 static int
-object_exists(const char *object)
+object_exists(sqlite3 *db, const char *object)
 {
 	int ret;
 	ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%q'",
@@ -830,27 +1004,86 @@ object_exists(const char *object)
 	return (ret > 0);
 }
 
-#define COLUMNS "o.DETAIL_ID, o.CLASS," \
-                " d.SIZE, d.TITLE, d.DURATION, d.BITRATE, d.SAMPLERATE, d.ARTIST," \
-                " d.ALBUM, d.GENRE, d.COMMENT, d.CHANNELS, d.TRACK, d.DATE, d.RESOLUTION," \
-                " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.DISC "
-#define SELECT_COLUMNS "SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, " COLUMNS
+/* What callback() reads from each row, after the three IDs.  Columns
+ * that neither the filter nor the client's quirks call for are selected
+ * as NULL, so that the others keep their positions, and each mix of
+ * them becomes a statement of its own in the cache.  A filter of 0
+ * means the column is always needed.  Columns the ORDER BY names are
+ * always selected too, since a compound SELECT can only be ordered by
+ * its own result columns. */
+static const struct {
+	const char *name;
+	uint32_t filter;	/* DIDL properties it is used for */
+	uint32_t flags;		/* client flags it is used for */
+	uint32_t runtime;	/* runtime_flags it is used for */
+} object_columns[] = {
+	{ "o.DETAIL_ID",    0, 0, 0 },
+	{ "o.CLASS",        0, 0, 0 },
+	{ "d.SIZE",         0, 0, 0 },	/* also storageUsed of storage folders */
+	{ "d.TITLE",        0, 0, 0 },
+	{ "d.DURATION",     FILTER_RES, 0, 0 },
+	{ "d.BITRATE",      FILTER_RES, 0, 0 },
+	{ "d.SAMPLERATE",   FILTER_RES, 0, 0 },
+	{ "d.ARTIST",       FILTER_UPNP_ARTIST|FILTER_UPNP_ACTOR, 0, 0 },
+	{ "d.ALBUM",        FILTER_UPNP_ALBUM, FLAG_MS_PFS, 0 },
+	{ "d.GENRE",        FILTER_UPNP_GENRE, 0, 0 },
+	{ "d.COMMENT",      FILTER_DC_DESCRIPTION, 0, 0 },
+	{ "d.CHANNELS",     FILTER_RES, 0, 0 },
+	{ "d.TRACK",        FILTER_UPNP_ORIGINALTRACKNUMBER|FILTER_UPNP_EPISODENUMBER|FILTER_UPNP_EPISODESEASON,
+	                    0, FORCE_ALPHASORT_MASK },
+	{ "d.DATE",         FILTER_DC_DATE, 0, 0 },
+	{ "d.RESOLUTION",   FILTER_RES, 0, 0 },
+	{ "d.THUMBNAIL",    FILTER_RES, FLAG_MS_PFS, 0 },
+	{ "d.CREATOR",      FILTER_DC_CREATOR, FLAG_MIME_AVI_DIVX, 0 },
+	{ "d.DLNA_PN",      0, 0, 0 },
+	{ "d.MIME",         0, 0, 0 },
+	{ "d.ALBUM_ART",    FILTER_RES|FILTER_UPNP_ALBUMARTURI, 0, 0 },
+	{ "d.ROTATION",     FILTER_RES, FLAG_MS_PFS, 0 },
+	{ "d.DISC",         FILTER_UPNP_EPISODESEASON, 0, FORCE_ALPHASORT_MASK },
+	{ "o.CHILD_COUNT",  FILTER_CHILDCOUNT, 0, 0 },
+	{ "o.LOCKED_COUNT", FILTER_CHILDCOUNT, 0, 0 },
+};
+
+static const char *
+select_columns(const struct Response *args, const char *orderBy, char *buf, size_t len)
+{
+	struct string_s str = { buf, 0, len };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(object_columns) / sizeof(object_columns[0]); i++)
+	{
+		int used = !object_columns[i].filter ||
+		           (args->filter & object_columns[i].filter) ||
+		           (args->flags & object_columns[i].flags) ||
+		           GETFLAG(object_columns[i].runtime) ||
+		           (orderBy && strstr(orderBy, object_columns[i].name));
+		strcatf(&str, "%s%s", i ? ", " : "", used ? object_columns[i].name : "NULL");
+	}
+
+	return buf;
+}
+
+#define COLUMN(n) (char *)sqlite3_column_text(stmt, n)
 
 static int
-callback(void *args, int argc, char **argv, char **azColName)
+callback(struct Response *passed_args, sqlite3_stmt *stmt)
 {
-	struct Response *passed_args = (struct Response *)args;
-	char *id = argv[0], *parent = argv[1], *refID = argv[2], *detailID = argv[3], *class = argv[4], *size = argv[5], *title = argv[6],
-	     *duration = argv[7], *bitrate = argv[8], *sampleFrequency = argv[9], *artist = argv[10], *album = argv[11],
-	     *genre = argv[12], *comment = argv[13], *nrAudioChannels = argv[14], *track = argv[15], *date = argv[16], *resolution = argv[17],
-	     *tn = argv[18], *creator = argv[19], *dlna_pn = argv[20], *mime = argv[21], *album_art = argv[22], *rotate = argv[23], *disc = argv[24];
-	char dlna_buf[128];
+	char *id = COLUMN(0), *parent = COLUMN(1), *refID = COLUMN(2), *detailID = COLUMN(3), *class = COLUMN(4), *size = COLUMN(5), *title = COLUMN(6),
+	     *duration = COLUMN(7), *bitrate = COLUMN(8), *sampleFrequency = COLUMN(9), *artist = COLUMN(10), *album = COLUMN(11),
+	     *genre = COLUMN(12), *comment = COLUMN(13), *nrAudioChannels = COLUMN(14), *track = COLUMN(15), *date = COLUMN(16), *resolution = COLUMN(17),
+	     *tn = COLUMN(18), *creator = COLUMN(19), *dlna_pn = COLUMN(20), *mime = COLUMN(21), *album_art = COLUMN(22), *rotate = COLUMN(23), *disc = COLUMN(24);
+	char dlna_buf[128], mime_buf[64];
 	const char *ext;
 	struct string_s *str = passed_args->str;
 	int ret = 0;
 
 	/* Make sure we have at least 8KB left of allocated memory to finish the response. */
-	if( str->off > (str->size - 8192) )
+	if( str->off > (str->size - 8192) && passed_args->h )
+	{
+		if( FlushSoapResp(passed_args) != 0 )
+			return -1;
+	}
+	else if( str->off > (str->size - 8192) )
 	{
 #if MAX_RESPONSE_SIZE > 0
 		if( (str->size+DEFAULT_RESP_SIZE) <= MAX_RESPONSE_SIZE )
@@ -884,6 +1117,12 @@ callback(void *args, int argc, char **argv, char **azColName)
 	{
 		uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B;
 		char *alt_title = NULL;
+		/* The MIME type gets rewritten per client below; column text belongs to SQLite */
+		if( mime )
+		{
+			strncpyt(mime_buf, mime, sizeof(mime_buf));
+			mime = mime_buf;
+		}
 		/* We may need special handling for certain MIME types */
 		if( *mime == 'v' )
 		{
@@ -927,7 +1166,7 @@ callback(void *args, int argc, char **argv, char **azColName)
 			if( (passed_args->flags & FLAG_CAPTION_RES) ||
 			    (passed_args->filter & (FILTER_SEC_CAPTION_INFO_EX|FILTER_PV_SUBTITLE)) )
 			{
-				if( sql_get_int_field(db, "SELECT ID from CAPTIONS where ID = '%s'", detailID) > 0 )
+				if( sql_get_int_field(passed_args->db, "SELECT ID from CAPTIONS where ID = '%s'", detailID) > 0 )
 					passed_args->flags |= FLAG_HAS_CAPTIONS;
 			}
 			/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
@@ -951,7 +1190,13 @@ callback(void *args, int argc, char **argv, char **azColName)
 			else if( passed_args->client == EAsusOPlay && (passed_args->flags & FLAG_HAS_CAPTIONS) )
 			{
 				if( strlen(title) > 23 )
-					title[23] = '\0';
+				{
+					ret = asprintf(&alt_title, "%.23s", title);
+					if( ret > 0 )
+						title = alt_title;
+					else
+						alt_title = NULL;
+				}
 			}
 			/* Hyundai hack: Only titles with a media extension get recognized. */
 			else if( passed_args->client == EHyundaiTV )
@@ -991,83 +1236,98 @@ callback(void *args, int argc, char **argv, char **azColName)
 		if( passed_args->flags & FLAG_SKIP_DLNA_PN )
 			dlna_pn = NULL;
 
-		if( dlna_pn )
-			snprintf(dlna_buf, sizeof(dlna_buf), "DLNA.ORG_PN=%s;"
-			                                     "DLNA.ORG_OP=01;"
-			                                     "DLNA.ORG_CI=0;"
-			                                     "DLNA.ORG_FLAGS=%08X%024X",
-			                                     dlna_pn, dlna_flags, 0);
-		else if( passed_args->flags & FLAG_DLNA )
-			snprintf(dlna_buf, sizeof(dlna_buf), "DLNA.ORG_OP=01;"
-			                                     "DLNA.ORG_CI=0;"
-			                                     "DLNA.ORG_FLAGS=%08X%024X",
-			                                     dlna_flags, 0);
+		if( dlna_pn || (passed_args->flags & FLAG_DLNA) )
+		{
+			struct string_s pn = { dlna_buf, 0, sizeof(dlna_buf) };
+
+			if( dlna_pn ) {
+				didl_lit(&pn, "DLNA.ORG_PN=");
+				didl_text(&pn, dlna_pn);
+				didl_lit(&pn, ";");
+			}
+			didl_lit(&pn, "DLNA.ORG_OP=01;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=");
+			didl_hex(&pn, dlna_flags, 8);
+			didl_hex(&pn, 0, 24);
+			dlna_buf[MIN(pn.off, sizeof(dlna_buf) - 1)] = '\0';
+		}
 		else
 			strcpy(dlna_buf, "*");
 
-		ret = strcatf(str, "&lt;item id=\"%s\" parentID=\"%s\" restricted=\"1\"", id, parent);
+		didl_lit(str, "&lt;item id=\"");
+		didl_text(str, id);
+		didl_lit(str, "\" parentID=\"");
+		didl_text(str, parent);
+		didl_lit(str, "\" restricted=\"1\"");
 		if( refID && (passed_args->filter & FILTER_REFID) ) {
-			ret = strcatf(str, " refID=\"%s\"", refID);
-		}
-		ret = strcatf(str, "&gt;"
-		                   "&lt;dc:title&gt;%s&lt;/dc:title&gt;"
-		                   "&lt;upnp:class&gt;object.%s&lt;/upnp:class&gt;",
-		                   title, class);
+			didl_lit(str, " refID=\"");
+			didl_text(str, refID);
+			didl_lit(str, "\"");
+		}
+		didl_lit(str, "&gt;");
+		didl_tag(str, "dc:title", title);
+		didl_lit(str, "&lt;upnp:class&gt;object.");
+		didl_text(str, class);
+		didl_lit(str, "&lt;/upnp:class&gt;");
 		if( comment && (passed_args->filter & FILTER_DC_DESCRIPTION) ) {
-			ret = strcatf(str, "&lt;dc:description&gt;%.384s&lt;/dc:description&gt;", comment);
+			didl_lit(str, "&lt;dc:description&gt;");
+			strcatn(str, comment, strnlen(comment, 384));
+			didl_lit(str, "&lt;/dc:description&gt;");
 		}
 		if( creator && (passed_args->filter & FILTER_DC_CREATOR) ) {
-			ret = strcatf(str, "&lt;dc:creator&gt;%s&lt;/dc:creator&gt;", creator);
+			didl_tag(str, "dc:creator", creator);
 		}
 		if( date && (passed_args->filter & FILTER_DC_DATE) ) {
-			ret = strcatf(str, "&lt;dc:date&gt;%s&lt;/dc:date&gt;", date);
+			didl_tag(str, "dc:date", date);
 		}
 		if( (passed_args->filter & FILTER_BOOKMARK_MASK) ) {
 			/* Get bookmark */
-			int sec = sql_get_int_field(db, "SELECT SEC from BOOKMARKS where ID = '%s'", detailID);
+			int sec = sql_get_int_field(passed_args->db, "SELECT SEC from BOOKMARKS where ID = '%s'", detailID);
 			if( sec > 0 ) {
 				/* This format is wrong according to the UPnP/AV spec.  It should be in duration format,
 				** so HH:MM:SS. But Kodi seems to be the only user of this tag, and it only works with a
 				** raw seconds value.
 				** If Kodi gets fixed, we can use duration_str(sec * 1000) here */
-				if( passed_args->filter & FILTER_UPNP_LASTPLAYBACKPOSITION )
-					ret = strcatf(str, "&lt;upnp:lastPlaybackPosition&gt;%d&lt;/upnp:lastPlaybackPosition&gt;",
-					              sec);
+				if( passed_args->filter & FILTER_UPNP_LASTPLAYBACKPOSITION ) {
+					didl_lit(str, "&lt;upnp:lastPlaybackPosition&gt;");
+					didl_int(str, sec);
+					didl_lit(str, "&lt;/upnp:lastPlaybackPosition&gt;");
+				}
 				if( passed_args->filter & FILTER_SEC_DCM_INFO )
 					ret = strcatf(str, "&lt;sec:dcmInfo&gt;CREATIONDATE=0,FOLDER=%s,BM=%d&lt;/sec:dcmInfo&gt;",
 					              title, sec);
 			}
 			if( passed_args->filter & FILTER_UPNP_PLAYBACKCOUNT ) {
-				ret = strcatf(str, "&lt;upnp:playbackCount&gt;%d&lt;/upnp:playbackCount&gt;",
-				              sql_get_int_field(db, "SELECT WATCH_COUNT from BOOKMARKS where ID = '%s'", detailID));
+				didl_lit(str, "&lt;upnp:playbackCount&gt;");
+				didl_int(str, sql_get_int_field(passed_args->db, "SELECT WATCH_COUNT from BOOKMARKS where ID = '%s'", detailID));
+				didl_lit(str, "&lt;/upnp:playbackCount&gt;");
 			}
 		}
 		free(alt_title);
 		if( artist ) {
 			if( (*mime == 'v') && (passed_args->filter & FILTER_UPNP_ACTOR) ) {
-				ret = strcatf(str, "&lt;upnp:actor&gt;%s&lt;/upnp:actor&gt;", artist);
+				didl_tag(str, "upnp:actor", artist);
 			}
 			if( passed_args->filter & FILTER_UPNP_ARTIST ) {
-				ret = strcatf(str, "&lt;upnp:artist&gt;%s&lt;/upnp:artist&gt;", artist);
+				didl_tag(str, "upnp:artist", artist);
 			}
 		}
 		if( album && (passed_args->filter & FILTER_UPNP_ALBUM) ) {
-			ret = strcatf(str, "&lt;upnp:album&gt;%s&lt;/upnp:album&gt;", album);
+			didl_tag(str, "upnp:album", album);
 		}
 		if( genre && (passed_args->filter & FILTER_UPNP_GENRE) ) {
-			ret = strcatf(str, "&lt;upnp:genre&gt;%s&lt;/upnp:genre&gt;", genre);
+			didl_tag(str, "upnp:genre", genre);
 		}
 		if( strncmp(id, MUSIC_PLIST_ID, strlen(MUSIC_PLIST_ID)) == 0 ) {
 			track = strrchr(id, '$')+1;
 		}
 		if( NON_ZERO(track) ) {
 			if( *mime == 'a' && (passed_args->filter & FILTER_UPNP_ORIGINALTRACKNUMBER) ) {
-				ret = strcatf(str, "&lt;upnp:originalTrackNumber&gt;%s&lt;/upnp:originalTrackNumber&gt;", track);
+				didl_tag(str, "upnp:originalTrackNumber", track);
 			} else if( *mime == 'v' ) {
 				if( NON_ZERO(disc) && (passed_args->filter & FILTER_UPNP_EPISODESEASON) )
-					ret = strcatf(str, "&lt;upnp:episodeSeason&gt;%s&lt;/upnp:episodeSeason&gt;", disc);
+					didl_tag(str, "upnp:episodeSeason", disc);
 				if( passed_args->filter & FILTER_UPNP_EPISODENUMBER )
-					ret = strcatf(str, "&lt;upnp:episodeNumber&gt;%s&lt;/upnp:episodeNumber&gt;", track);
+					didl_tag(str, "upnp:episodeNumber", track);
 			}
 		}
 		if( passed_args->filter & FILTER_RES ) {
@@ -1086,11 +1346,11 @@ callback(void *args, int argc, char **argv, char **azColName)
 						add_resized_res(srcw, srch, 640, 480, "JPEG_SM", detailID, passed_args);
 				}
 				if( !(passed_args->flags & FLAG_RESIZE_THUMBS) && NON_ZERO(tn) && IS_ZERO(rotate) ) {
-					ret = strcatf(str, "&lt;res protocolInfo=\"http-get:*:%s:%s\"&gt;"
-					                   "http://%s:%d/Thumbnails/%s.jpg"
-					                   "&lt;/res&gt;",
-					                   mime, "DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1", lan_addr[passed_args->iface].str,
-					                   runtime_vars.port, detailID);
+					didl_lit(str, "&lt;res protocolInfo=\"http-get:*:");
+					didl_text(str, mime);
+					didl_lit(str, ":DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1\"&gt;");
+					add_url(passed_args, "Thumbnails", detailID, ".jpg");
+					didl_lit(str, "&lt;/res&gt;");
 				}
 				else
 					add_resized_res(srcw, srch, 160, 160, "JPEG_TN", detailID, passed_args);
@@ -1169,16 +1429,16 @@ callback(void *args, int argc, char **argv, char **azColName)
 				default:
 					if( passed_args->flags & FLAG_HAS_CAPTIONS )
 					{
-						if( passed_args->flags & FLAG_CAPTION_RES )
-							ret = strcatf(str, "&lt;res protocolInfo=\"http-get:*:text/srt:*\"&gt;"
-									     "http://%s:%d/Captions/%s.srt"
-									   "&lt;/res&gt;",
-									   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
-						if( passed_args->filter & FILTER_SEC_CAPTION_INFO_EX )
-							ret = strcatf(str, "&lt;sec:CaptionInfoEx sec:type=\"srt\"&gt;"
-							                     "http://%s:%d/Captions/%s.srt"
-							                   "&lt;/sec:CaptionInfoEx&gt;",
-							                   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
+						if( passed_args->flags & FLAG_CAPTION_RES ) {
+							didl_lit(str, "&lt;res protocolInfo=\"http-get:*:text/srt:*\"&gt;");
+							add_url(passed_args, "Captions", detailID, ".srt");
+							didl_lit(str, "&lt;/res&gt;");
+						}
+						if( passed_args->filter & FILTER_SEC_CAPTION_INFO_EX ) {
+							didl_lit(str, "&lt;sec:CaptionInfoEx sec:type=\"srt\"&gt;");
+							add_url(passed_args, "Captions", detailID, ".srt");
+							didl_lit(str, "&lt;/sec:CaptionInfoEx&gt;");
+						}
 					}
 					break;
 				}
@@ -1188,91 +1448,102 @@ callback(void *args, int argc, char **argv, char **azColName)
 		{
 			/* Video and audio album art is handled differently */
 			if( *mime == 'v' && (passed_args->filter & FILTER_RES) && !(passed_args->flags & FLAG_MS_PFS) ) {
-				ret = strcatf(str, "&lt;res protocolInfo=\"http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_TN\"&gt;"
-				                   "http://%s:%d/AlbumArt/%s-%s.jpg"
-				                   "&lt;/res&gt;",
-				                   lan_addr[passed_args->iface].str, runtime_vars.port, album_art, detailID);
+				add_album_art(passed_args, "&lt;res protocolInfo=\"http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_TN\"&gt;",
+				              album_art, detailID, "&lt;/res&gt;");
 				if (passed_args->client == ESamsungSeriesCDE ) {
-					ret = strcatf(str, "&lt;res dlna:profileID=\"JPEG_SM\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\""
-							   " protocolInfo=\"http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_SM;"
-							   "DLNA.ORG_OP=01;DLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\" resolution=\"320x320\"&gt;"
-							   "http://%s:%d/AlbumArt/%s-%s.jpg"
-							   "&lt;/res&gt;",
-							   DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_TM_B|DLNA_FLAG_TM_I, 0,
-							   lan_addr[passed_args->iface].str, runtime_vars.port, album_art, detailID);
+					didl_lit(str, "&lt;res dlna:profileID=\"JPEG_SM\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\""
+					              " protocolInfo=\"http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_SM;"
+					              "DLNA.ORG_OP=01;DLNA.ORG_CI=1;DLNA.ORG_FLAGS=");
+					didl_hex(str, DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_TM_B|DLNA_FLAG_TM_I, 8);
+					didl_hex(str, 0, 24);
+					add_album_art(passed_args, "\" resolution=\"320x320\"&gt;",
+					              album_art, detailID, "&lt;/res&gt;");
 				}
 			} else if( passed_args->filter & FILTER_UPNP_ALBUMARTURI ) {
-				ret = strcatf(str, "&lt;upnp:albumArtURI");
+				didl_lit(str, "&lt;upnp:albumArtURI");
 				if( passed_args->filter & FILTER_UPNP_ALBUMARTURI_DLNA_PROFILEID ) {
-					ret = strcatf(str, " dlna:profileID=\"JPEG_TN\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"");
+					didl_lit(str, " dlna:profileID=\"JPEG_TN\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"");
 				}
-				ret = strcatf(str, "&gt;http://%s:%d/AlbumArt/%s-%s.jpg&lt;/upnp:albumArtURI&gt;",
-				                   lan_addr[passed_args->iface].str, runtime_vars.port, album_art, detailID);
+				add_album_art(passed_args, "&gt;", album_art, detailID, "&lt;/upnp:albumArtURI&gt;");
 			}
 		}
 		if( (passed_args->flags & FLAG_MS_PFS) && *mime == 'i' ) {
 			if( passed_args->client == EMediaRoom && !album )
-				ret = strcatf(str, "&lt;upnp:album&gt;%s&lt;/upnp:album&gt;", "[No Keywords]");
+				didl_lit(str, "&lt;upnp:album&gt;[No Keywords]&lt;/upnp:album&gt;");
 
 			/* EVA2000 doesn't seem to handle embedded thumbnails */
 			if( !(passed_args->flags & FLAG_RESIZE_THUMBS) && NON_ZERO(tn) && IS_ZERO(rotate) ) {
-				ret = strcatf(str, "&lt;upnp:albumArtURI&gt;"
-				                   "http://%s:%d/Thumbnails/%s.jpg"
-				                   "&lt;/upnp:albumArtURI&gt;",
-				                   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
+				didl_lit(str, "&lt;upnp:albumArtURI&gt;");
+				add_url(passed_args, "Thumbnails", detailID, ".jpg");
+				didl_lit(str, "&lt;/upnp:albumArtURI&gt;");
 			} else {
-				ret = strcatf(str, "&lt;upnp:albumArtURI&gt;"
-				                   "http://%s:%d/Resized/%s.jpg?width=160,height=160"
-				                   "&lt;/upnp:albumArtURI&gt;",
-				                   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
+				didl_lit(str, "&lt;upnp:albumArtURI&gt;");
+				add_url(passed_args, "Resized", detailID, ".jpg?width=160,height=160");
+				didl_lit(str, "&lt;/upnp:albumArtURI&gt;");
 			}
 		}
-		ret = strcatf(str, "&lt;/item&gt;");
+		didl_lit(str, "&lt;/item&gt;");
 	}
 	else if( strncmp(class, "container", 9) == 0 )
 	{
-		ret = strcatf(str, "&lt;container id=\"%s\" parentID=\"%s\" restricted=\"1\" ", id, parent);
+		didl_lit(str, "&lt;container id=\"");
+		didl_text(str, id);
+		didl_lit(str, "\" parentID=\"");
+		didl_text(str, parent);
+		didl_lit(str, "\" restricted=\"1\" ");
 		if( passed_args->filter & FILTER_SEARCHABLE ) {
-			ret = strcatf(str, "searchable=\"%d\" ", check_magic_container(id, passed_args->flags) ? 0 : 1);
+			if( check_magic_container(id, passed_args->flags) )
+				didl_lit(str, "searchable=\"0\" ");
+			else
+				didl_lit(str, "searchable=\"1\" ");
 		}
 		if( passed_args->filter & FILTER_CHILDCOUNT ) {
 			if (strcmp(id, PASSWORD_CONTAINER) == 0) {
-				ret = strcatf(str, "childCount=\"%d\"", 10);
+				didl_lit(str, "childCount=\"10\"");
 			} else {
-				ret = strcatf(str, "childCount=\"%d\"", get_child_count(id, check_magic_container(id, passed_args->flags), passed_args->password));
+				struct magic_container_s *magic = check_magic_container(id, passed_args->flags);
+				int count;
+
+				if (!magic && !GETFLAG(SCANNING_MASK) && sqlite3_column_int(stmt, 26) == 0)
+					count = sqlite3_column_int(stmt, 25);
+				else
+					count = get_child_count(passed_args->db, id, magic, passed_args->password);
+				didl_lit(str, "childCount=\"");
+				didl_int(str, count);
+				didl_lit(str, "\"");
 			}
 		}
 		/* If the client calls for BrowseMetadata on root, we have to include our "upnp:searchClass"'s, unless they're filtered out */
 		if( passed_args->requested == 1 && strcmp(id, "0") == 0 && (passed_args->filter & FILTER_UPNP_SEARCHCLASS) ) {
-			ret = strcatf(str, "&gt;"
-			                   "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.audioItem&lt;/upnp:searchClass&gt;"
-			                   "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.imageItem&lt;/upnp:searchClass&gt;"
-			                   "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.videoItem&lt;/upnp:searchClass");
-		}
-		ret = strcatf(str, "&gt;"
-		                   "&lt;dc:title&gt;%s&lt;/dc:title&gt;"
-		                   "&lt;upnp:class&gt;object.%s&lt;/upnp:class&gt;",
-		                   title, class);
+			didl_lit(str, "&gt;"
+			              "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.audioItem&lt;/upnp:searchClass&gt;"
+			              "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.imageItem&lt;/upnp:searchClass&gt;"
+			              "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.videoItem&lt;/upnp:searchClass");
+		}
+		didl_lit(str, "&gt;");
+		didl_tag(str, "dc:title", title);
+		didl_lit(str, "&lt;upnp:class&gt;object.");
+		didl_text(str, class);
+		didl_lit(str, "&lt;/upnp:class&gt;");
 		if( (passed_args->filter & FILTER_UPNP_STORAGEUSED) || strcmp(class+10, "storageFolder") == 0 ) {
 			/* TODO: Implement real folder size tracking */
-			ret = strcatf(str, "&lt;upnp:storageUsed&gt;%s&lt;/upnp:storageUsed&gt;", (size ? size : "-1"));
+			didl_tag(str, "upnp:storageUsed", (size ? size : "-1"));
 		}
 		if( creator && (passed_args->filter & FILTER_DC_CREATOR) ) {
-			ret = strcatf(str, "&lt;dc:creator&gt;%s&lt;/dc:creator&gt;", creator);
+			didl_tag(str, "dc:creator", creator);
 		}
 		if( genre && (passed_args->filter & FILTER_UPNP_GENRE) ) {
-			ret = strcatf(str, "&lt;upnp:genre&gt;%s&lt;/upnp:genre&gt;", genre);
+			didl_tag(str, "upnp:genre", genre);
 		}
 		if( artist && (passed_args->filter & FILTER_UPNP_ARTIST) ) {
-			ret = strcatf(str, "&lt;upnp:artist&gt;%s&lt;/upnp:artist&gt;", artist);
+			didl_tag(str, "upnp:artist", artist);
 		}
 		if( NON_ZERO(album_art) && (passed_args->filter & FILTER_UPNP_ALBUMARTURI) ) {
-			ret = strcatf(str, "&lt;upnp:albumArtURI ");
+			didl_lit(str, "&lt;upnp:albumArtURI ");
 			if( passed_args->filter & FILTER_UPNP_ALBUMARTURI_DLNA_PROFILEID ) {
-				ret = strcatf(str, "dlna:profileID=\"JPEG_TN\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"");
+				didl_lit(str, "dlna:profileID=\"JPEG_TN\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"");
 			}
-			ret = strcatf(str, "&gt;http://%s:%d/AlbumArt/%s-%s.jpg&lt;/upnp:albumArtURI&gt;",
-			                   lan_addr[passed_args->iface].str, runtime_vars.port, album_art, detailID);
+			add_album_art(passed_args, "&gt;", album_art, detailID, "&lt;/upnp:albumArtURI&gt;");
 		}
 		if( passed_args->filter & FILTER_AV_MEDIA_CLASS ) {
 			char class;
@@ -1284,17 +1555,136 @@ callback(void *args, int argc, char **argv, char **azColName)
 				class = 'P';
 			else
 				class = 0;
-			if( class )
-				ret = strcatf(str, "&lt;av:mediaClass xmlns:av=\"urn:schemas-sony-com:av\"&gt;"
-				                    "%c&lt;/av:mediaClass&gt;", class);
+			if( class ) {
+				didl_lit(str, "&lt;av:mediaClass xmlns:av=\"urn:schemas-sony-com:av\"&gt;");
+				strcatn(str, &class, 1);
+				didl_lit(str, "&lt;/av:mediaClass&gt;");
+			}
 		}
-		ret = strcatf(str, "&lt;/container&gt;");
+		didl_lit(str, "&lt;/container&gt;");
 	}
 
 	return 0;
 }
 
+/* Run a cached object query, adding each row to the response */
+static int
+add_objects(struct Response *args, const char *sql, const char *id, const char *glob, int offset, int count)
+{
+	sqlite3_stmt *stmt;
+	char *pw;
+	int ret;
 
+	stmt = sql_prepare_cached(args->db, sql);
+	if (!stmt)
+		return SQLITE_ERROR;
+	pw = password_list(args->password);
+	bind_object_params(stmt, id, glob, pw);
+	sql_bind_int(stmt, ":offset", offset);
+	sql_bind_int(stmt, ":count", count);
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if (callback(args, stmt) != 0)
+		{
+			ret = SQLITE_ABORT;
+			break;
+		}
+	}
+	if (ret == SQLITE_DONE)
+		ret = SQLITE_OK;
+	else if (ret != SQLITE_ABORT)
+		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", sqlite3_errmsg(args->db), sql);
+	sql_release_cached(stmt);
+	free(pw);
+
+	return ret;
+}
+
+
+/* Run a Search's criteria, collecting the rowids of up to count of the
+ * matching objects from offset on, in the order they are to be returned.
+ * Returns how many were collected, or -1 if the query failed. */
+static int
+search_objects(sqlite3 *db, const char *sql, const char *id, const char *glob,
+               const char *password, int offset, int count, int64_t **ids)
+{
+	sqlite3_stmt *stmt;
+	int64_t *list = NULL, *tmp;
+	int n = 0, alloc = 0;
+	char *pw;
+	int ret;
+
+	*ids = NULL;
+	stmt = sql_prepare_cached(db, sql);
+	if (!stmt)
+		return -1;
+	pw = password_list(password);
+	bind_object_params(stmt, id, glob, pw);
+	sql_bind_int(stmt, ":offset", offset);
+	sql_bind_int(stmt, ":count", count);
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if (n == alloc)
+		{
+			alloc = alloc ? alloc * 2 : 256;
+			tmp = realloc(list, alloc * sizeof(*list));
+			if (!tmp)
+			{
+				ret = SQLITE_NOMEM;
+				break;
+			}
+			list = tmp;
+		}
+		list[n++] = sqlite3_column_int64(stmt, 0);
+	}
+	if (ret != SQLITE_DONE)
+	{
+		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", sqlite3_errmsg(db), sql);
+		free(list);
+		list = NULL;
+		n = -1;
+	}
+	sql_release_cached(stmt);
+	free(pw);
+	*ids = list;
+
+	return n;
+}
+
+/* Add the objects with the given rowids to the response, in that order */
+static int
+add_object_list(struct Response *args, const char *sql, const int64_t *ids, int count)
+{
+	sqlite3_stmt *stmt;
+	int i, ret = SQLITE_OK;
+
+	stmt = sql_prepare_cached(args->db, sql);
+	if (!stmt)
+		return SQLITE_ERROR;
+	for (i = 0; i < count; i++)
+	{
+		sqlite3_bind_int64(stmt, 1, ids[i]);
+		ret = sqlite3_step(stmt);
+		/* Gone since the list was made */
+		if (ret == SQLITE_DONE)
+			ret = SQLITE_OK;
+		else if (ret != SQLITE_ROW)
+		{
+			DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", sqlite3_errmsg(args->db), sql);
+			break;
+		}
+		else if (callback(args, stmt) != 0)
+		{
+			ret = SQLITE_ABORT;
+			break;
+		}
+		sqlite3_reset(stmt);
+		ret = SQLITE_OK;
+	}
+	sql_release_cached(stmt);
+
+	return ret;
+}
 
 static void createPasswordPrimaryContainer(struct Response *passed_args, const char *parent)
 {
@@ -1437,7 +1827,6 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			"&lt;DIDL-Lite"
 			CONTENT_DIRECTORY_SCHEMAS;
 	struct magic_container_s *magic;
-	char *zErrMsg = NULL;
 	char *sql, *ptr;
 	struct Response args;
 	struct string_s str;
@@ -1455,6 +1844,10 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	int StartingIndex = 0;
 	int isPasswd = 0;
 	int AddedPasswordContainer=0;
+	char *cache_key = NULL, *cached;
+	size_t cached_len;
+	char columns[512];
+	uint32_t update_id = updateID;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
@@ -1514,6 +1907,11 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	args.str = &str;
 	
 	args.password = h->req_client ? h->req_client->password : NULL;
+	args.db = workers_db();
+	/* A worker thread can wait on the client, so results that don't fit
+	 * in one buffer are streamed out as they are read */
+	if( workers_self() && strcmp(h->HttpVer, "HTTP/1.0") != 0 )
+		args.h = h;
 
 	DPRINTF(E_DEBUG, L_HTTP, "Browsing ContentDirectory:\n"
 	                         " * ObjectID: %s\n"
@@ -1525,6 +1923,23 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 				ObjectID, RequestedCount, StartingIndex,
 	                        BrowseFlag, Filter, SortCriteria);
 
+	/* TVs send the same Browse each time the user goes back into a folder.
+	 * Playback positions change without SystemUpdateID moving on, so
+	 * responses that carry them are always built afresh. */
+	if( !(args.filter & FILTER_BOOKMARK_MASK) &&
+	    asprintf(&cache_key, "%d/%x/%x/%d/%d/%d/%c/%zu:%s/%zu:%s/%s", args.client, args.flags,
+	             args.filter, args.iface, StartingIndex, RequestedCount, BrowseFlag[6],
+	             args.password ? strlen(args.password) : 0, THISORNUL(args.password),
+	             strlen(ObjectID), ObjectID, THISORNUL(SortCriteria)) < 0 )
+		cache_key = NULL;
+	if( cache_key && (cached = browsecache_get(cache_key, &cached_len)) )
+	{
+		BuildSendAndCloseSoapResp(h, cached, cached_len);
+		free(cached);
+		goto browse_error;
+	}
+
+
 	isPasswd = check_password_container(ObjectID);
 
 	if( strcmp(BrowseFlag+6, "Metadata") == 0 )
@@ -1550,11 +1965,13 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 				if (magic->refid_sql)
 					refid_sql = magic->refid_sql;
 			}
-			sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
+			sql = sqlite3_mprintf("SELECT %s, %s, %s, %s "
 				      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-				      " where OBJECT_ID = '%q' and (o.password is null or o.password = '' or o.password in (%s));",
-				      objectid_sql, parentid_sql, refid_sql, id, args.password ? args.password : "''");
-			ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+				      " where OBJECT_ID = :id and " PASSWORD_WHERE("o.") ";",
+				      objectid_sql, parentid_sql, refid_sql,
+				      select_columns(&args, NULL, columns, sizeof(columns)));
+			ret = add_objects(&args, sql, id, NULL, 0, 1);
+			sqlite3_free(sql);
 			totalMatches = args.returned;
 		}
 	}
@@ -1587,7 +2004,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			if (magic->max_count > 0)
 			{
 				int limit = MAX(magic->max_count - StartingIndex, 0);
-				ret = get_child_count(ObjectID, magic, args.password);
+				ret = get_child_count(args.db, ObjectID, magic, args.password);
 				totalMatches = MIN(ret, limit);
 				if (RequestedCount > limit || RequestedCount < 0)
 					RequestedCount = limit;
@@ -1600,11 +2017,11 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 					AddedPasswordContainer=1;
 				}
 
-				sqlite3_snprintf(sizeof(where), where, "PARENT_ID = '%q'", ObjectID);
+				strncpyt(where, "PARENT_ID = :id", sizeof(where));
 		}
 
 		if (!totalMatches) {
-        				totalMatches = get_child_count(ObjectID, magic, args.password) + AddedPasswordContainer;
+        				totalMatches = get_child_count(args.db, ObjectID, magic, args.password) + AddedPasswordContainer;
         }
 
 		ret = 0;
@@ -1646,29 +2063,28 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
             			goto browse_error;
             }
 
-			sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
+			sql = sqlite3_mprintf("SELECT %s, %s, %s, %s "
 		              "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-				      " where (%s and (o.password is null or o.password = '' or o.password in (%s))) %s limit %d, %d;",
+				      " where (%s and " PASSWORD_WHERE("o.") ") %s limit :offset, :count;",
 				      objectid_sql, parentid_sql, refid_sql,
- 				      where, args.password ? args.password : "''", THISORNUL(orderBy), StartingIndex, RequestedCount);
+				      select_columns(&args, orderBy, columns, sizeof(columns)),
+ 				      where, THISORNUL(orderBy));
 			DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s\n", sql);
-			ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+			ret = add_objects(&args, sql, ObjectID, NULL, StartingIndex, RequestedCount);
+			sqlite3_free(sql);
 		}
 	}
 	if (!isPasswd) {
-		if( (ret != SQLITE_OK) && (zErrMsg != NULL) )
+		if( ret != SQLITE_OK && !args.streaming )
 		{
-			DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", zErrMsg, sql);
-			sqlite3_free(zErrMsg);
 			SoapError(h, 709, "Unsupported or invalid sort criteria");
 			goto browse_error;
 		}
 
-		sqlite3_free(sql);
         /* Does the object even exist? */
         if( !totalMatches )
         {
-        		if( !object_exists(ObjectID) )
+        		if( !object_exists(args.db, ObjectID) )
         		{
         			SoapError(h, 701, "No such object error");
         			goto browse_error;
@@ -1682,9 +2098,12 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	                    "<UpdateID>%u</UpdateID>"
 	                    "</u:BrowseResponse>",
 	                    args.returned, totalMatches, updateID);
-	BuildSendAndCloseSoapResp(h, str.data, str.off);
+	if( cache_key && !isPasswd && !args.streaming )
+		browsecache_put(cache_key, update_id, str.data, str.off);
+	SendAndCloseSoapResult(h, &args);
 browse_error:
 	ClearNameValueList(&data);
+	free(cache_key);
 	free(orderBy);
 	free(str.data);
 }
@@ -1701,18 +2120,105 @@ charcat(struct string_s *str, char c)
 	str->off += 1;
 }
 
+/* Translate '<column> contains "term"' into a match against the trigram
+ * text index, when that finds the same rows as the LIKE it replaces: the
+ * tokenizer needs at least 3 characters to match anything, and LIKE would
+ * treat % and _ as wildcards.  "d.<column>" was written to criteria at
+ * col_off, and s points just past the operator.
+ * Returns how much of s was used, or 0 to leave it to LIKE. */
+static int
+add_text_match(struct string_s *criteria, const char *column, size_t col_off,
+               int negate, const char *s)
+{
+	char term[256];
+	const char *p = s;
+	size_t len = 0;
+	int chars = 0;
+	char c;
+
+	/* The column has to be the operand, not something written before it */
+	len = col_off + 2 + strlen(column);
+	if (len > criteria->off)
+		return 0;
+	for (; len < criteria->off; len++)
+	{
+		if (!isspace(criteria->data[len]))
+			return 0;
+	}
+	len = 0;
+
+	while (isspace(*p))
+		p++;
+	if (*p == '"')
+		p++;
+	else if (strncmp(p, "&quot;", 6) == 0)
+		p += 6;
+	else
+		return 0;
+
+	for (;;)
+	{
+		if (*p == '\0' || *p == '\\')
+			return 0;
+		if (*p == '"')
+		{
+			p++;
+			break;
+		}
+		if (strncmp(p, "&quot;", 6) == 0)
+		{
+			p += 6;
+			break;
+		}
+		if (strncmp(p, "&apos;", 6) == 0)
+		{
+			c = '\'';
+			p += 6;
+		}
+		else
+			c = *p++;
+		if (c == '%' || c == '_' || len >= sizeof(term) - 2)
+			return 0;
+		/* The term goes into a quoted SQL string */
+		if (c == '\'')
+			term[len++] = c;
+		term[len++] = c;
+		if ((c & 0xC0) != 0x80)
+			chars++;
+	}
+	if (chars < 3)
+		return 0;
+	term[len] = '\0';
+
+	criteria->off = col_off;
+	/* LIKE is never true for a NULL column, and neither is this */
+	if (negate)
+		strcatf(criteria, "(d.%s is not NULL and o.DETAIL_ID not in", column);
+	else
+		strcatf(criteria, "(o.DETAIL_ID in");
+	strcatf(criteria, " (SELECT rowid from DETAILS_FTS where DETAILS_FTS match '%s:\"%s\"'))",
+		column, term);
+
+	return p - s;
+}
+
 static inline char *
-parse_search_criteria(const char *str, char *sep)
+parse_search_criteria(const char *str, char *sep, int text_index)
 {
 	struct string_s criteria;
 	int len;
-	int literal = 0, like = 0, class = 0;
-	const char *s;
+	int literal = 0, like = 0, class = 0, n;
+	const char *s, *p;
+	const char *text_col = NULL;
+	size_t text_off = 0;
 
 	if (!str)
 		return strdup("1 = 1");
 
 	len = strlen(str) + 32;
+	/* Room for text index matches, which are longer than the LIKE */
+	for (p = str; (p = strstr(p, "ontain")); p++)
+		len += 128;
 	criteria.data = malloc(len);
 	criteria.size = len;
 	criteria.off = 0;
@@ -1851,8 +2357,15 @@ parse_search_criteria(const char *str, char *sep)
 			case 'c':
 				if (strncmp(s, "contains", 8) == 0)
 				{
-					strcatf(&criteria, "like");
 					s += 8;
+					if (text_index && text_col &&
+					    (n = add_text_match(&criteria, text_col, text_off, 0, s)))
+					{
+						s += n;
+						text_col = NULL;
+						continue;
+					}
+					strcatf(&criteria, "like");
 					like = 2;
 					continue;
 				}
@@ -1860,7 +2373,21 @@ parse_search_criteria(const char *str, char *sep)
 					charcat(&criteria, *s);
 				break;
 			case 'd':
-				if (strncmp(s, "derivedfrom", 11) == 0)
+				if (strncmp(s, "doesNotContain", 14) == 0)
+				{
+					s += 14;
+					if (text_index && text_col &&
+					    (n = add_text_match(&criteria, text_col, text_off, 1, s)))
+					{
+						s += n;
+						text_col = NULL;
+						continue;
+					}
+					strcatf(&criteria, "not like");
+					like = 2;
+					continue;
+				}
+				else if (strncmp(s, "derivedfrom", 11) == 0)
 				{
 					strcatf(&criteria, "like");
 					s += 11;
@@ -1875,6 +2402,8 @@ parse_search_criteria(const char *str, char *sep)
 				}
 				else if (strncmp(s, "dc:title", 8) == 0)
 				{
+					text_col = "TITLE";
+					text_off = criteria.off;
 					strcatf(&criteria, "d.TITLE");
 					s += 8;
 					continue;
@@ -1935,24 +2464,32 @@ parse_search_criteria(const char *str, char *sep)
 				}
 				else if (strncmp(s, "upnp:actor", 10) == 0)
 				{
+					text_col = "ARTIST";
+					text_off = criteria.off;
 					strcatf(&criteria, "d.ARTIST");
 					s += 10;
 					continue;
 				}
 				else if (strncmp(s, "upnp:artist", 11) == 0)
 				{
+					text_col = "ARTIST";
+					text_off = criteria.off;
 					strcatf(&criteria, "d.ARTIST");
 					s += 11;
 					continue;
 				}
 				else if (strncmp(s, "upnp:album", 10) == 0)
 				{
+					text_col = "ALBUM";
+					text_off = criteria.off;
 					strcatf(&criteria, "d.ALBUM");
 					s += 10;
 					continue;
 				}
 				else if (strncmp(s, "upnp:genre", 10) == 0)
 				{
+					text_col = "GENRE";
+					text_off = criteria.off;
 					strcatf(&criteria, "d.GENRE");
 					s += 10;
 					continue;
@@ -1992,7 +2529,6 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 			"&lt;DIDL-Lite"
 			CONTENT_DIRECTORY_SCHEMAS;
 	struct magic_container_s *magic;
-	char *zErrMsg = NULL;
 	char *sql, *ptr;
 	struct Response args;
 	struct string_s str;
@@ -2000,11 +2536,17 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	int ret;
 	const char *ContainerID;
 	char *Filter, *SearchCriteria, *SortCriteria;
-	char *orderBy = NULL, *where = NULL, sep[] = "$*";
+	char *orderBy = NULL, *where = NULL, *glob = NULL, sep[] = "$*";
+	char columns[512];
 	char groupBy[] = "group by DETAIL_ID";
+	char *cache_key = NULL, *matches, *count_sql;
+	int64_t *ids = NULL;
+	size_t ids_len, max;
+	int nids, first = 0;
 	struct NameValueParserData data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
+	uint32_t update_id = updateID;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
@@ -2049,6 +2591,9 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	args.flags = h->req_client ? h->req_client->type->flags : 0;
 	args.password = h->req_client ? h->req_client->password : NULL;
 	args.str = &str;
+	args.db = workers_db();
+	if( workers_self() && strcmp(h->HttpVer, "HTTP/1.0") != 0 )
+		args.h = h;
 	DPRINTF(E_DEBUG, L_HTTP, "Searching ContentDirectory:\n"
 	                         " * ObjectID: %s\n"
 	                         " * Count: %d\n"
@@ -2070,59 +2615,106 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	    GETFLAG(DLNA_STRICT_MASK) )
 		groupBy[0] = '\0';
 
-	where = parse_search_criteria(SearchCriteria, sep);
+	where = parse_search_criteria(SearchCriteria, sep, db_has_text_index(args.db));
 	DPRINTF(E_DEBUG, L_HTTP, "Translated SearchCriteria: %s\n", where);
 
-	totalMatches = sql_get_int_field(db, "SELECT (select count(distinct DETAIL_ID)"
-	                                     " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                     " where (OBJECT_ID glob '%q%s') and (%s) and (o.password is null or o.password = '' or o.password in (%s)))"
-	                                     " + "
-	                                     "(select count(*) from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                     " where (OBJECT_ID = '%q') and (%s) and (o.password is null or o.password = '' or o.password in (%s)))",
-	                                     ContainerID, sep, where, args.password ? args.password : "''", ContainerID, where, args.password ? args.password : "''");
-	if( totalMatches < 0 )
+	ret = 0;
+	orderBy = parse_sort_criteria(SortCriteria, &ret);
+	/* If it's a DLNA client, return an error for bad sort criteria */
+	if( ret < 0 && ((args.flags & FLAG_DLNA) || GETFLAG(DLNA_STRICT_MASK)) )
 	{
-		/* Must be invalid SQL, so most likely bad or unhandled search criteria. */
-		SoapError(h, 708, "Unsupported or invalid search criteria");
+		SoapError(h, 709, "Unsupported or invalid sort criteria");
 		goto search_error;
 	}
+
+	/* The criteria are run once per search, and the matching objects kept
+	 * in order; the pages a client then asks for, and totalMatches, come
+	 * from that list until SystemUpdateID changes.  A list too long to be
+	 * kept is not collected at all: the matches are counted, and only the
+	 * page asked for is fetched, as every page would run the query anyway. */
+	ret = asprintf(&cache_key, "S/%zu:%s/%d/%zu:%s/%s/%s", strlen(ContainerID), ContainerID,
+	               groupBy[0] != '\0', args.password ? strlen(args.password) : 0,
+	               args.password ? args.password : "", orderBy ? orderBy : "", where);
+	if( ret < 0 )
+		cache_key = NULL;
+	if( cache_key && (ids = (int64_t *)browsecache_get(cache_key, &ids_len)) )
+	{
+		totalMatches = nids = ids_len / sizeof(*ids);
+	}
+	else
+	{
+		/* Every column that orderBy may use is selected, as the terms of
+		 * a compound SELECT's ORDER BY have to be among its results. */
+		glob = sqlite3_mprintf("%s%s", ContainerID, sep);
+		matches = sqlite3_mprintf("SELECT o.ID, " SEARCH_SORT_COLUMNS
+		                          " from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+		                          " where OBJECT_ID glob :glob and (%s) and " PASSWORD_WHERE("o.") " %s "
+		                          "%z",
+		                          where, groupBy,
+		                          (*ContainerID == '*') ? NULL :
+		                          sqlite3_mprintf("UNION ALL SELECT o.ID, " SEARCH_SORT_COLUMNS
+		                                          " from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+		                                          " where OBJECT_ID = :id and (%s) and " PASSWORD_WHERE("o.") " ", where));
+		sql = sqlite3_mprintf("%s %s limit :offset, :count", matches, THISORNUL(orderBy));
+		DPRINTF(E_DEBUG, L_HTTP, "Search SQL: %s\n", sql);
+		max = cache_key ? browsecache_max_entry() / sizeof(*ids) : 0;
+		/* asking for one more than fits tells a list that is too long */
+		nids = max ? search_objects(args.db, sql, ContainerID, glob, args.password, 0, max + 1, &ids) : -1;
+		if( nids >= 0 && nids <= max )
+		{
+			totalMatches = nids;
+			if( nids )
+				browsecache_put(cache_key, update_id, (char *)ids, nids * sizeof(*ids));
+		}
+		else
+		{
+			free(ids);
+			ids = NULL;
+			nids = 0;
+			count_sql = sqlite3_mprintf("SELECT count(*) from (%s)", matches);
+			totalMatches = count_objects(args.db, count_sql, ContainerID, glob, args.password);
+			sqlite3_free(count_sql);
+			if( totalMatches > 0 && StartingIndex >= 0 && StartingIndex < totalMatches )
+			{
+				nids = search_objects(args.db, sql, ContainerID, glob, args.password,
+				                      StartingIndex, RequestedCount < 0 ? -1 : RequestedCount, &ids);
+				if( nids < 0 )
+					totalMatches = -1;
+				first = StartingIndex;
+			}
+		}
+		sqlite3_free(sql);
+		sqlite3_free(matches);
+		if( totalMatches < 0 )
+		{
+			/* Must be invalid SQL, so most likely bad or unhandled search criteria. */
+			SoapError(h, 708, "Unsupported or invalid search criteria");
+			goto search_error;
+		}
+	}
 	/* Does the object even exist? */
 	if( !totalMatches )
 	{
-		if( !object_exists(ContainerID) )
+		if( !object_exists(args.db, ContainerID) )
 		{
 			SoapError(h, 710, "No such container");
 			goto search_error;
 		}
 	}
-	ret = 0;
-	__SORT_LIMIT
-	orderBy = parse_sort_criteria(SortCriteria, &ret);
-	/* If it's a DLNA client, return an error for bad sort criteria */
-	if( ret < 0 && ((args.flags & FLAG_DLNA) || GETFLAG(DLNA_STRICT_MASK)) )
-	{
-		SoapError(h, 709, "Unsupported or invalid sort criteria");
-		goto search_error;
-	}
 
-	sql = sqlite3_mprintf( SELECT_COLUMNS
+	if( StartingIndex < 0 || StartingIndex > totalMatches )
+		StartingIndex = totalMatches;
+	if( RequestedCount < 0 || RequestedCount > totalMatches - StartingIndex )
+		RequestedCount = totalMatches - StartingIndex;
+	select_columns(&args, NULL, columns, sizeof(columns));
+	sql = sqlite3_mprintf("SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, %s "
 	                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                      " where OBJECT_ID glob '%q%s' and (%s) and (o.password is null or o.password = '' or o.password in (%s)) %s "
-	                      "%z %s"
-	                      " limit %d, %d",
-	                      ContainerID, sep, where, args.password ? args.password : "''", groupBy,
-	                      (*ContainerID == '*') ? NULL :
-	                      sqlite3_mprintf("UNION ALL " SELECT_COLUMNS
-	                                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                                      " where OBJECT_ID = '%q' and (%s) and (o.password is null or o.password = '' or o.password in (%s)) ", ContainerID, where, args.password ? args.password : "''"),
-	                      orderBy, StartingIndex, RequestedCount);
-	DPRINTF(E_DEBUG, L_HTTP, "Search SQL: %s\n", sql);
-	ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
-	if( (ret != SQLITE_OK) && (zErrMsg != NULL) )
-	{
-		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", zErrMsg, sql);
-		sqlite3_free(zErrMsg);
-	}
+	                      " where o.ID = ?", columns);
+	/* ids holds the list from its first entry on */
+	if( RequestedCount > nids - (StartingIndex - first) )
+		RequestedCount = nids - (StartingIndex - first);
+	if( RequestedCount > 0 )
+		add_object_list(&args, sql, ids + (StartingIndex - first), RequestedCount);
 	sqlite3_free(sql);
 	ret = strcatf(&str, "&lt;/DIDL-Lite&gt;</Result>\n"
 	                    "<NumberReturned>%u</NumberReturned>\n"
@@ -2130,9 +2722,12 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	                    "<UpdateID>%u</UpdateID>"
 	                    "</u:SearchResponse>",
 	                    args.returned, totalMatches, updateID);
-	BuildSendAndCloseSoapResp(h, str.data, str.off);
+	SendAndCloseSoapResult(h, &args);
 search_error:
 	ClearNameValueList(&data);
+	free(cache_key);
+	free(ids);
+	sqlite3_free(glob);
 	free(orderBy);
 	free(where);
 	free(str.data);
@@ -2422,27 +3017,47 @@ static const struct
 {
 	const char * methodName;
 	void (*methodImpl)(struct upnphttp *, const char *);
+	int threaded;	/* read-only, may run on a worker thread */
 }
 soapMethods[] =
 {
-	{ "QueryStateVariable", QueryStateVariable},
-	{ "Browse", BrowseContentDirectory},
-	{ "Search", SearchContentDirectory},
-	{ "GetSearchCapabilities", GetSearchCapabilities},
-	{ "GetSortCapabilities", GetSortCapabilities},
-	{ "GetSystemUpdateID", GetSystemUpdateID},
-	{ "GetProtocolInfo", GetProtocolInfo},
-	{ "GetCurrentConnectionIDs", GetCurrentConnectionIDs},
-	{ "GetCurrentConnectionInfo", GetCurrentConnectionInfo},
-	{ "IsAuthorized", IsAuthorizedValidated},
-	{ "IsValidated", IsAuthorizedValidated},
-	{ "RegisterDevice", RegisterDevice},
-	{ "UpdateObject", UpdateObject},
-	{ "X_GetFeatureList", SamsungGetFeatureList},
-	{ "X_SetBookmark", SamsungSetBookmark},
-	{ 0, 0 }
+	{ "QueryStateVariable", QueryStateVariable, 0},
+	{ "Browse", BrowseContentDirectory, 1},
+	{ "Search", SearchContentDirectory, 1},
+	{ "GetSearchCapabilities", GetSearchCapabilities, 0},
+	{ "GetSortCapabilities", GetSortCapabilities, 0},
+	{ "GetSystemUpdateID", GetSystemUpdateID, 0},
+	{ "GetProtocolInfo", GetProtocolInfo, 0},
+	{ "GetCurrentConnectionIDs", GetCurrentConnectionIDs, 0},
+	{ "GetCurrentConnectionInfo", GetCurrentConnectionInfo, 0},
+	{ "IsAuthorized", IsAuthorizedValidated, 0},
+	{ "IsValidated", IsAuthorizedValidated, 0},
+	{ "RegisterDevice", RegisterDevice, 0},
+	{ "UpdateObject", UpdateObject, 0},
+	{ "X_GetFeatureList", SamsungGetFeatureList, 0},
+	{ "X_SetBookmark", SamsungSetBookmark, 0},
+	{ 0, 0, 0 }
 };
 
+/* Browsing the password containers changes the client's password
+ * and sends out events, which has to be done from the event loop. */
+static int
+is_password_request(struct upnphttp * h)
+{
+	struct NameValueParserData data;
+	const char *id;
+	int ret;
+
+	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
+	id = GetValueFromNameValueList(&data, "ObjectID");
+	if( !id )
+		id = GetValueFromNameValueList(&data, "ContainerID");
+	ret = id ? check_password_container(id) : 0;
+	ClearNameValueList(&data);
+
+	return ret;
+}
+
 void
 ExecuteSoapAction(struct upnphttp * h, const char * action, int n)
 {
@@ -2467,6 +3082,16 @@ ExecuteSoapAction(struct upnphttp * h, const char * action, int n)
 			len = strlen(soapMethods[i].methodName);
 			if(strncmp(p, soapMethods[i].methodName, len) == 0)
 			{
+				if(soapMethods[i].threaded && !is_password_request(h))
+				{
+					if(client_admit_request(h->req_client) != ADMIT_OK)
+					{
+						Send503(h);
+						return;
+					}
+					if(workers_queue(h, soapMethods[i].methodImpl, soapMethods[i].methodName) == 0)
+						return;
+				}
 				soapMethods[i].methodImpl(h, soapMethods[i].methodName);
 				return;
 			}
@@ -21,6 +21,8 @@
 #ifndef __UPNPSOAP_H__
 #define __UPNPSOAP_H__
 
+#include <sqlite3.h>
+
 #define DEFAULT_RESP_SIZE 131072
 #define MAX_RESPONSE_SIZE 2097152
 
@@ -46,6 +48,9 @@ struct Response
 	uint32_t flags;
 	enum client_types client;
 	char *password;
+	sqlite3 *db;
+	struct upnphttp *h;	/* set if the result may be streamed */
+	int streaming;		/* the headers have gone out */
 };
 
 /* ExecuteSoapAction():
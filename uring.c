@@ -0,0 +1,306 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#ifdef HAVE_LIBURING
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <liburing.h>
+
+#include "event.h"
+#include "uring.h"
+#include "readahead.h"
+#include "log.h"
+
+#define URING_ENTRIES     256
+#define URING_BUFFER_SIZE 131072
+#define URING_STALL       300	/* seconds a peer may stop reading before we give up */
+
+/* Each transfer alternates between reading a buffer's worth of the file
+ * and sending it.  Both are queued on the ring and submitted together,
+ * once per pass of the main loop, for all the transfers in progress. */
+struct uring_xfer {
+	int sock;
+	int fd;
+	off_t offset;		/* next offset to read */
+	off_t end;
+	char *buf;
+	int buflen;		/* bytes read into buf */
+	int bufoff;		/* bytes of buf already sent */
+	int sending;
+	int stalled;
+	time_t progress;	/* when the last read or send completed */
+	struct readahead ra;
+	uring_done_t *done;
+	void *data;
+	LIST_ENTRY(uring_xfer) entries;
+};
+
+static struct io_uring ring;
+static int ring_ok = 0;
+static struct event ring_ev;
+static LIST_HEAD(, uring_xfer) xfers = LIST_HEAD_INITIALIZER(xfers);
+
+static struct io_uring_sqe *
+get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ring);
+	if (!sqe)
+	{
+		/* submission queue full, so flush it early */
+		io_uring_submit(&ring);
+		sqe = io_uring_get_sqe(&ring);
+	}
+	return sqe;
+}
+
+static int
+queue_next(struct uring_xfer *x)
+{
+	struct io_uring_sqe *sqe;
+	off_t len;
+
+	sqe = get_sqe();
+	if (!sqe)
+		return -1;
+	if (x->bufoff < x->buflen)
+	{
+		io_uring_prep_send(sqe, x->sock, x->buf + x->bufoff,
+		                   x->buflen - x->bufoff, MSG_NOSIGNAL);
+		x->sending = 1;
+	}
+	else
+	{
+		len = x->end - x->offset + 1;
+		if (len > URING_BUFFER_SIZE)
+			len = URING_BUFFER_SIZE;
+		io_uring_prep_read(sqe, x->fd, x->buf, len, x->offset);
+		x->sending = 0;
+	}
+	io_uring_sqe_set_data(sqe, x);
+
+	return 0;
+}
+
+static void
+finish(struct uring_xfer *x, int error)
+{
+	LIST_REMOVE(x, entries);
+	x->done(x->data, x->offset - (x->buflen - x->bufoff), error);
+	free(x->buf);
+	free(x);
+}
+
+static void
+complete(struct uring_xfer *x, int res)
+{
+	if (res > 0)
+		x->progress = time(NULL);
+	if (res == -EINTR || res == -EAGAIN)
+		res = 0;
+	else if (res < 0)
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "%s error :: error no. %d [%s]\n",
+			x->sending ? "send" : "read", -res, strerror(-res));
+		finish(x, -res);
+		return;
+	}
+	else if (x->sending)
+		x->bufoff += res;
+	else if (res == 0)
+	{
+		DPRINTF(E_WARN, L_HTTP, "Unexpected end of file at offset %jd\n", (intmax_t)x->offset);
+		finish(x, EIO);
+		return;
+	}
+	else
+	{
+		readahead_update(&x->ra, x->fd, x->offset, res);
+		x->buflen = res;
+		x->bufoff = 0;
+		x->offset += res;
+	}
+
+	if (x->bufoff >= x->buflen && x->offset > x->end)
+		finish(x, 0);
+	else if (queue_next(x) != 0)
+		finish(x, EBUSY);
+}
+
+static void
+process_ring(struct event *ev)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_xfer *x;
+	uint64_t count;
+	int res;
+
+	if (read(ev->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		DPRINTF(E_ERROR, L_HTTP, "read(eventfd): %s\n", strerror(errno));
+
+	while (io_uring_peek_cqe(&ring, &cqe) == 0)
+	{
+		x = io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		io_uring_cqe_seen(&ring, cqe);
+		complete(x, res);
+	}
+}
+
+int
+uring_init(void)
+{
+	struct io_uring_probe *probe;
+	int ret, fd;
+
+	ret = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+	if (ret < 0)
+	{
+		DPRINTF(E_INFO, L_GENERAL, "io_uring unavailable (%s), using sendfile\n", strerror(-ret));
+		return -1;
+	}
+	probe = io_uring_get_probe_ring(&ring);
+	if (!probe ||
+	    !io_uring_opcode_supported(probe, IORING_OP_READ) ||
+	    !io_uring_opcode_supported(probe, IORING_OP_SEND))
+	{
+		DPRINTF(E_INFO, L_GENERAL, "io_uring lacks read/send support, using sendfile\n");
+		if (probe)
+			io_uring_free_probe(probe);
+		io_uring_queue_exit(&ring);
+		return -1;
+	}
+	io_uring_free_probe(probe);
+
+	fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (fd < 0 || io_uring_register_eventfd(&ring, fd) < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Failed to set up io_uring eventfd: %s\n", strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		io_uring_queue_exit(&ring);
+		return -1;
+	}
+	ring_ev = (struct event ){ .fd = fd, .rdwr = EVENT_READ, .process = process_ring };
+	event_module.add(&ring_ev);
+	ring_ok = 1;
+	DPRINTF(E_INFO, L_GENERAL, "Streaming files through io_uring\n");
+
+	return 0;
+}
+
+void
+uring_fini(void)
+{
+	if (!ring_ok)
+		return;
+	ring_ok = 0;
+	/* cancels and waits for whatever is still in flight */
+	io_uring_queue_exit(&ring);
+	while (!LIST_EMPTY(&xfers))
+		finish(LIST_FIRST(&xfers), ECANCELED);
+	event_module.del(&ring_ev, 0);
+	close(ring_ev.fd);
+}
+
+void
+uring_submit(void)
+{
+	int ret;
+
+	if (!ring_ok || !io_uring_sq_ready(&ring))
+		return;
+	ret = io_uring_submit(&ring);
+	if (ret < 0)
+		DPRINTF(E_ERROR, L_HTTP, "io_uring_submit: %s\n", strerror(-ret));
+}
+
+/* A blocking send to a peer that has stopped reading never completes,
+ * and would hold its ring entry, buffer and socket for good.  Shutting
+ * the socket down makes it fail, so the transfer ends as on any other
+ * error.  Returns when the next transfer would stall, or 0. */
+time_t
+uring_expire(time_t now)
+{
+	struct uring_xfer *x;
+	time_t deadline = 0;
+
+	LIST_FOREACH(x, &xfers, entries)
+	{
+		if (x->stalled)
+			continue;
+		if (now - x->progress >= URING_STALL)
+		{
+			DPRINTF(E_WARN, L_HTTP, "Transfer stalled for %d seconds, giving up\n", URING_STALL);
+			shutdown(x->sock, SHUT_RDWR);
+			x->stalled = 1;
+		}
+		else if (!deadline || x->progress + URING_STALL < deadline)
+			deadline = x->progress + URING_STALL;
+	}
+
+	return deadline;
+}
+
+int
+uring_send_file(int sock, int fd, off_t offset, off_t end_offset,
+                uring_done_t *done, void *data)
+{
+	struct uring_xfer *x;
+
+	if (!ring_ok)
+		return -1;
+	x = calloc(1, sizeof(*x));
+	if (!x)
+		return -1;
+	x->buf = malloc(URING_BUFFER_SIZE);
+	if (!x->buf)
+	{
+		free(x);
+		return -1;
+	}
+	x->sock = sock;
+	x->fd = fd;
+	x->offset = offset;
+	x->end = end_offset;
+	x->done = done;
+	x->data = data;
+	x->progress = time(NULL);
+	readahead_start(&x->ra, fd, offset);
+	if (queue_next(x) != 0)
+	{
+		free(x->buf);
+		free(x);
+		return -1;
+	}
+	LIST_INSERT_HEAD(&xfers, x, entries);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,46 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <time.h>
+
+/* called once a transfer is over, with the offset reached in the
+ * file and 0 or an errno value */
+typedef void uring_done_t(void *data, off_t offset, int error);
+
+#ifdef HAVE_LIBURING
+int uring_init(void);
+void uring_fini(void);
+void uring_submit(void);
+int uring_send_file(int sock, int fd, off_t offset, off_t end_offset,
+                    uring_done_t *done, void *data);
+time_t uring_expire(time_t now);
+#else
+static inline int uring_init(void) { return -1; }
+static inline void uring_fini(void) {}
+static inline void uring_submit(void) {}
+static inline int uring_send_file(int sock, int fd, off_t offset, off_t end_offset,
+                                  uring_done_t *done, void *data) { return -1; }
+static inline time_t uring_expire(time_t now) { return 0; }
+#endif
+
+#endif
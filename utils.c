@@ -29,10 +29,13 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "minidlnatypes.h"
 #include "upnpglobalvars.h"
 #include "utils.h"
+#include "didl.h"
 #include "log.h"
 
 int
@@ -211,23 +214,25 @@ unescape_tag(const char *tag, int force_alloc)
 	return esc_tag;
 }
 
+/* Escape once into an exactly sized buffer, rather than strdup()ing and
+ * growing it with a modifyString() pass per character. */
 char *
 escape_tag(const char *tag, int force_alloc)
 {
-	char *esc_tag = NULL;
+	struct string_s str;
+	size_t len = strlen(tag);
 
-	if( strchr(tag, '&') || strchr(tag, '<') || strchr(tag, '>') || strchr(tag, '"') )
-	{
-		esc_tag = strdup(tag);
-		esc_tag = modifyString(esc_tag, "&", "&amp;amp;", 0);
-		esc_tag = modifyString(esc_tag, "<", "&amp;lt;", 0);
-		esc_tag = modifyString(esc_tag, ">", "&amp;gt;", 0);
-		esc_tag = modifyString(esc_tag, "\"", "&amp;quot;", 0);
-	}
-	else if( force_alloc )
-		esc_tag = strdup(tag);
+	if( xml_special_span(tag, len) == len )
+		return force_alloc ? strdup(tag) : NULL;
 
-	return esc_tag;
+	str.size = xml_escaped_len(tag, len) + 1;
+	str.data = malloc(str.size);
+	if( !str.data )
+		return NULL;
+	str.off = 0;
+	didl_escape(&str, tag, len);
+
+	return str.data;
 }
 
 char *
@@ -574,3 +579,73 @@ timevalfix(struct timeval *t1)
 		t1->tv_usec -= 1000000;
 	}
 }
+
+static const char http_days[7][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char http_months[12][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                         "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/* Format t in the RFC 1123 format used by HTTP headers.
+ * buf must hold HTTP_DATE_LEN + 1 bytes. */
+int
+http_time(char *buf, time_t t)
+{
+	struct tm tm;
+
+	/* only years of four digits give exactly HTTP_DATE_LEN characters */
+	gmtime_r(&t, &tm);
+	if (snprintf(buf, HTTP_DATE_LEN + 1, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+		http_days[tm.tm_wday], tm.tm_mday, http_months[tm.tm_mon], tm.tm_year + 1900,
+		tm.tm_hour, tm.tm_min, tm.tm_sec) < HTTP_DATE_LEN)
+		return strlen(buf);
+
+	return HTTP_DATE_LEN;
+}
+
+/* Current time in the RFC 1123 format.  It only changes once a
+ * second, so it is formatted once and then copied out. */
+int
+http_date(char *buf)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static char date[HTTP_DATE_LEN + 1];
+	static time_t cached = 0;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&lock);
+	if (now != cached)
+	{
+		http_time(date, now);
+		cached = now;
+	}
+	memcpy(buf, date, sizeof(date));
+	pthread_mutex_unlock(&lock);
+
+	return HTTP_DATE_LEN;
+}
+
+/* Parse an RFC 1123 date, as sent in If-Modified-Since.
+ * Returns 0 if it isn't one. */
+time_t
+parse_http_date(const char *str)
+{
+	char mon[4];
+	int day, year, hour, min, sec, m, y;
+	long days;
+
+	if (sscanf(str, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT",
+	           &day, mon, &year, &hour, &min, &sec) != 6)
+		return 0;
+	for (m = 0; m < 12; m++)
+		if (strcmp(mon, http_months[m]) == 0)
+			break;
+	if (m == 12 || year < 1970)
+		return 0;
+
+	/* days since the epoch, counting years from March so that
+	 * the leap day comes last */
+	y = year - (m < 2);
+	days = 365L * y + y / 4 - y / 100 + y / 400 +
+	       (153 * (m + (m < 2 ? 10 : -2)) + 2) / 5 + day - 1 - 719468;
+
+	return (time_t)days * 86400 + hour * 3600 + min * 60 + sec;
+}
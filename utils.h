@@ -25,6 +25,7 @@
 #define __UTILS_H__
 
 #include <stdarg.h>
+#include <string.h>
 #include <dirent.h>
 #include <sys/param.h>
 
@@ -51,6 +52,27 @@ strcatf(struct string_s *str, const char *fmt, ...)
 
 	return ret;
 }
+/* Append a string of known length, without going through vsnprintf().
+ * Truncates like strcatf(): the result is always NUL-terminated, and
+ * off reaches size once the string no longer fits. */
+static inline int
+strcatn(struct string_s *str, const char *s, int len)
+{
+	int size, n;
+
+	if (str->off >= str->size)
+		return 0;
+
+	/* never copy more than len, so s can be a buffer of exactly len */
+	size = str->size - str->off;
+	n = MIN(len, size - 1);
+	memcpy(str->data + str->off, s, n);
+	str->data[str->off + n] = '\0';
+	str->off += MIN(len, size);
+
+	return len;
+}
+#define strcats(str, s) strcatn(str, s, sizeof(s) - 1)
 static inline void strncpyt(char *dst, const char *src, size_t len)
 {
 	strncpy(dst, src, len);
@@ -99,6 +121,10 @@ const char *mime_to_ext(const char * mime);
 
 /* Others */
 int make_dir(char * path, mode_t mode);
+#define HTTP_DATE_LEN 29
+int http_date(char *buf);
+int http_time(char *buf, time_t t);
+time_t parse_http_date(const char *str);
 unsigned int DJBHash(uint8_t *data, int len);
 
 /* Timeval manipulations */
@@ -0,0 +1,335 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "event.h"
+#include "upnpglobalvars.h"
+#include "upnphttp.h"
+#include "workers.h"
+#include "sql.h"
+#include "log.h"
+
+#define MAX_WORKERS 8
+
+struct worker_job {
+	struct upnphttp *h;
+	worker_job_t *run;
+	const char *action;
+	struct client_cache_s *client;	/* restored once the job is done */
+	struct client_cache_s client_copy;
+	struct worker_job *next;
+};
+
+static pthread_t *workers;
+static int n_workers;
+static int quitting_workers;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct worker_job *pending_head, **pending_tail = &pending_head;
+static struct worker_job *done_head, **done_tail = &done_head;
+static pthread_key_t db_key;
+static int done_pipe[2] = { -1, -1 };
+static struct event done_ev;
+
+static sqlite3 *
+open_readonly_db(void)
+{
+	char path[PATH_MAX];
+	sqlite3 *rdb = NULL;
+
+	snprintf(path, sizeof(path), "%s/files.db", db_path);
+	if (sqlite3_open_v2(path, &rdb, SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Worker failed to open %s: %s\n",
+			path, rdb ? sqlite3_errmsg(rdb) : "out of memory");
+		sqlite3_close(rdb);
+		return NULL;
+	}
+	sqlite3_busy_timeout(rdb, 5000);
+	sql_exec(rdb, "pragma cache_size = 2048;");
+
+	return rdb;
+}
+
+static void *
+worker_thread(void *arg)
+{
+	struct worker_job *job;
+	sqlite3 *rdb = arg;
+	sigset_t set;
+	char c = 0;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_setspecific(db_key, rdb);
+
+	pthread_mutex_lock(&queue_lock);
+	while (!quitting_workers)
+	{
+		job = pending_head;
+		if (!job)
+		{
+			pthread_cond_wait(&queue_cond, &queue_lock);
+			continue;
+		}
+		pending_head = job->next;
+		if (!pending_head)
+			pending_tail = &pending_head;
+		pthread_mutex_unlock(&queue_lock);
+
+		job->run(job->h, job->action);
+
+		pthread_mutex_lock(&queue_lock);
+		job->next = NULL;
+		*done_tail = job;
+		done_tail = &job->next;
+		if (write(done_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+			DPRINTF(E_ERROR, L_GENERAL, "write(done_pipe): %s\n", strerror(errno));
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	pthread_setspecific(db_key, NULL);
+	sql_flush_cached(rdb);
+	sqlite3_close(rdb);
+
+	return NULL;
+}
+
+/* Hand the connection back to the event loop */
+static void
+finish_job(struct worker_job *job, int resume)
+{
+	struct upnphttp *h = job->h;
+
+	free(job->client_copy.password);
+	h->req_client = job->client;
+	if (job->client && job->client->requests > 0)
+		job->client->requests--;
+	free(job);
+
+	if (resume)
+	{
+		event_module.add(&h->ev);
+		Resume_upnphttp(h);
+	}
+}
+
+static void
+process_done(struct event *ev)
+{
+	struct worker_job *job, *next;
+	char buf[64];
+
+	while (read(ev->fd, buf, sizeof(buf)) > 0)
+		continue;
+
+	pthread_mutex_lock(&queue_lock);
+	job = done_head;
+	done_head = NULL;
+	done_tail = &done_head;
+	pthread_mutex_unlock(&queue_lock);
+
+	for (; job; job = next)
+	{
+		next = job->next;
+		finish_job(job, 1);
+	}
+}
+
+int
+workers_init(int threads)
+{
+	sqlite3 *rdb;
+	int i, flags;
+
+	if (threads < 0)
+	{
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads > MAX_WORKERS)
+			threads = MAX_WORKERS;
+	}
+	if (threads <= 0)
+		return 0;
+	if (!sqlite3_threadsafe() || sqlite3_libversion_number() < 3005001)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "SQLite library is not threadsafe!  "
+		                            "Worker threads will be disabled.\n");
+		return 0;
+	}
+
+	if (pthread_key_create(&db_key, NULL) != 0)
+		return 0;
+	if (pipe(done_pipe) < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "pipe(): %s\n", strerror(errno));
+		pthread_key_delete(db_key);
+		return 0;
+	}
+	for (i = 0; i < 2; i++)
+	{
+		flags = fcntl(done_pipe[i], F_GETFL, 0);
+		fcntl(done_pipe[i], F_SETFL, flags | O_NONBLOCK);
+		fcntl(done_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+	done_ev = (struct event ){ .fd = done_pipe[0], .rdwr = EVENT_READ, .process = process_done };
+	event_module.add(&done_ev);
+
+	workers = calloc(threads, sizeof(pthread_t));
+	quitting_workers = 0;
+	for (i = 0; workers && i < threads; i++)
+	{
+		/* A worker never falls back to the main connection, so one
+		 * that can't have its own is not started at all */
+		rdb = open_readonly_db();
+		if (!rdb)
+			break;
+		if (pthread_create(&workers[n_workers], NULL, worker_thread, rdb) != 0)
+		{
+			DPRINTF(E_ERROR, L_GENERAL, "pthread_create() failed for worker thread: %s\n",
+				strerror(errno));
+			sqlite3_close(rdb);
+			break;
+		}
+		n_workers++;
+	}
+	if (!n_workers)
+	{
+		workers_fini();
+		return 0;
+	}
+	DPRINTF(E_INFO, L_GENERAL, "Started %d worker thread%s\n",
+		n_workers, n_workers == 1 ? "" : "s");
+
+	return n_workers;
+}
+
+void
+workers_fini(void)
+{
+	struct worker_job *job, *next;
+	int i;
+
+	if (done_pipe[0] < 0)
+		return;
+
+	pthread_mutex_lock(&queue_lock);
+	quitting_workers = 1;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	for (i = 0; i < n_workers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	workers = NULL;
+	n_workers = 0;
+
+	/* Connections are left in state 5, for Delete_upnphttp() to close */
+	for (job = pending_head; job; job = next)
+	{
+		next = job->next;
+		finish_job(job, 0);
+	}
+	pending_head = NULL;
+	pending_tail = &pending_head;
+	for (job = done_head; job; job = next)
+	{
+		next = job->next;
+		finish_job(job, 0);
+	}
+	done_head = NULL;
+	done_tail = &done_head;
+
+	event_module.del(&done_ev, 0);
+	close(done_pipe[0]);
+	close(done_pipe[1]);
+	done_pipe[0] = done_pipe[1] = -1;
+	pthread_key_delete(db_key);
+}
+
+int
+workers_queue(struct upnphttp *h, worker_job_t *run, const char *action)
+{
+	struct worker_job *job;
+
+	if (!n_workers)
+		return -1;
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -1;
+	job->h = h;
+	job->run = run;
+	job->action = action;
+	/* The client cache entry may be changed or reused while the job runs */
+	job->client = h->req_client;
+	if (h->req_client)
+	{
+		h->req_client->requests++;
+		job->client_copy = *h->req_client;
+		if (h->req_client->password)
+			job->client_copy.password = strdup(h->req_client->password);
+		h->req_client = &job->client_copy;
+	}
+
+	event_module.del(&h->ev, 0);
+	h->state = 5;
+
+	pthread_mutex_lock(&queue_lock);
+	*pending_tail = job;
+	pending_tail = &job->next;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	return 0;
+}
+
+sqlite3 *
+workers_db(void)
+{
+	sqlite3 *rdb;
+
+	if (!n_workers)
+		return db;
+	/* every worker has its own; only the event loop has none */
+	rdb = pthread_getspecific(db_key);
+
+	return rdb ? rdb : db;
+}
+
+int
+workers_self(void)
+{
+	int i;
+
+	for (i = 0; i < n_workers; i++)
+	{
+		if (pthread_equal(workers[i], pthread_self()))
+			return 1;
+	}
+
+	return 0;
+}
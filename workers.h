@@ -0,0 +1,58 @@
+/* MiniDLNA media server
+ * Copyright (C) 2026  MiniDLNA project
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#include <sqlite3.h>
+
+struct upnphttp;
+
+typedef void worker_job_t(struct upnphttp *, const char *);
+
+/* workers_init()
+ * start the pool of worker threads, each with its own read-only
+ * database connection.  A thread is only started once its connection
+ * is open.  returns the number of threads started */
+int
+workers_init(int threads);
+
+/* workers_fini()
+ * stop the worker threads.  Requests that were still queued are
+ * abandoned, and their connections closed by Delete_upnphttp() */
+void
+workers_fini(void);
+
+/* workers_queue()
+ * run job(h, action) on a worker thread.  The connection is taken out
+ * of the event loop meanwhile, and the response the job built is sent
+ * from the event loop once it is done.
+ * returns 0 on success, -1 if the job has to run on the caller's thread */
+int
+workers_queue(struct upnphttp *h, worker_job_t *job, const char *action);
+
+/* workers_db()
+ * database connection to be used by the calling thread */
+sqlite3 *
+workers_db(void);
+
+/* workers_self()
+ * returns 1 if called from one of the worker threads */
+int
+workers_self(void);
+
+#endif